@@ -5,17 +5,105 @@
 #include "status_panel.h"
 #include "dorbo_utils.h"
 #include "cli.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "event_log.h"
+#include "tx_queue.h"
+#include "tick.h"
 
 // For testing millis() rollover.
 extern volatile unsigned long timer0_millis;
 
+static void check_credential(struct wiegand_frame * frame) {
+  struct wiegand_credential cred;
+  if (!wiegand_frame_decode(frame, &cred)) {
+    PL("frame invalid");
+    return;
+  }
+  P_WIEGAND_CREDENTIAL(cred);
+  PL();
+  STATS_START(lookup_started);
+  boolean found = storage_find_credential(&cred);
+  STATS_RECORD(STATS_LOOKUP_DURATION, micros() - lookup_started);
+  if (found) {
+    PL("credential good");
+    door_open(frame->reader_num);
+    STATS_RECORD(STATS_UNLOCK_LATENCY, millis() - frame->captured);
+    STATS_COUNT(STATS_GRANTS);
+    cli_push_event(event_log_add(frame->reader_num, &cred, EVENT_GRANTED));
+  } else {
+    PL("credential bad");
+    STATS_COUNT(STATS_DENIALS);
+    cli_push_event(event_log_add(frame->reader_num, &cred, EVENT_DENIED));
+  }
+}
+
+// Checks every presented credential waiting, so none waits for the lower
+// priority tasks of the pass.  The frame queue bounds the work.
+byte credentials_task() {
+  wiegand_readers_loop();
+  struct wiegand_frame frame;
+  while (wiegand_next_frame(&frame)) {
+    check_credential(&frame);
+  }
+  return TASK_DONE;
+}
+
+// Strike states last reported to the host
+static boolean doors_open[NUM_DOORS];
+
+byte door_task() {
+  door_loop();
+  for (byte i = 0; i < NUM_DOORS; i++) {
+    boolean open = door_open_remaining_ms(i) > 0;
+    if (open != doors_open[i]) {
+      doors_open[i] = open;
+      cli_push_door(i, open);
+    }
+  }
+  return TASK_DONE;
+}
+
+byte cli_task() {
+  cli_loop();
+  return cli_busy() ? TASK_YIELD : TASK_DONE;
+}
+
+byte event_log_task() {
+  return event_log_loop() ? TASK_YIELD : TASK_DONE;
+}
+
+byte tx_task() {
+  tx_queue_loop();
+  return TASK_DONE;
+}
+
+byte filter_task() {
+  storage_refresh_wiegand26_filter();
+  return TASK_DONE;
+}
+
+byte status_panel_task() {
+  status_panel_loop();
+  return status_panel_pending() ? TASK_YIELD : TASK_DONE;
+}
+
 void setup() {
+  tick_init();
   Serial.begin(115200);
+  tx_queue_init();
+
+  storage_init();
+  PL("storage initialized");
+
+  event_log_init();
+  PL("event log initialized");
 
   status_panel_init();
   PL("status panel initialized");
   
   door_init();
+  memset(doors_open, 0, sizeof(doors_open));
   PL("doors initialized");
 
   wiegand_readers_init();
@@ -23,32 +111,28 @@ void setup() {
 
   cli_init();
   PL("cli initialized");
+
+  // Presented credentials and the strikes they open come first: each pass
+  // checks every frame waiting and opens their strikes before the CLI,
+  // saving the event log, the panel and rebuilding the filter get a turn.
+  scheduler_init();
+  scheduler_add_task("wiegand", credentials_task, 0, 0, 2000);
+  scheduler_add_task("door", door_task, 1, 0, 200);
+  scheduler_add_task("cli", cli_task, 2, 0, 10000);
+  scheduler_add_task("log", event_log_task, 3, 0, 8000);
+  scheduler_add_task("panel", status_panel_task, 4, STATUS_PANEL_PERIOD_MS, 2000);
+  scheduler_add_task("filter", filter_task, 4, WIEGAND26_FILTER_REBUILD_MS, 10000);
+  // Last, so output from the tasks above goes out in the same pass
+  scheduler_add_task("tx", tx_task, 5, 0, 500);
+  PL("scheduler initialized");
+  tx_queue_flush();
   
   // For testing millis() rollover.
   //timer0_millis = -5000;
 }
 
 void loop() {
-  status_panel_loop();
-  door_loop();
-  cli_loop();
-
-  // See if any credentials have been presented on the readers.  
-  struct wiegand26_credential cred;
-  cred.facility = 0;
-  cred.user = 0;
-  for (byte i = 0; i < NUM_WIEGAND_READERS; i++) {
-    if (wiegand_reader_get_wiegand26(i, &cred)) {
-      P_WIEGAND26_CREDENTIAL(cred);
-      PL();
-      if (storage_find_wiegand26_credential(&cred)) {
-        PL("credential good");
-        door_open(i);
-      } else {
-        PL("credential bad");
-      }
-    }
-  }
+  STATS_LOOP_STARTED();
+  tick_update();
+  scheduler_loop();
 }
-
-
@@ -2,6 +2,11 @@
 #include "wiegand.h"
 #include "storage.h"
 #include "door.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "event_log.h"
+#include "tx_queue.h"
+#include "tick.h"
 
 //////////////////////////////////////////////////////////////////////////////
 // Command Line Interface Syntax
@@ -14,10 +19,14 @@
 // "r w26 3"            Read a 26-bit Wiegand credential from index 3.
 //                      w26 codes contain only 24-bits of identity information
 //                      (2 bits of parity are used on the wire).
+// "r w37 3"            Read a 37-bit Wiegand credential from index 3.
+//
+// Types are w26, w34, w35 and w37.  Types with no storage configured in 
+// config.h are invalid.
 //
 // Output: 
 //
-// w26: "<index> <facility> <user>"
+// "<index> <facility> <user>"
 //
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -29,8 +38,62 @@
 //                      decimal facility code 103, decimal user code 26441
 //                      w26 codes contain only 24-bits of identity information
 //                      (2 bits of parity are used on the wire).
-// "w x99 125 99123141" Write a 32-bit (hypothetical) Wizard-99 credential 
-//                      type to index 125 with decimal data "99123141"
+// "w w34 2 4000 60000" Write a 34-bit Wiegand credential to index 2 with 
+//                      facility code 4000, user code 60000.  The codes must 
+//                      fit the format's fields (w34: 16 and 16 bits, w35: 12
+//                      and 20 bits, w37: 16 and 19 bits).
+//
+//////////////////////////////////////////////////////////////////////////////
+//
+// Add Credential
+//
+// "a <type-str> {type-specific}"
+//
+// "a w26 103 26441"    Store a 26-bit Wiegand credential with decimal 
+//                      facility code 103, decimal user code 26441 in a free
+//                      index, unless it is already stored.  Use this (and 
+//                      "d") to manage credentials when the hashed or grouped
+//                      storage layout is configured.
+//
+// Output:
+//
+// "<index> <facility> <user>"
+//
+//////////////////////////////////////////////////////////////////////////////
+//
+// Delete Credential
+//
+// "d <type-str> {type-specific}"
+//
+// "d w26 103 26441"    Remove the 26-bit Wiegand credential with decimal 
+//                      facility code 103, decimal user code 26441 from the
+//                      index that holds it.
+//
+// Output:
+//
+// "<index> <facility> <user>"
+//
+//////////////////////////////////////////////////////////////////////////////
+//
+// Credential Rules
+//
+// The r26 type holds WIEGAND26_MAX_RULES rules, each granting or denying a
+// range of 26-bit Wiegand user codes of one facility.  They are checked
+// before the stored w26 credentials, and a deny rule wins over everything
+// else.  "r", "w", "l", "x", "a" and "d" take r26 like a credential type:
+//
+// "w r26 0 allow 103 1000 1199"  Grant users 1000 to 1199 of facility 103.
+// "w r26 1 allow 104"            Grant every user of facility 104.
+// "w r26 2 deny 103 1042"        Deny user 1042 of facility 103, a lost fob,
+//                                even though rule 0 grants it.
+// "w r26 3 none"                 Free index 3.
+// "a r26 deny 103 1042"          Store a rule in a free index, unless it is
+//                                already stored.
+// "d r26 deny 103 1042"          Remove a rule from the index that holds it.
+//
+// Output ("r", "l", "a" and "d"):
+//
+// "<index> allow|deny|none <facility> <first-user> <last-user>"
 //
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -44,7 +107,12 @@
 //
 // Output: 
 //
-// w26: "<index> <facility> <user>"...
+// "<index> <facility> <user>"...
+//
+// Listing prints a few slots per loop iteration, as the output queue has 
+// room, so doors and readers keep working.  Further input waits until it 
+// prints "ok".  Meanwhile, the events and debug traces of badges read
+// during the listing can arrive between slot lines.
 //
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -53,7 +121,13 @@
 // "x <type-str>"
 //
 // "x w26"              Writes a 26-bit Wiegand credential of facility code 0, 
-//                      user code 0, to all indexes
+//                      user code 0, to all indexes that aren't already empty
+//
+// Clearing runs a few slots per loop iteration so doors and readers keep 
+// working.  Further input waits until it prints "ok".
+//
+// A command that can't read or write EEPROM prints "storage failed" and
+// "err", even if it printed other output first.
 //
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -63,7 +137,145 @@
 //
 // Output: 
 //
-// "w26 <max-w26-credentials>"
+// "<type> <max-credentials> <layout>"... for each enabled type, where layout
+// is "flat", "hash" or "group", then "r26 <max-rules> rule" unless rules
+// are disabled
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Credential Filter Info
+//
+// "f"
+//
+// Output: 
+//
+// "w26 <set-bits> <filter-bits> <rejected> <false-positives>"
+//
+// The fill ratio is set-bits / filter-bits.  rejected counts credentials the
+// RAM filter turned away without reading EEPROM, and false-positives counts
+// credentials that got past the filter but were not stored.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Reader Queue Info
+//
+// "q"
+//
+// Output: 
+//
+// "<frames-waiting> <frames-dropped>"
+//
+// frames-dropped counts complete frames lost because the reader queue was 
+// full.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Reader Sampling Info
+//
+// "s"                  Print the CPU time spent sampling the reader lines.
+// "s reset"            Print it, then forget the peaks.
+//
+// Output: 
+//
+// "<sample-us> <duty> <peak-duty> <peak-sample-ns>"
+//
+// duty is the share of the CPU the sampling interrupt took over the last few
+// thousand samples, in hundredths of a percent, and peak-duty the largest
+// share since the last reset.  peak-sample-ns is the longest single sample.
+// Only available when WIEGAND_CAPTURE is WIEGAND_CAPTURE_TIMER in config.h.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get EEPROM Wear Info
+//
+// "e"
+//
+// Output: 
+//
+// "<type> <byte-writes> <zone-bytes>"... for each enabled type
+//
+// byte-writes counts EEPROM writes to the type's zone over the life of the
+// chip (as of the last save, see STORAGE_WEAR_SAVE_INTERVAL).  Each byte is 
+// rated for about 100,000 writes.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Task Info
+//
+// "t"
+//
+// Output: 
+//
+// "<task> <runs> <overruns> <max-us>"... in the order tasks run
+//
+// overruns counts runs that took longer than the task's budget, and max-us
+// is the longest run in microseconds.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Serial Output Info
+//
+// "u"
+//
+// Output: 
+//
+// "<queued> <max-queued> <dropped>"
+//
+// queued is the bytes of output waiting in the TX_QUEUE_SIZE byte queue 
+// (not counting this line), max-queued the most that have waited and 
+// dropped the bytes of debug output dropped because the queue was full.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Clock
+//
+// "c"
+//
+// Output: 
+//
+// "<era> <millis>"
+//
+// The controller's uptime is era * 2^32 + millis ms.  millis is the clock
+// that "log" timestamps events with, and era counts its rollovers (every
+// 49.7 days), so events stay in order across them.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Statistics
+//
+// "stats"              Print the histograms and counters.
+// "stats reset"        Print them, then set them all to 0.
+//
+// Output: 
+//
+// "<histogram> <bucket-0> ... <bucket-15>"... then "<counter> <count>"...
+//
+// Bucket 0 counts values of 0 and bucket b counts values from 2^(b-1) to 
+// 2^b - 1 (the last bucket counts all larger values too).  See stats.h for
+// the histograms, counters and their units.  Only available when 
+// STATS_ENABLED is set in config.h.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Get Events
+//
+// "log <seq-dec>"      Print the events numbered after seq, oldest first.
+// "log"                Print all events held.
+//
+// Output: 
+//
+// "<seq> <era> <millis> <reader> <type> <facility> <user> grant|deny"...
+//
+// At most EVENT_LOG_SIZE events are printed, so poll again with the last 
+// number printed until nothing is.  A gap in the numbers means older events
+// were dropped from the log.  When seq is newer than every event held the 
+// controller was reset and started a new log, and all of it is printed.
+// era and millis are the controller's clock (see "c") when the decision was
+// made.
+//////////////////////////////////////////////////////////////////////////////
+//
+// Unsolicited Events
+//
+// When CLI_PUSH_EVENTS is set in config.h, access decisions and door strike
+// changes are printed as they happen, between or during command output:
+//
+// "!access <seq> <era> <millis> <reader> <type> <facility> <user> grant|deny"
+// "!door <door_num> open|closed"
+//
+// The access fields are those of "log".  Debug traces (see DEBUG in
+// config.h) can also arrive at any time, and start with "#" (see
+// TX_DEBUG_PREFIX).  No command output starts with "!" or "#".
 //////////////////////////////////////////////////////////////////////////////
 //
 // Open Doors
@@ -74,15 +286,36 @@
 #define CMD_WRITE      "w"
 #define CMD_LIST       "l"
 #define CMD_CLEAR      "x"
+#define CMD_ADD        "a"
+#define CMD_DELETE     "d"
 #define CMD_INFO       "i"
+#define CMD_FILTER     "f"
+#define CMD_QUEUE      "q"
+#define CMD_SAMPLING   "s"
+#define CMD_WEAR       "e"
+#define CMD_TASKS      "t"
+#define CMD_OUTPUT     "u"
+#define CMD_CLOCK      "c"
+#define CMD_STATS      "stats"
+#define CMD_LOG        "log"
 #define CMD_OPEN       "o"
 #define CMD_HELP       "h"
 #define CMD_HELP2      "help"
 
-// A 26-bit Wiegand credential (24-bits in RAM because we don't store the 
-// 2 parity bits).
-#define CRED_TYPE_WIEGAND_26    0
-#define CRED_NAME_WIEGAND_26    "w26"
+// Credential type names, indexed by WIEGAND_FORMAT_*.  Parity bits are not
+// stored, so w26 codes contain only 24-bits of identity information.
+static const char * const cred_type_names[WIEGAND_NUM_FORMATS] = {
+  "w26", "w34", "w35", "w37"
+};
+
+// parse_type() returns this for Wiegand-26 rules
+#define TYPE_RULE26 WIEGAND_NUM_FORMATS
+static const char * const rule26_type_name = "r26";
+
+// Indexed by WIEGAND26_RULE_*
+static const char * const rule26_kind_names[] = {
+  "none", "allow", "deny"
+};
 
 //////////////////////////////////////////////////////////////////////////////
 // Parse Utilities
@@ -97,9 +330,9 @@ void clear_command() {
   command_index = 0;
 }
 
-uint8_t parse_uint8(char * str, uint8_t * dest) {
+uint16_t parse_uint16(char * str, uint16_t * dest) {
   char * endptr = 0;
-  uint8_t value = strtol(str, &endptr, 10);
+  uint16_t value = strtol(str, &endptr, 10);
   // The strtol man pages says this signifies success
   if (*str != 0 && *endptr == 0) {
     *dest = value;
@@ -108,11 +341,21 @@ uint8_t parse_uint8(char * str, uint8_t * dest) {
   return 0;
 }
 
-uint16_t parse_uint16(char * str, uint16_t * dest) {
+uint8_t parse_uint32(char * str, uint32_t * dest) {
   char * endptr = 0;
-  uint16_t value = strtol(str, &endptr, 10);
-  // The strtol man pages says this signifies success
-  if (*str != 0 && *endptr == 0) {
+  uint32_t value = strtoul(str, &endptr, 10);
+  if (*str != 0 && *str != '-' && *endptr == 0) {
+    *dest = value;
+    return 1;
+  }
+  return 0;
+}
+
+// Parses a value that must fit in the given number of bits.
+uint8_t parse_bits(char * str, byte bits, uint32_t * dest) {
+  char * endptr = 0;
+  uint32_t value = strtoul(str, &endptr, 10);
+  if (*str != 0 && *str != '-' && *endptr == 0 && value <= (1UL << bits) - 1) {
     *dest = value;
     return 1;
   }
@@ -136,23 +379,114 @@ static const char * e_missing_facility = "invalid facility";
 static const char * e_invalid_user = "missing user";
 static const char * e_missing_user = "invalid user";
 static const char * e_missing_door = "missing door";
+static const char * e_table_full = "table full";
+static const char * e_not_found = "not found";
+static const char * e_reserved = "reserved credential";
 static const char * e_invalid_door = "invalid door";
+static const char * e_invalid_seq = "invalid seq";
+static const char * e_missing_rule = "missing rule";
+static const char * e_invalid_rule = "invalid rule";
+static const char * e_storage_failed = "storage failed";
+
+// Parses a credential type name, or r26 for TYPE_RULE26.  Formats disabled
+// in config.h are invalid.
+boolean parse_type(char ** tok, byte * format) {
+  char * arg = strtok_r(NULL, " ", tok);
+  if (arg == NULL) {
+    tx_protocol.println(e_missing_type);
+    return false;
+  }
+  for (byte i = 0; i < WIEGAND_NUM_FORMATS; i++) {
+    if (strcmp(arg, cred_type_names[i]) == 0 && storage_max_credentials(i) > 0) {
+      *format = i;
+      return true;
+    }
+  }
+  if (WIEGAND26_MAX_RULES > 0 && strcmp(arg, rule26_type_name) == 0) {
+    *format = TYPE_RULE26;
+    return true;
+  }
+  tx_protocol.println(e_invalid_type);
+  return false;
+}
+
+// The number of slots of a type parse_type() accepted.
+int type_slots(byte type) {
+  return type == TYPE_RULE26 ? WIEGAND26_MAX_RULES : storage_max_credentials(type);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Jobs
+//////////////////////////////////////////////////////////////////////////////
+
+// A command that would block the loop for too long starts a job instead.
+// cli_loop() calls the job's step function once per loop iteration, and reads
+// no more input, until the step returns JOB_OK or JOB_ERR.  Then the command's
+// "ok" or "err" is printed.
+#define JOB_RUNNING 0
+#define JOB_OK      1
+#define JOB_ERR     2
+
+static byte (* job_step)() = NULL;
+
+// storage_backend_errors() when the command started
+static uint16_t command_storage_errors;
+
+// True if EEPROM couldn't be read or written since the command started.
+boolean storage_failed() {
+  return storage_backend_errors() != command_storage_errors;
+}
+
+// The error to print when a storage function fails for its usual reason or
+// a failed read or write.
+const char * storage_error(const char * usual) {
+  return storage_failed() ? e_storage_failed : usual;
+}
 
 //////////////////////////////////////////////////////////////////////////////
 // Read
 //////////////////////////////////////////////////////////////////////////////
 
-boolean exec_read_w26(uint8_t index) {
-  struct wiegand26_credential cred;
-  if (!storage_read_wiegand26_credential(index, &cred)) {
-    Serial.println(e_index_too_large);
+void print_credential(int index, struct wiegand_credential * cred) {
+  tx_protocol.print(index);
+  tx_protocol.print(' ');
+  tx_protocol.print(cred->facility);
+  tx_protocol.print(' ');
+  tx_protocol.println(cred->user);
+}
+
+boolean exec_read_cred(byte format, uint16_t index) {
+  struct wiegand_credential cred;
+  if (!storage_read_credential(format, index, &cred)) {
+    tx_protocol.println(storage_error(e_index_too_large));
+    return false;
+  }
+  print_credential(index, &cred);
+  return true;
+}
+
+void print_rule(int index, struct wiegand26_rule * rule) {
+  tx_protocol.print(index);
+  tx_protocol.print(' ');
+  tx_protocol.print(rule26_kind_names[rule->kind]);
+  tx_protocol.print(' ');
+  tx_protocol.print(rule->facility);
+  tx_protocol.print(' ');
+  tx_protocol.print(rule->first_user);
+  tx_protocol.print(' ');
+  tx_protocol.println(rule->last_user);
+}
+
+boolean exec_read_slot(byte type, uint16_t index) {
+  if (type != TYPE_RULE26) {
+    return exec_read_cred(type, index);
+  }
+  struct wiegand26_rule rule;
+  if (!storage_read_wiegand26_rule(index, &rule)) {
+    tx_protocol.println(storage_error(e_index_too_large));
     return false;
   }
-  Serial.print(index);
-  Serial.print(' ');
-  Serial.print(cred.facility);
-  Serial.print(' ');
-  Serial.println(cred.user);
+  print_rule(index, &rule);
   return true;
 }
 
@@ -160,76 +494,126 @@ boolean exec_read(char * tok) {
   char * arg;
   
   // Parse credental type
-  arg = strtok_r(NULL, " ", &tok);
-  if (arg == NULL) {
-    Serial.println(e_missing_type);
-    return false;
-  }
-  uint8_t type;
-  if (strcmp(arg, CRED_NAME_WIEGAND_26) == 0) {
-    type = CRED_TYPE_WIEGAND_26;
-  } else {
-    Serial.println(e_invalid_type);
+  byte format;
+  if (!parse_type(&tok, &format)) {
     return false;
   }
   
   // Parse index
   arg = strtok_r(NULL, " ", &tok);
   if (arg == NULL) {
-    Serial.println(e_missing_index);
+    tx_protocol.println(e_missing_index);
     return false;
   }
-  uint8_t index;
-  if (!parse_uint8(arg, &index)) {
-    Serial.println(e_invalid_index);
+  uint16_t index;
+  if (!parse_uint16(arg, &index)) {
+    tx_protocol.println(e_invalid_index);
     return false;
   }
 
-  // Let the specialized exec finish
-  if (type == CRED_TYPE_WIEGAND_26) {
-    return exec_read_w26(index);
-  }
-  
-  // Should not get here
-  return false;
+  return exec_read_slot(format, index);
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // Write
 //////////////////////////////////////////////////////////////////////////////
 
-boolean exec_write_w26(uint8_t index, char * tok) {
+// Parses the facility and user codes of a credential, which must fit the
+// format's fields.
+boolean parse_cred(byte format, char * tok, struct wiegand_credential * cred) {
+  struct wiegand_format f;
+  wiegand_get_format(format, &f);
   char * arg;
-  struct wiegand26_credential cred;
+  uint32_t facility;
+  uint32_t user;
 
   // Parse facility
   arg = strtok_r(NULL, " ", &tok);
   if (arg == NULL) {
-    Serial.println(e_missing_facility);
+    tx_protocol.println(e_missing_facility);
     return false;
   }
-  if (!parse_uint8(arg, &cred.facility)) {
-    Serial.println(e_invalid_facility);
+  if (!parse_bits(arg, f.facility_bits, &facility)) {
+    tx_protocol.println(e_invalid_facility);
     return false;
   }
   
   // Parse user
   arg = strtok_r(NULL, " ", &tok);
   if (arg == NULL) {
-    Serial.println(e_missing_user);
+    tx_protocol.println(e_missing_user);
     return false;
   }
-  if (!parse_uint16(arg, &cred.user)) {
-    Serial.println(e_invalid_user);
+  if (!parse_bits(arg, f.user_bits, &user)) {
+    tx_protocol.println(e_invalid_user);
     return false;
   }
 
-  // Execute
-  if (!storage_write_wiegand26_credential(index, &cred)) {
-    Serial.println(e_index_too_large);
+  cred->format = format;
+  cred->facility = facility;
+  cred->user = user;
+  return true;
+}
+
+// Parses "allow|deny <facility> [<first-user> [<last-user>]]" or "none".
+// With no users the rule covers the whole facility, and with one user just
+// that user.
+boolean parse_rule(char * tok, struct wiegand26_rule * rule) {
+  char * arg;
+  uint32_t value;
+  memset(rule, 0, sizeof(*rule));
+
+  // Parse kind
+  arg = strtok_r(NULL, " ", &tok);
+  if (arg == NULL) {
+    tx_protocol.println(e_missing_rule);
     return false;
   }
-  
+  while (rule->kind < sizeof(rule26_kind_names) / sizeof(rule26_kind_names[0])
+    && strcmp(arg, rule26_kind_names[rule->kind]) != 0) {
+    rule->kind++;
+  }
+  if (rule->kind == WIEGAND26_RULE_NONE) {
+    return true;
+  }
+  if (rule->kind > WIEGAND26_RULE_DENY) {
+    tx_protocol.println(e_invalid_rule);
+    return false;
+  }
+
+  // Parse facility
+  arg = strtok_r(NULL, " ", &tok);
+  if (arg == NULL) {
+    tx_protocol.println(e_missing_facility);
+    return false;
+  }
+  if (!parse_bits(arg, 8, &value)) {
+    tx_protocol.println(e_invalid_facility);
+    return false;
+  }
+  rule->facility = value;
+
+  // Parse users
+  rule->last_user = 0xffff;
+  arg = strtok_r(NULL, " ", &tok);
+  if (arg == NULL) {
+    return true;
+  }
+  if (!parse_bits(arg, 16, &value)) {
+    tx_protocol.println(e_invalid_user);
+    return false;
+  }
+  rule->first_user = value;
+  rule->last_user = value;
+  arg = strtok_r(NULL, " ", &tok);
+  if (arg == NULL) {
+    return true;
+  }
+  if (!parse_bits(arg, 16, &value) || value < rule->first_user) {
+    tx_protocol.println(e_invalid_user);
+    return false;
+  }
+  rule->last_user = value;
   return true;
 }
 
@@ -237,126 +621,211 @@ boolean exec_write(char * tok) {
   char * arg;
   
   // Parse credental type
-  arg = strtok_r(NULL, " ", &tok);
-  if (arg == NULL) {
-    Serial.println(e_missing_type);
-    return false;
-  }
-  uint8_t type;
-  if (strcmp(arg, CRED_NAME_WIEGAND_26) == 0) {
-    type = CRED_TYPE_WIEGAND_26;
-  } else {
-    Serial.println(e_invalid_type);
+  byte format;
+  if (!parse_type(&tok, &format)) {
     return false;
   }
   
   // Parse index
   arg = strtok_r(NULL, " ", &tok);
   if (arg == NULL) {
-    Serial.println(e_missing_index);
+    tx_protocol.println(e_missing_index);
     return false;
   }
-  uint8_t index;
-  if (!parse_uint8(arg, &index)) {
-    Serial.println(e_invalid_index);
+  uint16_t index;
+  if (!parse_uint16(arg, &index)) {
+    tx_protocol.println(e_invalid_index);
     return false;
   }
 
-  // Let the specialized exec finish
-  if (type == CRED_TYPE_WIEGAND_26) {
-    return exec_write_w26(index, tok);
+  if (format == TYPE_RULE26) {
+    struct wiegand26_rule rule;
+    if (!parse_rule(tok, &rule)) {
+      return false;
+    }
+    if (!storage_write_wiegand26_rule(index, &rule)) {
+      tx_protocol.println(storage_error(e_index_too_large));
+      return false;
+    }
+    return true;
+  }
+
+  struct wiegand_credential cred;
+  if (!parse_cred(format, tok, &cred)) {
+    return false;
+  }
+
+  // Execute
+  if (!storage_write_credential(index, &cred)) {
+    tx_protocol.println(storage_error(e_index_too_large));
+    return false;
   }
   
-  // Should not get here
-  return false;
+  return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // Clear
 //////////////////////////////////////////////////////////////////////////////
 
-boolean exec_clear_w26() {
-  struct wiegand26_credential cred;
-  cred.user = 0;
-  cred.facility = 0;
-  
-  for (byte i = 0; i < WIEGAND26_MAX_CREDS; i++) {
-    if (!storage_write_wiegand26_credential(i, &cred)) {
-      Serial.println(e_index_too_large);
-      return false;
+// Each step clears at most one slot (a few EEPROM writes, about 3.3 ms each)
+// or reads this many empty slots, whichever comes first.
+#define CLEAR_SLOTS_PER_STEP 16
+
+static byte clear_format;
+static int clear_index;
+
+// Frees a slot unless it already is free.  Returns true if EEPROM was
+// written.
+boolean clear_slot(byte type, int index) {
+  if (type != TYPE_RULE26) {
+    return storage_clear_credential(type, index);
+  }
+  struct wiegand26_rule rule;
+  if (!storage_read_wiegand26_rule(index, &rule) || rule.kind == WIEGAND26_RULE_NONE) {
+    return false;
+  }
+  rule.kind = WIEGAND26_RULE_NONE;
+  return storage_write_wiegand26_rule(index, &rule);
+}
+
+byte step_clear() {
+  for (byte n = 0; n < CLEAR_SLOTS_PER_STEP; n++) {
+    if (storage_failed()) {
+      // Slots that couldn't be cleared may still be in use
+      tx_protocol.println(e_storage_failed);
+      return JOB_ERR;
+    }
+    if (clear_index >= type_slots(clear_format)) {
+      if (clear_format == WIEGAND_FORMAT_26) {
+        // Every slot is empty now, so the filter can start over too
+        storage_clear_wiegand26_filter();
+      }
+      return JOB_OK;
+    }
+    if (clear_slot(clear_format, clear_index++)) {
+      break;
     }
   }
-  return true;
+  return JOB_RUNNING;
 }
 
 boolean exec_clear(char * tok) {
-  char * arg;
+  // Parse credental type
+  byte format;
+  if (!parse_type(&tok, &format)) {
+    return false;
+  }
   
+  clear_format = format;
+  clear_index = 0;
+  job_step = step_clear;
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Add and Delete
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_add_or_delete_rule(char * tok, boolean add) {
+  struct wiegand26_rule rule;
+  if (!parse_rule(tok, &rule)) {
+    return false;
+  }
+  if (rule.kind == WIEGAND26_RULE_NONE) {
+    tx_protocol.println(e_invalid_rule);
+    return false;
+  }
+
+  int index;
+  if (add && !storage_add_wiegand26_rule(&rule, &index)) {
+    tx_protocol.println(storage_error(e_table_full));
+    return false;
+  }
+  if (!add && !storage_remove_wiegand26_rule(&rule, &index)) {
+    tx_protocol.println(storage_error(e_not_found));
+    return false;
+  }
+  print_rule(index, &rule);
+  return true;
+}
+
+boolean exec_add_or_delete(char * tok, boolean add) {
   // Parse credental type
-  arg = strtok_r(NULL, " ", &tok);
-  if (arg == NULL) {
-    Serial.println(e_missing_type);
+  byte format;
+  if (!parse_type(&tok, &format)) {
     return false;
   }
-  uint8_t type;
-  if (strcmp(arg, CRED_NAME_WIEGAND_26) == 0) {
-    type = CRED_TYPE_WIEGAND_26;
-  } else {
-    Serial.println(e_invalid_type);
+  if (format == TYPE_RULE26) {
+    return exec_add_or_delete_rule(tok, add);
+  }
+
+  struct wiegand_credential cred;
+  if (!parse_cred(format, tok, &cred)) {
     return false;
   }
-  
-  // Let the specialized exec finish
-  if (type == CRED_TYPE_WIEGAND_26) {
-    return exec_clear_w26();
+
+  int index;
+  if (add) {
+    if (storage_credential_is_reserved(&cred)) {
+      tx_protocol.println(e_reserved);
+      return false;
+    }
+    if (!storage_add_credential(&cred, &index)) {
+      tx_protocol.println(storage_error(e_table_full));
+      return false;
+    }
+    return exec_read_cred(format, index);
   }
-  
-  // Should not get here
-  return false;
+
+  if (!storage_remove_credential(&cred, &index)) {
+    tx_protocol.println(storage_error(e_not_found));
+    return false;
+  }
+  print_credential(index, &cred);
+  return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 // List
 //////////////////////////////////////////////////////////////////////////////
 
-boolean exec_list_w26() {
-  struct wiegand26_credential cred;
-  cred.user = 0;
-  cred.facility = 0;
-  
-  for (byte i = 0; i < WIEGAND26_MAX_CREDS; i++) {
-    if (!exec_read_w26(i)) {
+// Each step prints at most this many slots, and only while the output queue
+// has room for a whole line, so printing never waits for the UART.
+#define LIST_SLOTS_PER_STEP 4
+// The longest line: "<index> allow <facility> <first-user> <last-user>\r\n"
+#define LIST_LINE_MAX 28
+
+static byte list_format;
+static int list_index;
+
+byte step_list() {
+  for (byte n = 0; n < LIST_SLOTS_PER_STEP; n++) {
+    if (list_index >= type_slots(list_format)) {
+      return JOB_OK;
+    }
+    if (tx_queue_room() < LIST_LINE_MAX) {
+      break;
+    }
+    if (!exec_read_slot(list_format, list_index++)) {
       // It printed the error
-      return false;
+      return JOB_ERR;
     }
   }
-  return true;
+  return JOB_RUNNING;
 }
 
 boolean exec_list(char * tok) {
-  char * arg;
-  
   // Parse credental type
-  arg = strtok_r(NULL, " ", &tok);
-  if (arg == NULL) {
-    Serial.println(e_missing_type);
-    return false;
-  }
-  uint8_t type;
-  if (strcmp(arg, CRED_NAME_WIEGAND_26) == 0) {
-    type = CRED_TYPE_WIEGAND_26;
-  } else {
-    Serial.println(e_invalid_type);
+  byte format;
+  if (!parse_type(&tok, &format)) {
     return false;
   }
   
-  // Let the specialized exec finish
-  if (type == CRED_TYPE_WIEGAND_26) {
-    return exec_list_w26();
-  }
-  
-  // Should not get here
-  return false;
+  list_format = format;
+  list_index = 0;
+  job_step = step_list;
+  return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -364,11 +833,250 @@ boolean exec_list(char * tok) {
 //////////////////////////////////////////////////////////////////////////////
 
 boolean exec_info(char * tok) {
-  Serial.print("w26 ");
-  Serial.println(WIEGAND26_MAX_CREDS);
+  for (byte i = 0; i < WIEGAND_NUM_FORMATS; i++) {
+    if (storage_max_credentials(i) == 0) {
+      continue;
+    }
+    tx_protocol.print(cred_type_names[i]);
+    tx_protocol.print(' ');
+    tx_protocol.print(storage_max_credentials(i));
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED
+    tx_protocol.println(i == WIEGAND_FORMAT_26 ? " hash" : " flat");
+#elif WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+    tx_protocol.println(i == WIEGAND_FORMAT_26 ? " group" : " flat");
+#else
+    tx_protocol.println(" flat");
+#endif
+  }
+  if (WIEGAND26_MAX_RULES > 0) {
+    tx_protocol.print(rule26_type_name);
+    tx_protocol.print(' ');
+    tx_protocol.print(WIEGAND26_MAX_RULES);
+    tx_protocol.println(" rule");
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Filter
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_filter(char * tok) {
+  struct wiegand26_filter_stats stats;
+  storage_get_wiegand26_filter_stats(&stats);
+  tx_protocol.print("w26 ");
+  tx_protocol.print(stats.set_bits);
+  tx_protocol.print(' ');
+  tx_protocol.print(stats.bits);
+  tx_protocol.print(' ');
+  tx_protocol.print(stats.rejected);
+  tx_protocol.print(' ');
+  tx_protocol.println(stats.false_positives);
   return true;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Queue
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_queue(char * tok) {
+  tx_protocol.print(wiegand_frames_waiting());
+  tx_protocol.print(' ');
+  tx_protocol.println(wiegand_frame_overflows());
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Sampling
+//////////////////////////////////////////////////////////////////////////////
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+
+boolean exec_sampling(char * tok) {
+  char * arg = strtok_r(NULL, " ", &tok);
+  if (arg != NULL && strcmp(arg, "reset") != 0) {
+    tx_protocol.println(e_invalid_command);
+    return false;
+  }
+
+  struct wiegand_sample_stats stats;
+  wiegand_get_sample_stats(&stats);
+  tx_protocol.print(WIEGAND_SAMPLE_US);
+  tx_protocol.print(' ');
+  tx_protocol.print(stats.duty);
+  tx_protocol.print(' ');
+  tx_protocol.print(stats.peak_duty);
+  tx_protocol.print(' ');
+  tx_protocol.println(stats.peak_sample_ns);
+
+  if (arg != NULL) {
+    wiegand_reset_sample_stats();
+  }
+  return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Wear
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_wear(char * tok) {
+  for (byte i = 0; i < WIEGAND_NUM_FORMATS; i++) {
+    if (storage_max_credentials(i) == 0) {
+      continue;
+    }
+    struct storage_wear_stats stats;
+    storage_get_wear_stats(i, &stats);
+    tx_protocol.print(cred_type_names[i]);
+    tx_protocol.print(' ');
+    tx_protocol.print(stats.writes);
+    tx_protocol.print(' ');
+    tx_protocol.println(stats.bytes);
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Tasks
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_tasks(char * tok) {
+  struct task_stats stats;
+  for (byte i = 0; scheduler_get_task_stats(i, &stats); i++) {
+    tx_protocol.print(stats.name);
+    tx_protocol.print(' ');
+    tx_protocol.print(stats.runs);
+    tx_protocol.print(' ');
+    tx_protocol.print(stats.overruns);
+    tx_protocol.print(' ');
+    tx_protocol.println(stats.max_us);
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Output
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_output(char * tok) {
+  struct tx_queue_stats stats;
+  tx_queue_get_stats(&stats);
+  tx_protocol.print(stats.queued);
+  tx_protocol.print(' ');
+  tx_protocol.print(stats.max_queued);
+  tx_protocol.print(' ');
+  tx_protocol.println(stats.dropped);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Clock
+//////////////////////////////////////////////////////////////////////////////
+
+boolean exec_clock(char * tok) {
+  struct time now;
+  tick_get_time(&now);
+  tx_protocol.print(now.era);
+  tx_protocol.print(' ');
+  tx_protocol.println(now.ms);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Stats
+//////////////////////////////////////////////////////////////////////////////
+
+#if STATS_ENABLED
+
+boolean exec_stats(char * tok) {
+  char * arg = strtok_r(NULL, " ", &tok);
+  if (arg != NULL && strcmp(arg, "reset") != 0) {
+    tx_protocol.println(e_invalid_command);
+    return false;
+  }
+
+  for (byte h = 0; h < STATS_NUM_HISTOGRAMS; h++) {
+    tx_protocol.print(stats_histogram_name(h));
+    for (byte b = 0; b < STATS_NUM_BUCKETS; b++) {
+      tx_protocol.print(' ');
+      tx_protocol.print(stats_get_bucket(h, b));
+    }
+    tx_protocol.println();
+  }
+  for (byte c = 0; c < STATS_NUM_COUNTERS; c++) {
+    tx_protocol.print(stats_counter_name(c));
+    tx_protocol.print(' ');
+    tx_protocol.println(stats_get_counter(c));
+  }
+
+  if (arg != NULL) {
+    stats_reset();
+  }
+  return true;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Log
+//////////////////////////////////////////////////////////////////////////////
+
+void print_event(uint32_t seq, struct event_log_entry * e) {
+  tx_protocol.print(seq);
+  tx_protocol.print(' ');
+  tx_protocol.print(e->time.era);
+  tx_protocol.print(' ');
+  tx_protocol.print(e->time.ms);
+  tx_protocol.print(' ');
+  tx_protocol.print(e->reader);
+  tx_protocol.print(' ');
+  tx_protocol.print(cred_type_names[e->cred.format]);
+  tx_protocol.print(' ');
+  tx_protocol.print(e->cred.facility);
+  tx_protocol.print(' ');
+  tx_protocol.print(e->cred.user);
+  tx_protocol.println(e->result == EVENT_GRANTED ? " grant" : " deny");
+}
+
+boolean exec_log(char * tok) {
+  uint32_t seq = 0;
+  char * arg = strtok_r(NULL, " ", &tok);
+  if (arg != NULL && !parse_uint32(arg, &seq)) {
+    tx_protocol.println(e_invalid_seq);
+    return false;
+  }
+
+  struct event_log_entry e;
+  for (byte i = 0; i < EVENT_LOG_SIZE; i++) {
+    seq = event_log_next(seq, &e);
+    if (seq == 0) {
+      break;
+    }
+    print_event(seq, &e);
+  }
+  return true;
+}
+
+void cli_push_event(uint32_t seq) {
+#if CLI_PUSH_EVENTS
+  struct event_log_entry e;
+  if (event_log_next(seq - 1, &e) != seq) {
+    return;
+  }
+  tx_protocol.print("!access ");
+  print_event(seq, &e);
+#endif
+}
+
+void cli_push_door(byte door_num, boolean open) {
+#if CLI_PUSH_EVENTS
+  tx_protocol.print("!door ");
+  tx_protocol.print(door_num);
+  tx_protocol.println(open ? " open" : " closed");
+#endif
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // Open
 //////////////////////////////////////////////////////////////////////////////
@@ -379,12 +1087,12 @@ boolean exec_open(char * tok) {
   // Parse door num
   arg = strtok_r(NULL, " ", &tok);
   if (arg == NULL) {
-    Serial.println(e_missing_door);
+    tx_protocol.println(e_missing_door);
     return false;
   }
   byte door_num = atoi(arg);
   if (door_num < 0 || door_num >= NUM_DOORS) {
-    Serial.println(e_invalid_door);
+    tx_protocol.println(e_invalid_door);
     return false;
   }
   
@@ -399,14 +1107,40 @@ boolean exec_open(char * tok) {
 //////////////////////////////////////////////////////////////////////////////
 
 boolean exec_help(char * tok) {
-  Serial.println("h|help");
-  Serial.println("l type");
-  Serial.println("r type idx");
-  Serial.println("w type idx n...");
-  Serial.println("x type");
-  Serial.println("o door");
-  Serial.print("types: ");
-  Serial.println(CRED_NAME_WIEGAND_26);
+  tx_protocol.println("h|help");
+  tx_protocol.println("l type");
+  tx_protocol.println("r type idx");
+  tx_protocol.println("w type idx n...");
+  tx_protocol.println("x type");
+  tx_protocol.println("a type n...");
+  tx_protocol.println("d type n...");
+  tx_protocol.println("o door");
+  tx_protocol.println("i");
+  tx_protocol.println("f");
+  tx_protocol.println("q");
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+  tx_protocol.println("s [reset]");
+#endif
+  tx_protocol.println("e");
+  tx_protocol.println("t");
+  tx_protocol.println("u");
+  tx_protocol.println("c");
+#if STATS_ENABLED
+  tx_protocol.println("stats [reset]");
+#endif
+  tx_protocol.println("log [seq]");
+  tx_protocol.print("types:");
+  for (byte i = 0; i < WIEGAND_NUM_FORMATS; i++) {
+    if (storage_max_credentials(i) > 0) {
+      tx_protocol.print(' ');
+      tx_protocol.print(cred_type_names[i]);
+    }
+  }
+  if (WIEGAND26_MAX_RULES > 0) {
+    tx_protocol.print(' ');
+    tx_protocol.print(rule26_type_name);
+  }
+  tx_protocol.println();
   return true;
 }
 
@@ -415,6 +1149,7 @@ boolean exec_help(char * tok) {
 //////////////////////////////////////////////////////////////////////////////
 
 void process_command() {
+  command_storage_errors = storage_backend_errors();
   boolean ok = false;
   char * tok = NULL;
   const char * command_name = strtok_r(command, " ", &tok);
@@ -428,23 +1163,56 @@ void process_command() {
     ok = exec_list(tok);
   } else if (strcmp(command_name, CMD_CLEAR) == 0) {
     ok = exec_clear(tok);
+  } else if (strcmp(command_name, CMD_ADD) == 0) {
+    ok = exec_add_or_delete(tok, true);
+  } else if (strcmp(command_name, CMD_DELETE) == 0) {
+    ok = exec_add_or_delete(tok, false);
   } else if (strcmp(command_name, CMD_INFO) == 0) {
     ok = exec_info(tok);
+  } else if (strcmp(command_name, CMD_FILTER) == 0) {
+    ok = exec_filter(tok);
+  } else if (strcmp(command_name, CMD_QUEUE) == 0) {
+    ok = exec_queue(tok);
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+  } else if (strcmp(command_name, CMD_SAMPLING) == 0) {
+    ok = exec_sampling(tok);
+#endif
+  } else if (strcmp(command_name, CMD_WEAR) == 0) {
+    ok = exec_wear(tok);
+  } else if (strcmp(command_name, CMD_TASKS) == 0) {
+    ok = exec_tasks(tok);
+  } else if (strcmp(command_name, CMD_OUTPUT) == 0) {
+    ok = exec_output(tok);
+  } else if (strcmp(command_name, CMD_CLOCK) == 0) {
+    ok = exec_clock(tok);
+#if STATS_ENABLED
+  } else if (strcmp(command_name, CMD_STATS) == 0) {
+    ok = exec_stats(tok);
+#endif
+  } else if (strcmp(command_name, CMD_LOG) == 0) {
+    ok = exec_log(tok);
   } else if (strcmp(command_name, CMD_OPEN) == 0) {
     ok = exec_open(tok);
   } else if (strcmp(command_name, CMD_HELP) == 0 
     || strcmp(command_name, CMD_HELP2) == 0) {
     ok = exec_help(tok);
   } else {
-    Serial.println(e_invalid_command);
+    tx_protocol.println(e_invalid_command);
   }
   
+  if (ok && job_step != NULL) {
+    // The job prints the result when it finishes
+    return;
+  }
+  if (ok && storage_failed()) {
+    tx_protocol.println(e_storage_failed);
+    ok = false;
+  }
   if (ok) {
-    Serial.println("ok");
+    tx_protocol.println("ok");
   } else {
-    Serial.println("err");
+    tx_protocol.println("err");
   }
-  Serial.flush();
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -455,8 +1223,25 @@ void cli_init() {
   clear_command();
 }
 
+boolean cli_busy() {
+  return job_step != NULL;
+}
+
 void cli_loop() {
-  while (Serial && Serial.available()) {
+  if (job_step != NULL) {
+    byte result = job_step();
+    if (result == JOB_RUNNING) {
+      return;
+    }
+    job_step = NULL;
+    if (result == JOB_OK && storage_failed()) {
+      tx_protocol.println(e_storage_failed);
+      result = JOB_ERR;
+    }
+    tx_protocol.println(result == JOB_OK ? "ok" : "err");
+  }
+
+  while (job_step == NULL && Serial && Serial.available()) {
     char c = Serial.read();
     
     if (c != '\r' && c != '\n' && command_index < sizeof(command)) {
@@ -468,8 +1253,8 @@ void cli_loop() {
       command[command_index] = 0;
       process_command();
     } else {
-      Serial.println("command too long");
-      Serial.println("err");
+      tx_protocol.println("command too long");
+      tx_protocol.println("err");
     }
   
     clear_command();
@@ -4,7 +4,17 @@
 #ifndef CLI_H
 #define CLI_H
 
+#include <Arduino.h>
+
 void cli_init();
 void cli_loop();
 
+// True while a command is still running across loop iterations.
+boolean cli_busy();
+
+// Print unsolicited event lines (see CLI_PUSH_EVENTS), which start with "!"
+// so hosts can tell them from command output.  seq is an event log number.
+void cli_push_event(uint32_t seq);
+void cli_push_door(byte door_num, boolean open);
+
 #endif
@@ -6,35 +6,225 @@
 // Enables serial debug output
 #define DEBUG
 
+// Settings wrapped in #ifndef may also be set from the compiler command line.
+// The native build in the "native" subdirectory uses this to test and 
+// benchmark several configurations.
+
+// Enables the latency histograms and event counters shown by the "stats" CLI
+// command.  They take about 150 bytes of SRAM and a few microseconds per
+// reader interrupt.  Set to 0 to compile them out.
+#ifndef STATS_ENABLED
+# define STATS_ENABLED 1
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 // Credential Storage
 //////////////////////////////////////////////////////////////////////////////
 
+// Where credentials, wear counts and saved events are kept.
+//
+// STORAGE_BACKEND_INTERNAL uses the microcontroller's EEPROM (E2END + 1
+// bytes: 1 KiB on an ATmega328, 4 KiB on an ATmega2560).
+//
+// STORAGE_BACKEND_24LC256 uses a 24LC256-class external I2C EEPROM (32 KiB)
+// on the Wire pins, which holds about 10,000 Wiegand-26 credentials.  Reads
+// and writes go over the bus in bursts of up to 30 bytes, and each write
+// takes about 5 ms.  Use the hashed layout for tables this large: a flat
+// scan of thousands of slots takes hundreds of milliseconds over I2C.
+//
+// Switching backends does not move the stored data.
+#define STORAGE_BACKEND_INTERNAL 0
+#define STORAGE_BACKEND_24LC256  1
+
+#ifndef STORAGE_BACKEND
+# define STORAGE_BACKEND STORAGE_BACKEND_INTERNAL
+#endif
+
+// I2C address of the external EEPROM: 0x50 with the A0-A2 pins tied low.
+#define STORAGE_24LC256_I2C_ADDRESS 0x50
+
+// How long to keep retrying an external EEPROM that doesn't answer, which it
+// doesn't while it finishes a write.  Must be longer than its write time.
+#define STORAGE_24LC256_TIMEOUT_MS 20
+
 // Number of Wiegand-26 credentials to store in EEPROM.  Each credential 
 // requires 24-bits (3 bytes) of EEPROM.  We don't store the 2 parity bits.
+// The grouped layout fits more credentials in the same space.
 // Increase the value if you have more memory or lower it if you need room 
 // for other things.
-#define WIEGAND26_MAX_CREDS 100
+#ifndef WIEGAND26_MAX_CREDS
+# define WIEGAND26_MAX_CREDS 100
+#endif
+
+// How Wiegand-26 credentials are arranged in their EEPROM zone.
+//
+// WIEGAND26_LAYOUT_FLAT keeps credentials at the index they were written to
+// and checks a presented credential by scanning every slot.
+//
+// WIEGAND26_LAYOUT_HASHED stores each credential in a slot chosen by hashing
+// its facility and user codes (open addressing with linear probing), so a
+// lookup usually reads only a few slots no matter how large
+// WIEGAND26_MAX_CREDS is.  Lookups stay fast while the table is at most
+// about 3/4 full, so size WIEGAND26_MAX_CREDS with some headroom.  Manage a
+// hashed table with the value-based "a" and "d" CLI commands; index-based
+// writes can put credentials where lookups won't find them.
+//
+// WIEGAND26_LAYOUT_GROUPED stores the facility code once per group of
+// credentials and 2 bytes of user code per credential, sorted within each
+// group, so the zone holds about 1.5 times WIEGAND26_MAX_CREDS credentials
+// and a lookup is a binary search of its facility's group.  Adding or
+// removing a credential moves the ones stored after it, about 1-2 EEPROM
+// writes each, so add credentials in ascending order when loading many (as
+// the host's sync_fobs.py does).  Slot indexes are positions in the sorted
+// table: index-based writes replace the credential at that position and the
+// new one lands in its sorted place, and clearing slot 0 empties the table.
+//
+// Switching between the flat and hashed layouts does not convert the stored
+// data.  Clear the table with "x w26" and add the credentials again.  The 
+// grouped layout converts a flat or hashed table when it first starts, in
+// a few seconds, and the other layouts convert a grouped table to their
+// own.  Don't reset the board while it converts: a conversion cut short in
+// either direction leaves an empty table when the board starts again, and
+// the credentials must be added again (as sync_fobs.py does).
+#define WIEGAND26_LAYOUT_FLAT    0
+#define WIEGAND26_LAYOUT_HASHED  1
+#define WIEGAND26_LAYOUT_GROUPED 2
+
+#ifndef WIEGAND26_LAYOUT
+# define WIEGAND26_LAYOUT WIEGAND26_LAYOUT_FLAT
+#endif
+
+// Number of facility codes the grouped layout can hold.  Each takes 3 bytes
+// of the zone and 3 bytes of SRAM.  Credentials of further facilities can't
+// be added, and are dropped when converting a table.  Changing it after
+// credentials are stored scrambles them.
+#ifndef WIEGAND26_MAX_FACILITIES
+# define WIEGAND26_MAX_FACILITIES 4
+#endif
+
+// Number of Wiegand-26 rules, each granting or denying the users of one 
+// facility from one user code to another (or all of them) with a single 
+// slot.  Rules are checked before the stored credentials and deny rules
+// override everything, so a lost fob from an allowed batch can be shut out
+// with one.  Each rule takes 6 bytes of EEPROM and 6 bytes of SRAM.  Set to
+// 0 to disable rules.
+#ifndef WIEGAND26_MAX_RULES
+# define WIEGAND26_MAX_RULES 8
+#endif
+
+// Number of credentials of the longer Wiegand formats to store in EEPROM.
+// Each format has its own storage zone, and setting a format's count to 0
+// disables the format: its frames are ignored and its CLI type is rejected.
+//
+// w34 (HID H10306, 16-bit facility and user) uses 4 bytes per credential.
+// w35 (HID Corporate 1000, 12-bit company and 20-bit card) uses 4 bytes.
+// w37 (HID H10304, 16-bit facility and 19-bit user) uses 5 bytes.
+//
+// These zones are always scanned slot by slot, so keep them small.
+#ifndef WIEGAND34_MAX_CREDS
+# define WIEGAND34_MAX_CREDS 20
+#endif
+#ifndef WIEGAND35_MAX_CREDS
+# define WIEGAND35_MAX_CREDS 0
+#endif
+#ifndef WIEGAND37_MAX_CREDS
+# define WIEGAND37_MAX_CREDS 20
+#endif
+
+// The count of EEPROM writes to each credential zone (see the "e" CLI 
+// command) is kept in SRAM and saved to EEPROM when it passes a multiple of
+// this.  A reset loses fewer than this many counts.
+#define STORAGE_WEAR_SAVE_INTERVAL 16
+
+// Each zone's count is saved to the next of this many 4 byte cells in turn,
+// so a cell is written once every STORAGE_WEAR_SAVE_INTERVAL *
+// STORAGE_WEAR_CELLS writes to the zone and outlasts the zone's busiest
+// bytes.
+#define STORAGE_WEAR_CELLS 8
+
+// Size in bits of the Bloom filter kept in SRAM that rejects unknown 
+// Wiegand-26 credentials without reading EEPROM.  Must be a power of 2 
+// and a multiple of 8; the filter uses WIEGAND26_FILTER_BITS / 8 bytes of 
+// SRAM.  Set to 0 to disable the filter.
+//
+// With n stored credentials the chance that an unknown credential gets past
+// the filter is about (1 - e^(-k * n / bits))^k for k hashes.  1024 bits 
+// and 4 hashes is about 1% for 100 credentials.
+#ifndef WIEGAND26_FILTER_BITS
+# define WIEGAND26_FILTER_BITS 1024
+#endif
+
+// Number of filter bits set per credential.
+#define WIEGAND26_FILTER_HASHES 4
+
+// Overwriting a stored credential leaves its bits set in the filter, which
+// only lets more unknown credentials through to EEPROM.  A background task
+// rebuilds the filter from the zone at most this often while that is so,
+// so a sync that rewrites many credentials costs one rebuild.
+#define WIEGAND26_FILTER_REBUILD_MS 1000
 
 //////////////////////////////////////////////////////////////////////////////
 // Wiegand Readers
 //////////////////////////////////////////////////////////////////////////////
 
 // Defines the number of Wiegand readers handled by this program.  Each reader 
-// requires 2 data pins, and each pin must support external interrupts.
-#define NUM_WIEGAND_READERS 2
+// requires 2 data pins, and each pin must support the interrupt chosen by
+// WIEGAND_CAPTURE.  At most 8.
+#ifndef NUM_WIEGAND_READERS
+# define NUM_WIEGAND_READERS 2
+#endif
 
-// Pins connected to readers.  All pins must be capable of triggering
-// external interrupts.  Must be an array initializer of two dimensions
+// Pins connected to readers.  Must be an array initializer of two dimensions
 // [NUM_WIEGAND_READERS][2] where the inner dimension defines 
 // {DATA_0_PIN, DATA_1_PIN}.
-#define WIEGAND_READER_PINS {{1, 0}, {2, 3}}
+#ifndef WIEGAND_READER_PINS
+# define WIEGAND_READER_PINS {{1, 0}, {2, 3}}
+#endif
+
+// How the reader data lines interrupt.
+//
+// WIEGAND_CAPTURE_EXTERNAL attaches an external interrupt to each data pin.
+// An ATmega328 has only two external interrupt pins, which limits it to one
+// reader (or two by borrowing pins, as the default WIEGAND_READER_PINS do).
+//
+// WIEGAND_CAPTURE_PCINT uses pin change interrupts, which nearly every pin
+// has.  Pins are grouped in banks of up to 8 (on an ATmega328 PCINT0-2 are
+// ports B, C and D) with one vector per bank.  The vector compares the port
+// with its last reading to find the data lines that fell and adds a bit to
+// each of their readers, so one interrupt serves all the readers of a bank
+// and does at most 8 bits of work.  Rising edges interrupt too but do no
+// work.  All of a bank's data pins must be on the same port.
+//
+// WIEGAND_CAPTURE_TIMER reads every data line's port from a Timer 2
+// interrupt every WIEGAND_SAMPLE_US and finds the lines that fell by
+// comparing each port with the previous sample.  Any pin will do, and the
+// interrupt rate doesn't grow with noise on the lines, so a noisy cable
+// can't starve the main loop.  The CPU share it takes is fixed by the sample
+// rate and the number of ports (see the "s" CLI command).  Timer 2 is then
+// unavailable for tone() and PWM (pins 3 and 11 on an ATmega328).
+#define WIEGAND_CAPTURE_EXTERNAL 0
+#define WIEGAND_CAPTURE_PCINT    1
+#define WIEGAND_CAPTURE_TIMER    2
+
+#ifndef WIEGAND_CAPTURE
+# define WIEGAND_CAPTURE WIEGAND_CAPTURE_EXTERNAL
+#endif
 
-// Abort the read and reset for a new value if reader input lines are idle 
-// for this many milliseconds.  Prevents noise from accumulating and 
-// spoiling the next read, which could be minutes or hours after the noise.  
-// Typical inter-pulse spacing for readers is 1 ms, so a timeout a little 
-// longer than this is useful.
+// Microseconds between samples with WIEGAND_CAPTURE_TIMER.  Pulses shorter
+// than this may be missed, so keep it below the readers' pulse width
+// (typically 50 us).  Each sample costs a few microseconds, so shorter
+// periods take more of the CPU.  1 to 128 at 16 MHz.
+#ifndef WIEGAND_SAMPLE_US
+# define WIEGAND_SAMPLE_US 25
+#endif
+
+// A frame ends when the reader input lines are idle for this many 
+// milliseconds.  The frame is decoded if its length matches an enabled
+// format, and frames shorter than any format are discarded as noise.  This
+// prevents noise from accumulating and spoiling the next read, which could 
+// be minutes or hours after the noise.  Typical inter-pulse spacing for 
+// readers is 1 ms, so a timeout a little longer than this is useful.  Frames
+// of the longest enabled format end as soon as their last bit arrives.
 // 
 // If your environment has large amounts of electrical noise you could 
 // try setting this to a smaller value, but don't make it shorter than 
@@ -42,7 +232,8 @@
 //
 // If your reader uses an especially long period, adjust this to a larger
 // value.  Longer values really won't hurt unless there's a lot of noise
-// in the lines.
+// in the lines.  The native noise benchmark (native/bench/bench_noise.cpp)
+// measures how the timeout copes with noise and back-to-back frames.
 //
 // If you don't have a physical Wiegand reader you can set this to a long
 // value like 3000 (3 seconds), connect two normally-closed pushbuttons across
@@ -50,7 +241,15 @@
 // works.
 //
 // Must be greater than 0 and less than 2^31 (2147483648 ms ~= 24.9 days).
-#define WIEGAND_INPUT_TIMEOUT_MS 10
+#ifndef WIEGAND_INPUT_TIMEOUT_MS
+# define WIEGAND_INPUT_TIMEOUT_MS 10
+#endif
+
+// Number of complete frames the readers can capture before the main loop 
+// processes them.  Frames that arrive while the queue is full are dropped and
+// counted (see the "q" CLI command).  Must be a power of 2 no larger than 128.
+// Each entry uses 13 bytes of SRAM.
+#define WIEGAND_FRAME_QUEUE_SIZE 8
 
 //////////////////////////////////////////////////////////////////////////////
 // Door Strikes and Indicators
@@ -77,6 +276,59 @@
 // the LED for that door index.
 #define DOOR_ACCEPTED_LED_PINS   {{4, LOW}, {5, LOW}}
 
+//////////////////////////////////////////////////////////////////////////////
+// Event Log
+//////////////////////////////////////////////////////////////////////////////
+
+// Number of recent grant and deny decisions kept in SRAM for the "log" CLI
+// command.  Must be a power of 2.  Each event uses 14 bytes of SRAM.
+#define EVENT_LOG_SIZE 16
+
+// Number of events also kept in EEPROM, so the log survives a reset.  Each
+// event uses 18 bytes of EEPROM, and every event rewrites most of one record,
+// so each byte wears out after about 100,000 * EVENT_LOG_EEPROM_SIZE events.
+// Set to 0 to keep the log in SRAM only.
+#ifndef EVENT_LOG_EEPROM_SIZE
+# define EVENT_LOG_EEPROM_SIZE 0
+#endif
+
+// The most EEPROM bytes to write per loop iteration when saving events.  Each
+// write takes about 3.3 ms.
+#define EVENT_LOG_EEPROM_WRITES_PER_LOOP 2
+
+// Prints each access decision and door strike change on the serial port as
+// it happens, tagged so hosts can tell it from command output (see cli.cpp).
+// Set to 0 for a quiet console.
+#ifndef CLI_PUSH_EVENTS
+# define CLI_PUSH_EVENTS 1
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Serial Output
+//////////////////////////////////////////////////////////////////////////////
+
+// Bytes of serial output queued in SRAM, on top of the Arduino core's 64
+// byte transmit buffer, so printing doesn't wait for the UART.  When it 
+// fills, debug output is dropped and CLI output waits (see tx_queue.h and 
+// the "u" CLI command).  At 115200 baud the UART sends about 11 bytes per
+// millisecond.  Must be a power of 2.
+#ifndef TX_QUEUE_SIZE
+# define TX_QUEUE_SIZE 256
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Scheduler
+//////////////////////////////////////////////////////////////////////////////
+
+// The loop runs each subsystem as a task with a priority, a period and a
+// time budget (see arduino.ino).  Runs that take longer than their budget
+// are counted as overruns (see the "t" CLI command).
+#define SCHEDULER_MAX_TASKS 9
+
+// How often the status panel is brought up to date.  Its heartbeat changes 
+// every 256 ms at the fastest.
+#define STATUS_PANEL_PERIOD_MS 20
+
 //////////////////////////////////////////////////////////////////////////////
 // Status LED Panel
 //////////////////////////////////////////////////////////////////////////////
@@ -90,5 +342,14 @@
 // LiquidCrystal(rs, rw, enable, d0, d1, d2, d3, d4, d5, d6, d7) 
 #define STATUS_PANEL_LIQUID_CRYSTAL_CONST_ARGS A3, A2, A1, A0, 15, 14
 
+// Size of the display in characters.
+#define STATUS_PANEL_COLS 20
+#define STATUS_PANEL_ROWS 4
+
+// The most display cells to write per loop iteration.  Each cell costs a 
+// few hundred microseconds of LCD I/O (more when the cursor has to move), so
+// a larger change is spread over several iterations.
+#define STATUS_PANEL_MAX_CELLS_PER_LOOP 4
+
 #endif
 
@@ -1,6 +1,6 @@
 #include <Arduino.h>
 #include "door.h"
-#include "time.h"
+#include "tick.h"
 
 // Declared and defined by config.h
 static byte strike_pins[NUM_DOORS] = DOOR_STRIKE_PINS;
@@ -30,7 +30,6 @@ void door_init(void) {
 }
 
 void door_loop() {
-  unsigned long now = millis();
   for (byte i = 0; i < NUM_DOORS; i++) {
     boolean open = door_open_remaining_ms(i) > 0;
 
@@ -48,11 +47,11 @@ void door_open(byte door_num) {
   if (door_num >= NUM_DOORS) {
     return;
   }
-  hold_open[door_num].start = millis();
+  hold_open[door_num].start = tick_millis();
   hold_open[door_num].duration = strike_open_periods[door_num];
 }
 
 uint32_t door_open_remaining_ms(byte door_num) {
-  return open_closed_interval_remaining(&hold_open[door_num], millis());
+  return open_closed_interval_remaining(&hold_open[door_num], tick_millis());
 }
 
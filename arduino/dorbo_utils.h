@@ -7,6 +7,7 @@
 #include <Arduino.h>
 
 #include "config.h"
+#include "tx_queue.h"
 
 // Clear the at the specified SFR address
 #define cbi(sfr,bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
@@ -14,16 +15,22 @@
 // Set the bit at the specified SFR address
 #define sbi(sfr,bit) (_SFR_BYTE(sfr) |= _BV(bit))
 
+// Keeps the compiler from moving memory accesses across this point.  Needed
+// where an ISR and the main loop hand off data through a volatile index.
+#define COMPILER_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+// Debug output goes through the serial output queue and is dropped when the
+// queue is full (see tx_queue.h).
 #ifdef DEBUG
 # define IFSER(e)   if (Serial) { e }
-# define P(a)       IFSER(Serial.print(a);)
-# define PDEC(a)    IFSER(Serial.print(a, DEC);)
-# define PBIN(a)    IFSER(Serial.print(a, BIN);)
-# define PHEX(a)    IFSER(Serial.print(a, HEX);)
-# define PL(a)      IFSER(Serial.println(a);)
-# define PLDEC(a)   IFSER(Serial.println(a, DEC);)
-# define PLBIN(a)   IFSER(Serial.println(a, BIN);)
-# define PLHEX(a)   IFSER(Serial.println(a, HEX);)
+# define P(a)       IFSER(tx_debug.print(a);)
+# define PDEC(a)    IFSER(tx_debug.print(a, DEC);)
+# define PBIN(a)    IFSER(tx_debug.print(a, BIN);)
+# define PHEX(a)    IFSER(tx_debug.print(a, HEX);)
+# define PL(a)      IFSER(tx_debug.println(a);)
+# define PLDEC(a)   IFSER(tx_debug.println(a, DEC);)
+# define PLBIN(a)   IFSER(tx_debug.println(a, BIN);)
+# define PLHEX(a)   IFSER(tx_debug.println(a, HEX);)
 #else
 # define P(a)
 # define PDEC(a)
@@ -0,0 +1,129 @@
+#include "event_log.h"
+#include "storage.h"
+#include "tick.h"
+
+// The newest EVENT_LOG_SIZE events, event n at ring[n % EVENT_LOG_SIZE].
+static struct event_log_entry ring[EVENT_LOG_SIZE];
+
+// The number the next event gets, and the oldest event in the ring
+static uint32_t next_seq;
+static uint32_t ring_first;
+
+#if EVENT_LOG_EEPROM_SIZE > 0
+
+// The oldest event in EEPROM, and the next event to save with the next step
+// of writing its record (see storage_write_event()).
+static uint32_t eeprom_first;
+static uint32_t save_seq;
+static byte save_byte;
+
+void event_log_init() {
+  // The newest record holds the largest number.  Erased slots read as 0.
+  uint32_t last = 0;
+  struct event_log_entry e;
+  for (int slot = 0; slot < EVENT_LOG_EEPROM_SIZE; slot++) {
+    uint32_t seq = storage_read_event(slot, &e);
+    if (seq > last) {
+      last = seq;
+    }
+  }
+
+  // Walk back from it while the records continue the sequence
+  eeprom_first = last + 1;
+  while (eeprom_first > 1 && last - eeprom_first + 1 < EVENT_LOG_EEPROM_SIZE) {
+    if (storage_read_event((eeprom_first - 1) % EVENT_LOG_EEPROM_SIZE, &e) != eeprom_first - 1) {
+      break;
+    }
+    eeprom_first--;
+  }
+
+  next_seq = last + 1;
+  ring_first = eeprom_first;
+  if (next_seq - ring_first > EVENT_LOG_SIZE) {
+    ring_first = next_seq - EVENT_LOG_SIZE;
+  }
+  for (uint32_t seq = ring_first; seq < next_seq; seq++) {
+    storage_read_event(seq % EVENT_LOG_EEPROM_SIZE, &ring[seq % EVENT_LOG_SIZE]);
+  }
+  save_seq = next_seq;
+  save_byte = 0;
+}
+
+boolean event_log_loop() {
+  if (save_seq < ring_first) {
+    // Added faster than they could be saved
+    save_seq = ring_first;
+    save_byte = 0;
+  }
+  if (save_seq == next_seq) {
+    return false;
+  }
+  // The event whose slot this overwrites leaves the EEPROM log before the
+  // slot's first byte changes, so event_log_next() never reads it half done
+  if (save_seq - eeprom_first + 1 > EVENT_LOG_EEPROM_SIZE) {
+    eeprom_first = save_seq - EVENT_LOG_EEPROM_SIZE + 1;
+  }
+  if (storage_write_event(save_seq % EVENT_LOG_EEPROM_SIZE, save_seq,
+                          &ring[save_seq % EVENT_LOG_SIZE], &save_byte,
+                          EVENT_LOG_EEPROM_WRITES_PER_LOOP)) {
+    save_seq++;
+    save_byte = 0;
+  }
+  return save_seq != next_seq;
+}
+
+#else
+
+void event_log_init() {
+  next_seq = 1;
+  ring_first = 1;
+}
+
+boolean event_log_loop() {
+  return false;
+}
+
+#endif
+
+uint32_t event_log_add(byte reader, struct wiegand_credential * cred, byte result) {
+  uint32_t seq = next_seq++;
+  struct event_log_entry * e = &ring[seq % EVENT_LOG_SIZE];
+  tick_get_time(&e->time);
+  e->reader = reader;
+  e->result = result;
+  e->cred = *cred;
+  if (next_seq - ring_first > EVENT_LOG_SIZE) {
+    ring_first = next_seq - EVENT_LOG_SIZE;
+  }
+  return seq;
+}
+
+uint32_t event_log_last() {
+  return next_seq - 1;
+}
+
+uint32_t event_log_next(uint32_t after, struct event_log_entry * e) {
+#if EVENT_LOG_EEPROM_SIZE > 0
+  uint32_t first = eeprom_first < ring_first ? eeprom_first : ring_first;
+#else
+  uint32_t first = ring_first;
+#endif
+  uint32_t seq = after >= next_seq || after < first ? first : after + 1;
+  if (seq >= next_seq) {
+    return 0;
+  }
+#if EVENT_LOG_EEPROM_SIZE > 0
+  if (seq < ring_first) {
+    if (storage_read_event(seq % EVENT_LOG_EEPROM_SIZE, e) == seq) {
+      return seq;
+    }
+    // Events that were added faster than they could be saved are missing
+    seq = ring_first;
+    if (seq == next_seq) {
+      return 0;
+    }
+  }
+#endif
+  *e = ring[seq % EVENT_LOG_SIZE];
+  return seq;
+}
@@ -0,0 +1,52 @@
+// A log of access decisions kept in a ring in SRAM, and optionally in an
+// EEPROM zone (see EVENT_LOG_EEPROM_SIZE) so it survives a reset.
+//
+
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <Arduino.h>
+
+#include "config.h"
+#include "time.h"
+#include "wiegand.h"
+
+#if EVENT_LOG_SIZE == 0 || (EVENT_LOG_SIZE & (EVENT_LOG_SIZE - 1)) != 0
+# error EVENT_LOG_SIZE must be a power of 2.
+#endif
+
+#define EVENT_DENIED  0
+#define EVENT_GRANTED 1
+
+struct event_log_entry {
+  // tick_get_time() when the decision was made
+  struct time time;
+  byte reader;
+  // EVENT_DENIED or EVENT_GRANTED
+  byte result;
+  struct wiegand_credential cred;
+};
+
+// Events are numbered from 1 in the order they are added.  Numbers keep
+// counting across resets when the log is kept in EEPROM, and start over at 1
+// otherwise.
+
+// Loads the log from EEPROM.  Call once from setup() after storage_init().
+void event_log_init();
+// Saves events to EEPROM a few bytes per call.  Returns true while some
+// events are still waiting to be saved.
+boolean event_log_loop();
+
+// Adds an event timestamped now.  Returns its number.
+uint32_t event_log_add(byte reader, struct wiegand_credential * cred, byte result);
+
+// The number of the newest event, 0 if there are none.
+uint32_t event_log_last();
+
+// Gets the oldest event still held with a number greater than after.  Returns
+// its number, or 0 if there is no newer event.  When after is newer than the
+// newest event (the controller was reset and the log started over) the oldest
+// held event is returned.
+uint32_t event_log_next(uint32_t after, struct event_log_entry * e);
+
+#endif
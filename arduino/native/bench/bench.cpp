@@ -0,0 +1,197 @@
+// Benchmarks for the firmware's hot paths: credential lookup, Wiegand decode
+// and CLI command handling.  The Makefile builds one binary per table size
+// and storage layout, and a few with the external I2C EEPROM.
+//
+// Wall-clock times measure the code on this machine, so compare them between
+// runs and configurations rather than reading them as AVR timings.  EEPROM
+// operation counts and simulated time (with EEPROM writes charged at 3.3 ms
+// each, like the ATmega328, and LCD operations at 50 us) carry over to the
+// hardware.  With the external EEPROM, reads and writes count bytes moved
+// over I2C at 400 kHz, and page writes take 5 ms.
+
+#include <chrono>
+
+#include "../tests/test.h"
+#include "storage.h"
+
+#define LOAD_PERCENT 75
+
+static const char * layout_name() {
+  if (STORAGE_BACKEND == STORAGE_BACKEND_24LC256) {
+    return "ext";
+  }
+  if (WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED) {
+    return "grouped";
+  }
+  return WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED ? "hashed" : "flat";
+}
+
+static double now_ns() {
+  return std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char * name, unsigned long ops, double ns,
+                   unsigned long reads, unsigned long writes, double sim_us) {
+  printf("%-8s %5d  %-22s %10.1f ns/op %9.2f reads/op %7.2f writes/op %10.1f sim-us/op\n",
+         layout_name(), WIEGAND26_MAX_CREDS, name, ns / ops, (double) reads / ops,
+         (double) writes / ops, sim_us / ops);
+}
+
+struct measurement {
+  double ns;
+  unsigned long reads;
+  unsigned long writes;
+  uint64_t sim_us;
+};
+
+static void start(struct measurement * m) {
+  m->reads = sim_counters.eeprom_reads;
+  m->writes = sim_counters.eeprom_writes;
+  m->sim_us = sim_now_us();
+  m->ns = now_ns();
+}
+
+static void stop(const char * name, unsigned long ops, struct measurement * m) {
+  double ns = now_ns() - m->ns;
+  report(name, ops, ns, sim_counters.eeprom_reads - m->reads,
+         sim_counters.eeprom_writes - m->writes, (double) (sim_now_us() - m->sim_us));
+}
+
+// Stored credentials are users 10000... of facilities 1-3.  Unknown ones
+// come from facility 200.
+static struct wiegand26_credential stored_credential(int i) {
+  struct wiegand26_credential c;
+  c.facility = 1 + i % 3;
+  c.user = 10000 + i;
+  return c;
+}
+
+static void fill_table() {
+  sim_command("x w26");
+  int index;
+  for (int i = 0; i < WIEGAND26_MAX_CREDS * LOAD_PERCENT / 100; i++) {
+    struct wiegand26_credential c = stored_credential(i);
+    storage_add_wiegand26_credential(&c, &index);
+  }
+}
+
+static void bench_lookup() {
+  const int n = WIEGAND26_MAX_CREDS * LOAD_PERCENT / 100;
+  const unsigned long rounds = 200000 / WIEGAND26_MAX_CREDS + 1;
+  struct measurement m;
+  volatile boolean found;
+
+  start(&m);
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (int i = 0; i < n; i++) {
+      struct wiegand26_credential c = stored_credential(i);
+      found = storage_find_wiegand26_credential(&c);
+    }
+  }
+  stop("lookup-hit", rounds * n, &m);
+
+  start(&m);
+  for (unsigned long r = 0; r < rounds; r++) {
+    for (int i = 0; i < n; i++) {
+      struct wiegand26_credential c;
+      c.facility = 200;
+      c.user = (r * n + i) & 0xffff;
+      found = storage_find_wiegand26_credential(&c);
+    }
+  }
+  stop("lookup-miss", rounds * n, &m);
+  (void) found;
+}
+
+static void bench_decode() {
+  const unsigned long frames = 20000;
+  struct measurement m;
+  start(&m);
+  for (unsigned long i = 0; i < frames; i++) {
+    struct wiegand26_credential c = stored_credential(i % 50);
+    send_wiegand_frame(i % NUM_WIEGAND_READERS, wiegand26_frame(c.facility, c.user), 26);
+    loop();
+  }
+  stop("decode+check+loop", frames, &m);
+  sim_serial_take_output();
+}
+
+// Loop passes with nothing to do but keep the status panel up to date, with
+// LCD operations charged at 50 us each.
+static void bench_idle_loop() {
+  const unsigned long passes = 20000;
+  struct measurement m;
+  sim_lcd_op_cost_us = 50;
+  start(&m);
+  for (unsigned long i = 0; i < passes; i++) {
+    loop();
+  }
+  stop("loop-idle", passes, &m);
+  sim_lcd_op_cost_us = 0;
+}
+
+// Loop passes that deny an unknown credential and print its debug trace and
+// event, about 100 bytes, with the UART sending at 115200 baud.  Each frame
+// is followed by 10 passes 1 ms apart, and only time spent in loop() counts:
+// time the loop waited for the UART.
+static void bench_denied_loop() {
+  const unsigned long frames = 2000;
+  struct measurement m;
+  sim_serial_tx_byte_cost_us = 87;
+  uint64_t loop_us = 0;
+  start(&m);
+  for (unsigned long i = 0; i < frames; i++) {
+    send_wiegand_frame(i % NUM_WIEGAND_READERS, wiegand26_frame(200, i), 26);
+    for (int pass = 0; pass < 10; pass++) {
+      uint64_t before = sim_now_us();
+      loop();
+      loop_us += sim_now_us() - before;
+      sim_advance_us(1000);
+    }
+    sim_serial_take_output();
+  }
+  m.sim_us = sim_now_us() - loop_us;
+  stop("loop-denied", frames, &m);
+  sim_serial_tx_byte_cost_us = 0;
+}
+
+static void bench_command(const char * name, const char * command, unsigned long count) {
+  struct measurement m;
+  start(&m);
+  for (unsigned long i = 0; i < count; i++) {
+    sim_command(command, 100000);
+  }
+  stop(name, count, &m);
+}
+
+static void bench_cli() {
+  char add[40];
+  struct wiegand26_credential c = stored_credential(WIEGAND26_MAX_CREDS - 1);
+  snprintf(add, sizeof(add), "a w26 %d %u", c.facility, c.user);
+
+  sim_eeprom_write_cost_us = 3300;
+  sim_ext_eeprom_write_cycle_us = 5000;
+  bench_command("cli-read", "r w26 1", 2000);
+  bench_command("cli-write", "w w26 1 9 9", 200);
+  bench_command("cli-add-existing", add, 2000);
+  bench_command("cli-list", "l w26", 20);
+  bench_command("cli-clear", "x w26", 2);
+  sim_eeprom_write_cost_us = 0;
+  sim_ext_eeprom_write_cycle_us = 0;
+}
+
+int main() {
+  sim_reset();
+  sim_i2c_byte_cost_us = 23;
+  setup();
+  sim_serial_take_output();
+
+  fill_table();
+  bench_lookup();
+  bench_decode();
+  bench_idle_loop();
+  bench_denied_loop();
+  bench_cli();
+  return 0;
+}
@@ -0,0 +1,260 @@
+// Wiegand decoder benchmark under line noise.  A generator synthesizes the
+// DATA0/DATA1 pulses of random Wiegand-26 frames, optionally with timing
+// jitter, lost and misplaced bits and spurious pulses, and plays them
+// through the simulated pins so the reader ISRs capture them.  A main loop
+// polled every few milliseconds closes frames and decodes them, and each
+// decoded frame is matched against what its reader sent.
+//
+// The Makefile builds it once per WIEGAND_INPUT_TIMEOUT_MS and once per
+// WIEGAND_CAPTURE mode, so the timeout, the modes and changes to the ISRs
+// can be judged by the numbers:
+//
+//   ok          frames decoded to the credential that was sent
+//   dropped     frames sent but never decoded (lost, merged or rejected)
+//   false-acc   decoded frames that pass parity but weren't sent
+//   rejected    captured frames that failed to decode
+//   overflows   frames lost because the frame queue was full
+//   ok/sim-s    frames decoded per simulated second of line time
+//   irq/frame   interrupts per frame sent: data line edges or timer samples
+//   ns/frame    wall-clock time per frame sent, for comparing runs
+//
+// Frames shorter than 26 bits are discarded by the ISRs and never show up
+// as rejected.
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "../tests/test.h"
+
+#define FRAMES_PER_SCENARIO 2000
+
+struct scenario {
+  const char * name;
+  // Bit period and pulse width.  Readers typically pulse for 50 us every
+  // 1 ms.
+  uint16_t period_us;
+  uint16_t width_us;
+  // Each bit period varies by up to this much either way
+  byte jitter_percent;
+  // Quiet time between the frames of a reader
+  uint32_t gap_us;
+  // Spurious pulses per second on each data line
+  uint16_t noise_per_s;
+  // Bits that never arrive, and bits pulsed on the wrong line, per 1000
+  uint16_t drop_per_mille;
+  uint16_t flip_per_mille;
+  // Readers sending at once, and how often the main loop runs
+  byte readers;
+  uint32_t loop_us;
+};
+
+#define TIMEOUT_US ((uint32_t) WIEGAND_INPUT_TIMEOUT_MS * 1000)
+
+static const struct scenario scenarios[] = {
+  { "clean",          1000, 50,  0, 100000,  0,  0,  0, 1, 1000 },
+  { "jitter-30%",     1000, 50, 30, 100000,  0,  0,  0, 1, 1000 },
+  { "fast-bits",       200, 20, 10, 100000,  0,  0,  0, 1, 1000 },
+  { "slow-bits",      2500, 50, 10, 100000,  0,  0,  0, 1, 1000 },
+  { "back-to-back",   1000, 50,  0, TIMEOUT_US + 2000, 0, 0, 0, 1, 1000 },
+  { "gap-half-tmo",   1000, 50,  0, TIMEOUT_US / 2, 0, 0, 0, 1, 1000 },
+  { "noise-2/s",      1000, 50,  0, 100000,  2,  0,  0, 1, 1000 },
+  { "noise-20/s",     1000, 50,  0, 100000, 20,  0,  0, 1, 1000 },
+  { "drop-5/1000",    1000, 50,  0, 100000,  0,  5,  0, 1, 1000 },
+  { "flip-5/1000",    1000, 50,  0, 100000,  0,  0,  5, 1, 1000 },
+  { "all-readers",    1000, 50, 10, TIMEOUT_US + 2000, 0, 0, 0, NUM_WIEGAND_READERS, 1000 },
+  { "slow-loop",      1000, 50, 10, TIMEOUT_US + 2000, 0, 0, 0, NUM_WIEGAND_READERS, 200000 },
+};
+
+// Indexed by WIEGAND_CAPTURE_*
+static const char * const capture_names[] = { "external", "pcint", "timer" };
+
+// One edge of a data line
+struct edge {
+  uint64_t us;
+  byte pin;
+  byte level;
+};
+
+static bool edge_before(const struct edge & a, const struct edge & b) {
+  // A pulse that starts when another ends on the same line stays separate
+  return a.us < b.us || (a.us == b.us && a.level > b.level);
+}
+
+// xorshift64*, seeded the same on every run so runs compare.  rand()'s
+// successive values are correlated enough to put errors in pairs.
+static uint64_t random_state = 26;
+
+static uint32_t random_below(uint32_t n) {
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  return n == 0 ? 0 : (uint32_t) ((random_state * 2685821657736338717ULL) >> 32) % n;
+}
+
+static void add_pulse(std::vector<struct edge> & edges, uint64_t us, byte pin, uint16_t width) {
+  struct edge e;
+  e.pin = pin;
+  e.us = us;
+  e.level = LOW;
+  edges.push_back(e);
+  e.us = us + width;
+  e.level = HIGH;
+  edges.push_back(e);
+}
+
+// A frame a reader sent, and the millis() its last bit was sent at
+struct sent_frame {
+  uint32_t bits;
+  uint32_t last_ms;
+};
+
+// Appends the pulses of one frame starting at us, and returns when the next
+// bit would have started.
+static uint64_t add_frame(std::vector<struct edge> & edges, const struct scenario * s,
+                          byte reader, struct sent_frame * f, uint64_t us) {
+  uint32_t bits = f->bits;
+  for (int i = 25; i >= 0; i--) {
+    f->last_ms = us / 1000;
+    byte line = (bits >> i) & 1;
+    if (random_below(1000) < s->flip_per_mille) {
+      line ^= 1;
+    }
+    if (random_below(1000) >= s->drop_per_mille) {
+      add_pulse(edges, us, test_reader_pins[reader][line], s->width_us);
+    }
+    int32_t jitter = s->jitter_percent == 0 ? 0
+      : (int32_t) random_below(2 * s->period_us * s->jitter_percent / 100 + 1)
+        - s->period_us * s->jitter_percent / 100;
+    us += s->period_us + jitter;
+  }
+  return us;
+}
+
+struct result {
+  unsigned long sent;
+  unsigned long ok;
+  unsigned long false_accepts;
+  unsigned long rejected;
+  uint64_t line_us;
+  double ns;
+};
+
+// Takes one frame per pass, like the firmware's credentials task, and
+// matches it against the frame its reader finished sending when the frame
+// was captured.  Sent frames that finished earlier were dropped.
+static void poll(std::vector<struct sent_frame> * sent, size_t * next, struct result * r) {
+  tick_update();
+  wiegand_readers_loop();
+  struct wiegand_frame frame;
+  if (!wiegand_next_frame(&frame)) {
+    return;
+  }
+  std::vector<struct sent_frame> & mine = sent[frame.reader_num];
+  size_t & i = next[frame.reader_num];
+  while (i < mine.size() && mine[i].last_ms + 1 < frame.captured) {
+    i++;
+  }
+
+  struct wiegand_credential cred;
+  if (!wiegand_frame_decode(&frame, &cred)) {
+    r->rejected++;
+    return;
+  }
+  if (i < mine.size() && mine[i].last_ms <= frame.captured + 1
+    && cred.format == WIEGAND_FORMAT_26
+    && mine[i].bits == wiegand26_frame(cred.facility, cred.user)) {
+    r->ok++;
+    i++;
+    return;
+  }
+  r->false_accepts++;
+}
+
+static void run(const struct scenario * s, struct result * r) {
+  std::vector<struct sent_frame> sent[NUM_WIEGAND_READERS];
+  size_t next[NUM_WIEGAND_READERS] = { 0 };
+  std::vector<struct edge> edges;
+  memset(r, 0, sizeof(*r));
+
+  // Each reader sends its share of the frames, starting at slightly
+  // different times
+  uint64_t start = sim_now_us() + 1000;
+  uint64_t end = start;
+  for (byte reader = 0; reader < s->readers; reader++) {
+    uint64_t us = start + reader * 137;
+    for (int i = reader; i < FRAMES_PER_SCENARIO; i += s->readers) {
+      struct sent_frame f;
+      f.bits = wiegand26_frame(random_below(256), random_below(65536));
+      us = add_frame(edges, s, reader, &f, us) + s->gap_us;
+      sent[reader].push_back(f);
+    }
+    end = std::max(end, us);
+  }
+  r->sent = FRAMES_PER_SCENARIO;
+  r->line_us = end - start;
+
+  for (byte reader = 0; reader < s->readers; reader++) {
+    for (byte line = 0; line < 2; line++) {
+      unsigned long n = (unsigned long) (r->line_us * s->noise_per_s / 1000000);
+      for (unsigned long i = 0; i < n; i++) {
+        add_pulse(edges, start + random_below(r->line_us), test_reader_pins[reader][line],
+                  5 + random_below(s->width_us));
+      }
+    }
+  }
+  std::sort(edges.begin(), edges.end(), edge_before);
+
+  // Play the edges, polling the main loop between them.  Overlapping pulses
+  // on a line hold it low until the last one ends.
+  byte low_count[SIM_NUM_PINS] = { 0 };
+  uint64_t next_poll = start;
+  uint16_t overflows = wiegand_frame_overflows();
+  unsigned long interrupts = sim_counters.interrupts;
+  double started = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+  for (size_t i = 0; i < edges.size(); i++) {
+    const struct edge & e = edges[i];
+    while (next_poll <= e.us) {
+      sim_set_us(next_poll);
+      poll(sent, next, r);
+      next_poll += s->loop_us;
+    }
+    sim_set_us(e.us);
+    if (e.level == LOW && low_count[e.pin]++ == 0) {
+      sim_pin_set(e.pin, LOW);
+    } else if (e.level == HIGH && --low_count[e.pin] == 0) {
+      sim_pin_set(e.pin, HIGH);
+    }
+  }
+  // Let the last frames time out and drain the queue
+  uint64_t done = sim_now_us() + TIMEOUT_US + 1000
+    + (uint64_t) WIEGAND_FRAME_QUEUE_SIZE * s->loop_us;
+  while (next_poll <= done) {
+    sim_set_us(next_poll);
+    poll(sent, next, r);
+    next_poll += s->loop_us;
+  }
+  r->ns = std::chrono::duration<double, std::nano>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() - started;
+  overflows = wiegand_frame_overflows() - overflows;
+  interrupts = sim_counters.interrupts - interrupts;
+
+  printf("%-8s timeout %3d ms  %-14s %5.1f%% ok %6lu dropped %4lu false-acc %6lu rejected "
+         "%4u overflows %7.1f ok/sim-s %7.1f irq/frame %8.1f ns/frame\n",
+         capture_names[WIEGAND_CAPTURE], WIEGAND_INPUT_TIMEOUT_MS, s->name,
+         100.0 * r->ok / r->sent, r->sent - r->ok, r->false_accepts, r->rejected, overflows,
+         r->ok * 1e6 / r->line_us, (double) interrupts / r->sent, r->ns / r->sent);
+}
+
+int main() {
+  sim_reset();
+  setup();
+  sim_serial_take_output();
+
+  for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    struct result r;
+    run(&scenarios[i], &r);
+  }
+  return 0;
+}
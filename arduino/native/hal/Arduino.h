@@ -0,0 +1,165 @@
+// Simulated Arduino core for building the firmware natively on Linux.
+//
+// Only the parts of the Arduino API that the firmware uses are provided.  The
+// simulated board has SIM_NUM_PINS digital pins laid out linearly across
+// 8-bit ports (pin N is bit N % 8 of port N / 8) and every pin can trigger an
+// external interrupt and a pin change interrupt.  See sim.h for the
+// functions a test harness uses to drive the simulation.
+
+#ifndef ARDUINO_H
+#define ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE  1
+#define FALLING 2
+#define RISING  3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define SIM_NUM_PINS 24
+#define SIM_NUM_PORTS ((SIM_NUM_PINS + 7) / 8)
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+
+#define NOT_AN_INTERRUPT -1
+
+#ifndef F_CPU
+# define F_CPU 16000000UL
+#endif
+
+// Same size as an ATmega2560 so large credential tables fit.
+#ifndef E2END
+# define E2END 4095
+#endif
+
+#define _BV(bit) (1 << (bit))
+#define _SFR_BYTE(sfr) (sfr)
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Ports are numbered from 1 like the AVR core, where 0 is NOT_A_PORT.  As in
+// the core, the input registers are looked up in a table indexed by port
+// number whose entry for NOT_A_PORT is NULL.
+extern volatile uint8_t sim_port_inputs[SIM_NUM_PORTS];
+extern volatile uint8_t * const sim_port_input_registers[SIM_NUM_PORTS + 1];
+#define NOT_A_PORT 0
+#define digitalPinToPort(p) ((p) < SIM_NUM_PINS ? (p) / 8 + 1 : NOT_A_PORT)
+#define digitalPinToBitMask(p) ((uint8_t) _BV((p) % 8))
+#define portInputRegister(port) (sim_port_input_registers[(port)])
+
+#define digitalPinToInterrupt(p) ((p) < SIM_NUM_PINS ? (p) : NOT_AN_INTERRUPT)
+void attachInterrupt(uint8_t interrupt_num, void (*isr)(void), int mode);
+void detachInterrupt(uint8_t interrupt_num);
+
+// Pin change interrupts, one bank per port: bank N (bit N of PCICR and
+// PCMSKN) covers pins 8N to 8N + 7 and its vector is PCINTN_vect.
+extern volatile uint8_t PCICR;
+extern volatile uint8_t PCIFR;
+extern volatile uint8_t sim_pcmsk[SIM_NUM_PORTS];
+#define PCMSK0 (sim_pcmsk[0])
+#define PCMSK1 (sim_pcmsk[1])
+#define PCMSK2 (sim_pcmsk[2])
+#define digitalPinToPCICR(p) ((p) < SIM_NUM_PINS ? &PCICR : (volatile uint8_t *) 0)
+#define digitalPinToPCICRbit(p) ((p) / 8)
+#define digitalPinToPCMSK(p) ((p) < SIM_NUM_PINS ? &sim_pcmsk[(p) / 8] : (volatile uint8_t *) 0)
+#define digitalPinToPCMSKbit(p) ((p) % 8)
+
+// Timer 2 with its compare match A interrupt (TIMER2_COMPA_vect), always in
+// CTC mode.  See sim_timer_isr_cost_us in sim.h.
+extern volatile uint8_t TCCR2A;
+extern volatile uint8_t TCCR2B;
+extern volatile uint8_t OCR2A;
+extern volatile uint8_t TCNT2;
+extern volatile uint8_t TIMSK2;
+extern volatile uint8_t TIFR2;
+#define WGM21  1
+#define CS20   0
+#define CS21   1
+#define CS22   2
+#define OCIE2A 1
+#define OCF2A  1
+
+//////////////////////////////////////////////////////////////////////////////
+// Print and Serial
+//////////////////////////////////////////////////////////////////////////////
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t * buffer, size_t size);
+  size_t write(const char * str) {
+    return str == NULL ? 0 : write((const uint8_t *) str, strlen(str));
+  }
+
+  size_t print(const char * s);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+
+  size_t println(void);
+  size_t println(const char * s);
+  size_t println(char c);
+  size_t println(unsigned char n, int base = DEC);
+  size_t println(int n, int base = DEC);
+  size_t println(unsigned int n, int base = DEC);
+  size_t println(long n, int base = DEC);
+  size_t println(unsigned long n, int base = DEC);
+
+private:
+  size_t print_number(unsigned long n, int base);
+};
+
+// A serial port backed by a pair of file descriptors.  The harness decides
+// what they are connected to (pipes in tests, stdin/stdout for a standalone
+// simulator).
+class HardwareSerial : public Print {
+public:
+  void begin(unsigned long baud) { (void) baud; }
+  void end(void) {}
+  int available(void);
+  int peek(void);
+  int read(void);
+  int availableForWrite(void);
+  void flush(void) {}
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t * buffer, size_t size);
+  using Print::write;
+  operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,23 @@
+// Simulated EEPROM library backed by a RAM array of E2END + 1 bytes.
+//
+
+#ifndef EEPROM_H
+#define EEPROM_H
+
+#include <Arduino.h>
+
+class EEPROMClass {
+public:
+  uint8_t read(int address);
+  void write(int address, uint8_t value);
+  void update(int address, uint8_t value) {
+    if (read(address) != value) {
+      write(address, value);
+    }
+  }
+  uint16_t length() { return E2END + 1; }
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
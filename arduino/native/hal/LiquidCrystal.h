@@ -0,0 +1,25 @@
+// Simulated LiquidCrystal library.  Characters land in a RAM copy of the
+// display that the harness can inspect through sim.h.
+//
+
+#ifndef LIQUID_CRYSTAL_H
+#define LIQUID_CRYSTAL_H
+
+#include <Arduino.h>
+
+class LiquidCrystal : public Print {
+public:
+  LiquidCrystal(uint8_t rs, uint8_t enable,
+                uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7);
+  LiquidCrystal(uint8_t rs, uint8_t rw, uint8_t enable,
+                uint8_t d4, uint8_t d5, uint8_t d6, uint8_t d7);
+
+  void begin(uint8_t cols, uint8_t rows);
+  void clear();
+  void setCursor(uint8_t col, uint8_t row);
+  void createChar(uint8_t location, uint8_t charmap[]);
+  virtual size_t write(uint8_t c);
+  using Print::write;
+};
+
+#endif
@@ -0,0 +1,31 @@
+// Simulated Wire (I2C) library with one device on the bus: a 24LC256-class
+// 32 KiB EEPROM at address 0x50, which the harness can inspect through
+// sim.h.
+//
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <Arduino.h>
+
+// Bytes the library buffers per transaction, like the AVR core
+#define BUFFER_LENGTH 32
+
+class TwoWire : public Print {
+public:
+  void begin(void) {}
+  void beginTransmission(uint8_t address);
+  // 0 on success, 2 if no device acknowledged the address
+  uint8_t endTransmission(uint8_t send_stop = true);
+  // Returns the number of bytes received
+  uint8_t requestFrom(uint8_t address, uint8_t quantity);
+  int available(void);
+  int read(void);
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t * buffer, size_t size);
+  using Print::write;
+};
+
+extern TwoWire Wire;
+
+#endif
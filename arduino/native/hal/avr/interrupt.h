@@ -0,0 +1,12 @@
+// Simulated avr-libc interrupt vectors.  ISR() defines a vector as a plain
+// C function, which the simulator calls when the interrupt fires.  Only the
+// pin change and Timer 2 compare match A vectors are simulated (see
+// Arduino.h).
+//
+
+#ifndef AVR_INTERRUPT_H
+#define AVR_INTERRUPT_H
+
+#define ISR(vector) extern "C" void vector(void)
+
+#endif
@@ -0,0 +1,16 @@
+// Simulated avr-libc program memory access.  Flash data is ordinary memory.
+//
+
+#ifndef AVR_PGMSPACE_H
+#define AVR_PGMSPACE_H
+
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+
+#endif
@@ -0,0 +1,732 @@
+// Simulated board behind the native HAL headers.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <LiquidCrystal.h>
+#include <Wire.h>
+
+#include "sim.h"
+
+struct sim_counters sim_counters;
+unsigned long sim_eeprom_write_cost_us = 0;
+unsigned long sim_lcd_op_cost_us = 0;
+unsigned long sim_serial_tx_byte_cost_us = 0;
+unsigned long sim_i2c_byte_cost_us = 0;
+unsigned long sim_ext_eeprom_write_cycle_us = 0;
+bool sim_ext_eeprom_unplugged = false;
+
+// Referenced by arduino.ino for millis() rollover testing.
+volatile unsigned long timer0_millis;
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+TwoWire Wire;
+
+static uint64_t now_us;
+
+//////////////////////////////////////////////////////////////////////////////
+// Pins and Interrupts
+//////////////////////////////////////////////////////////////////////////////
+
+struct sim_pin {
+  uint8_t mode;
+  void (*isr)(void);
+  int isr_mode;
+};
+
+static struct sim_pin pins[SIM_NUM_PINS];
+
+// Pin levels, one bit per pin, read by the firmware through 
+// portInputRegister() and by digitalRead()
+volatile uint8_t sim_port_inputs[SIM_NUM_PORTS];
+
+#if SIM_NUM_PORTS != 3
+# error Update the port input registers and pin change vectors for SIM_NUM_PORTS.
+#endif
+
+volatile uint8_t * const sim_port_input_registers[SIM_NUM_PORTS + 1] = {
+  NULL, &sim_port_inputs[0], &sim_port_inputs[1], &sim_port_inputs[2]
+};
+
+volatile uint8_t PCICR;
+volatile uint8_t PCIFR;
+volatile uint8_t sim_pcmsk[SIM_NUM_PORTS];
+
+// Defined by the firmware with ISR() if it uses pin change interrupts
+extern "C" {
+void PCINT0_vect(void) __attribute__((weak));
+void PCINT1_vect(void) __attribute__((weak));
+void PCINT2_vect(void) __attribute__((weak));
+}
+
+static void (* const pcint_vectors[SIM_NUM_PORTS])(void) = {
+  PCINT0_vect, PCINT1_vect, PCINT2_vect
+};
+
+static uint8_t pin_level(uint8_t pin) {
+  return (sim_port_inputs[pin / 8] & _BV(pin % 8)) ? HIGH : LOW;
+}
+
+static void set_pin_level(uint8_t pin, uint8_t level) {
+  if (level) {
+    sim_port_inputs[pin / 8] |= _BV(pin % 8);
+  } else {
+    sim_port_inputs[pin / 8] &= ~_BV(pin % 8);
+  }
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (pin < SIM_NUM_PINS) {
+    pins[pin].mode = mode;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin < SIM_NUM_PINS && pins[pin].mode == OUTPUT) {
+    set_pin_level(pin, value);
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  return pin < SIM_NUM_PINS ? pin_level(pin) : LOW;
+}
+
+void attachInterrupt(uint8_t interrupt_num, void (*isr)(void), int mode) {
+  if (interrupt_num < SIM_NUM_PINS) {
+    pins[interrupt_num].isr = isr;
+    pins[interrupt_num].isr_mode = mode;
+  }
+}
+
+void detachInterrupt(uint8_t interrupt_num) {
+  if (interrupt_num < SIM_NUM_PINS) {
+    pins[interrupt_num].isr = NULL;
+  }
+}
+
+void sim_pin_set(uint8_t pin, uint8_t level) {
+  if (pin >= SIM_NUM_PINS) {
+    return;
+  }
+  struct sim_pin * p = &pins[pin];
+  level = level ? HIGH : LOW;
+  if (pin_level(pin) == level) {
+    return;
+  }
+  set_pin_level(pin, level);
+  if (p->isr != NULL
+    && (p->isr_mode == CHANGE
+      || (p->isr_mode == FALLING && level == LOW)
+      || (p->isr_mode == RISING && level == HIGH))) {
+    sim_counters.interrupts++;
+    p->isr();
+  }
+  // Either edge of a masked pin fires its bank's vector
+  uint8_t bank = pin / 8;
+  if ((PCICR & _BV(bank)) && (sim_pcmsk[bank] & _BV(pin % 8))
+    && pcint_vectors[bank] != NULL) {
+    sim_counters.interrupts++;
+    pcint_vectors[bank]();
+  }
+}
+
+uint8_t sim_pin_get(uint8_t pin) {
+  return digitalRead(pin);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Clock
+//////////////////////////////////////////////////////////////////////////////
+
+// Timer 2 and its compare match A interrupt, the only timer interrupt
+// simulated.  It runs in CTC mode whatever TCCR2A says: it counts up at the
+// prescaled clock and interrupts every OCR2A + 1 counts.
+volatile uint8_t TCCR2A;
+volatile uint8_t TCCR2B;
+volatile uint8_t OCR2A;
+volatile uint8_t TCNT2;
+volatile uint8_t TIMSK2;
+volatile uint8_t TIFR2;
+
+unsigned long sim_timer_isr_cost_us = 0;
+
+extern "C" void TIMER2_COMPA_vect(void) __attribute__((weak));
+
+// Indexed by the clock select bits CS22..CS20
+static const uint16_t timer2_prescalers[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+
+// The next compare match, or 0 while the interrupt is off
+static uint64_t timer2_next_us;
+
+// Microseconds between compare match interrupts, at least 1, or 0 if they
+// are off.
+static uint64_t timer2_period_us(void) {
+  uint16_t prescaler = timer2_prescalers[TCCR2B & 7];
+  if (prescaler == 0 || !(TIMSK2 & _BV(OCIE2A)) || TIMER2_COMPA_vect == NULL) {
+    return 0;
+  }
+  uint64_t period = (uint64_t) prescaler * (OCR2A + 1) / (F_CPU / 1000000);
+  return period > 0 ? period : 1;
+}
+
+// Moves the clock to us, firing the timer interrupts due on the way.  Each
+// one moves the clock on by sim_timer_isr_cost_us, which it finds in TCNT2.
+static void clock_to(uint64_t us) {
+  if (us < now_us) {
+    // The harness turned the clock back
+    now_us = us;
+    timer2_next_us = 0;
+    return;
+  }
+  uint64_t period = timer2_period_us();
+  if (period == 0) {
+    timer2_next_us = 0;
+  } else if (timer2_next_us == 0) {
+    timer2_next_us = now_us + period;
+  }
+  while (timer2_next_us != 0 && timer2_next_us <= us) {
+    if (now_us < timer2_next_us) {
+      now_us = timer2_next_us;
+    }
+    now_us += sim_timer_isr_cost_us;
+    uint64_t ticks = sim_timer_isr_cost_us * (F_CPU / 1000000)
+      / timer2_prescalers[TCCR2B & 7];
+    TCNT2 = ticks < OCR2A ? ticks : OCR2A;
+    TIFR2 |= _BV(OCF2A);
+    sim_counters.interrupts++;
+    TIMER2_COMPA_vect();
+    TIFR2 &= ~_BV(OCF2A);
+    period = timer2_period_us();
+    timer2_next_us = period == 0 ? 0 : timer2_next_us + period;
+  }
+  // The last interrupt may have run past us
+  if (now_us < us) {
+    now_us = us;
+  }
+}
+
+unsigned long millis(void) {
+  return (uint32_t) (now_us / 1000);
+}
+
+unsigned long micros(void) {
+  return (uint32_t) now_us;
+}
+
+void delay(unsigned long ms) {
+  clock_to(now_us + (uint64_t) ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  clock_to(now_us + us);
+}
+
+uint64_t sim_now_us(void) {
+  return now_us;
+}
+
+void sim_set_us(uint64_t us) {
+  clock_to(us);
+}
+
+void sim_advance_us(uint64_t us) {
+  clock_to(now_us + us);
+}
+
+void sim_set_millis(unsigned long ms) {
+  clock_to((uint64_t) (uint32_t) ms * 1000);
+}
+
+void sim_advance_millis(unsigned long ms) {
+  clock_to(now_us + (uint64_t) ms * 1000);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// EEPROM
+//////////////////////////////////////////////////////////////////////////////
+
+static uint8_t eeprom[E2END + 1];
+
+uint8_t EEPROMClass::read(int address) {
+  sim_counters.eeprom_reads++;
+  if (address < 0 || address > E2END) {
+    return 0xff;
+  }
+  return eeprom[address];
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  sim_counters.eeprom_writes++;
+  clock_to(now_us + sim_eeprom_write_cost_us);
+  if (address >= 0 && address <= E2END) {
+    eeprom[address] = value;
+  }
+}
+
+uint8_t * sim_eeprom(void) {
+  return eeprom;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Wire and the external EEPROM
+//////////////////////////////////////////////////////////////////////////////
+
+#define EXT_EEPROM_ADDRESS   0x50
+#define EXT_EEPROM_SIZE      32768
+#define EXT_EEPROM_PAGE_SIZE 64
+
+static uint8_t ext_eeprom[EXT_EEPROM_SIZE];
+// The address the next read or write starts at
+static uint16_t ext_eeprom_pointer;
+// The device ignores its address until a write cycle ends
+static uint64_t ext_eeprom_busy_until_us;
+
+static uint8_t wire_tx_address;
+static uint8_t wire_tx[BUFFER_LENGTH];
+static uint8_t wire_tx_len;
+static uint8_t wire_rx[BUFFER_LENGTH];
+static uint8_t wire_rx_len;
+static uint8_t wire_rx_next;
+
+// Charges the bus time of a transaction of size bytes after the address
+// byte.
+static void wire_transaction(size_t size) {
+  sim_counters.i2c_transactions++;
+  clock_to(now_us + (size + 1) * sim_i2c_byte_cost_us);
+}
+
+// A transaction nobody acknowledged.  It costs at least 1 us so that
+// polling a busy device moves the clock even with a free bus.
+static void wire_nack(void) {
+  wire_transaction(0);
+  if (sim_i2c_byte_cost_us == 0) {
+    clock_to(now_us + 1);
+  }
+}
+
+static bool ext_eeprom_acks(uint8_t address) {
+  return address == EXT_EEPROM_ADDRESS && !sim_ext_eeprom_unplugged
+    && now_us >= ext_eeprom_busy_until_us;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+  wire_tx_address = address;
+  wire_tx_len = 0;
+}
+
+size_t TwoWire::write(uint8_t c) {
+  if (wire_tx_len == BUFFER_LENGTH) {
+    return 0;
+  }
+  wire_tx[wire_tx_len++] = c;
+  return 1;
+}
+
+size_t TwoWire::write(const uint8_t * buffer, size_t size) {
+  size_t n = 0;
+  while (n < size && write(buffer[n])) {
+    n++;
+  }
+  return n;
+}
+
+// The first two bytes set the address pointer.  Bytes after them are
+// written to the pointer's page, wrapping around within it, and start a
+// write cycle.
+uint8_t TwoWire::endTransmission(uint8_t) {
+  if (!ext_eeprom_acks(wire_tx_address)) {
+    wire_nack();
+    return 2;
+  }
+  wire_transaction(wire_tx_len);
+  if (wire_tx_len < 2) {
+    return 0;
+  }
+  ext_eeprom_pointer = ((wire_tx[0] << 8) | wire_tx[1]) % EXT_EEPROM_SIZE;
+  if (wire_tx_len == 2) {
+    return 0;
+  }
+  uint16_t page = ext_eeprom_pointer & ~(EXT_EEPROM_PAGE_SIZE - 1);
+  for (uint8_t i = 2; i < wire_tx_len; i++) {
+    ext_eeprom[ext_eeprom_pointer] = wire_tx[i];
+    sim_counters.eeprom_writes++;
+    ext_eeprom_pointer = page | ((ext_eeprom_pointer + 1) & (EXT_EEPROM_PAGE_SIZE - 1));
+  }
+  ext_eeprom_busy_until_us = now_us + sim_ext_eeprom_write_cycle_us;
+  return 0;
+}
+
+// Reads go on from the address pointer, wrapping around at the end of the
+// memory.
+uint8_t TwoWire::requestFrom(uint8_t address, uint8_t quantity) {
+  wire_rx_len = 0;
+  wire_rx_next = 0;
+  if (!ext_eeprom_acks(address)) {
+    wire_nack();
+    return 0;
+  }
+  if (quantity > BUFFER_LENGTH) {
+    quantity = BUFFER_LENGTH;
+  }
+  wire_transaction(quantity);
+  while (wire_rx_len < quantity) {
+    wire_rx[wire_rx_len++] = ext_eeprom[ext_eeprom_pointer];
+    sim_counters.eeprom_reads++;
+    ext_eeprom_pointer = (ext_eeprom_pointer + 1) % EXT_EEPROM_SIZE;
+  }
+  return wire_rx_len;
+}
+
+int TwoWire::available(void) {
+  return wire_rx_len - wire_rx_next;
+}
+
+int TwoWire::read(void) {
+  return wire_rx_next < wire_rx_len ? wire_rx[wire_rx_next++] : -1;
+}
+
+uint8_t * sim_ext_eeprom(void) {
+  return ext_eeprom;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Print
+//////////////////////////////////////////////////////////////////////////////
+
+size_t Print::write(const uint8_t * buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print_number(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char * str = &buf[sizeof(buf) - 1];
+  *str = 0;
+  if (base < 2) {
+    base = 10;
+  }
+  do {
+    unsigned long m = n;
+    n /= base;
+    char c = m - base * n;
+    *--str = c < 10 ? c + '0' : c + 'A' - 10;
+  } while (n);
+  return write(str);
+}
+
+size_t Print::print(const char * s) { return write(s); }
+size_t Print::print(char c) { return write((uint8_t) c); }
+size_t Print::print(unsigned char n, int base) { return print_number(n, base); }
+size_t Print::print(unsigned int n, int base) { return print_number(n, base); }
+size_t Print::print(unsigned long n, int base) { return print_number(n, base); }
+size_t Print::print(int n, int base) { return print((long) n, base); }
+
+size_t Print::print(long n, int base) {
+  if (base == 10 && n < 0) {
+    return print('-') + print_number(-(unsigned long) n, 10);
+  }
+  return print_number((unsigned long) n, base);
+}
+
+size_t Print::println(void) { return write("\r\n"); }
+size_t Print::println(const char * s) { return print(s) + println(); }
+size_t Print::println(char c) { return print(c) + println(); }
+size_t Print::println(unsigned char n, int base) { return print(n, base) + println(); }
+size_t Print::println(int n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned int n, int base) { return print(n, base) + println(); }
+size_t Print::println(long n, int base) { return print(n, base) + println(); }
+size_t Print::println(unsigned long n, int base) { return print(n, base) + println(); }
+
+//////////////////////////////////////////////////////////////////////////////
+// Serial
+//////////////////////////////////////////////////////////////////////////////
+
+// File descriptors the firmware reads from and writes to
+static int serial_in_fd = -1;
+static int serial_out_fd = -1;
+
+// The harness ends of the simulator-owned pipes
+static int harness_in_fd = -1;
+static int harness_out_fd = -1;
+
+// Output that did not fit in the pipe, handed out before newer pipe data
+static std::string serial_spill;
+
+// When the simulated UART finishes sending what is in the transmit buffer
+static uint64_t serial_tx_done_us;
+
+#define SERIAL_TX_BUFFER_ROOM 63
+
+static void close_fd(int * fd) {
+  if (*fd >= 0) {
+    close(*fd);
+    *fd = -1;
+  }
+}
+
+static void serial_open_pipes(void) {
+  int to_firmware[2];
+  int from_firmware[2];
+  if (pipe(to_firmware) != 0 || pipe(from_firmware) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fcntl(from_firmware[0], F_SETFL, O_NONBLOCK);
+  fcntl(from_firmware[1], F_SETFL, O_NONBLOCK);
+  serial_in_fd = to_firmware[0];
+  harness_in_fd = to_firmware[1];
+  harness_out_fd = from_firmware[0];
+  serial_out_fd = from_firmware[1];
+}
+
+static void serial_close(void) {
+  close_fd(&harness_in_fd);
+  close_fd(&harness_out_fd);
+  if (serial_in_fd > 2) {
+    close(serial_in_fd);
+  }
+  if (serial_out_fd > 2) {
+    close(serial_out_fd);
+  }
+  serial_in_fd = -1;
+  serial_out_fd = -1;
+  serial_spill.clear();
+  serial_tx_done_us = 0;
+}
+
+void sim_serial_attach(int in_fd, int out_fd) {
+  serial_close();
+  serial_in_fd = in_fd;
+  serial_out_fd = out_fd;
+}
+
+int HardwareSerial::available(void) {
+  int n = 0;
+  if (serial_in_fd < 0 || ioctl(serial_in_fd, FIONREAD, &n) != 0) {
+    return 0;
+  }
+  return n;
+}
+
+int HardwareSerial::peek(void) {
+  // Not used by the firmware.  Reading ahead would need a buffer.
+  return -1;
+}
+
+int HardwareSerial::read(void) {
+  uint8_t c;
+  if (available() <= 0 || ::read(serial_in_fd, &c, 1) != 1) {
+    return -1;
+  }
+  return c;
+}
+
+// Bytes in the transmit buffer the UART hasn't sent yet
+static uint64_t serial_tx_pending(void) {
+  if (sim_serial_tx_byte_cost_us == 0 || serial_tx_done_us <= now_us) {
+    return 0;
+  }
+  return (serial_tx_done_us - now_us + sim_serial_tx_byte_cost_us - 1)
+    / sim_serial_tx_byte_cost_us;
+}
+
+int HardwareSerial::availableForWrite(void) {
+  // Matches the AVR core's 64-byte transmit buffer
+  return SERIAL_TX_BUFFER_ROOM - serial_tx_pending();
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t * buffer, size_t size) {
+  if (serial_out_fd < 0) {
+    return 0;
+  }
+  if (sim_serial_tx_byte_cost_us != 0) {
+    for (size_t i = 0; i < size; i++) {
+      if (serial_tx_pending() >= SERIAL_TX_BUFFER_ROOM) {
+        // Wait for the UART to make room, like the AVR core does
+        clock_to(serial_tx_done_us - (SERIAL_TX_BUFFER_ROOM - 1) * sim_serial_tx_byte_cost_us);
+      }
+      serial_tx_done_us = (serial_tx_done_us > now_us ? serial_tx_done_us : now_us)
+        + sim_serial_tx_byte_cost_us;
+    }
+  }
+  size_t done = 0;
+  if (serial_spill.empty()) {
+    while (done < size) {
+      ssize_t n = ::write(serial_out_fd, buffer + done, size - done);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      done += n;
+    }
+  }
+  serial_spill.append((const char *) buffer + done, size - done);
+  return size;
+}
+
+void sim_serial_send(const char * text) {
+  size_t len = strlen(text);
+  while (len > 0) {
+    ssize_t n = ::write(harness_in_fd, text, len);
+    if (n <= 0) {
+      perror("sim_serial_send");
+      exit(1);
+    }
+    text += n;
+    len -= n;
+  }
+}
+
+std::string sim_serial_take_output(void) {
+  std::string out;
+  char buf[4096];
+  ssize_t n;
+  while (harness_out_fd >= 0 && (n = ::read(harness_out_fd, buf, sizeof(buf))) > 0) {
+    out.append(buf, n);
+  }
+  // The spill holds output written after the pipe filled, so it follows
+  // everything that was in the pipe.
+  out += serial_spill;
+  serial_spill.clear();
+  return out;
+}
+
+static bool ends_with_line(const std::string & s, const char * line) {
+  std::string tail = std::string(line) + "\r\n";
+  if (s.size() < tail.size()) {
+    return false;
+  }
+  if (s.compare(s.size() - tail.size(), tail.size(), tail) != 0) {
+    return false;
+  }
+  return s.size() == tail.size() || s[s.size() - tail.size() - 1] == '\n';
+}
+
+std::string sim_command(const char * line, int max_loops) {
+  std::string out = sim_serial_take_output();
+  sim_serial_send(line);
+  sim_serial_send("\n");
+  out.clear();
+  for (int i = 0; i < max_loops; i++) {
+    loop();
+    out += sim_serial_take_output();
+    if (ends_with_line(out, "ok") || ends_with_line(out, "err")) {
+      break;
+    }
+  }
+  return out;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// LiquidCrystal
+//////////////////////////////////////////////////////////////////////////////
+
+#define LCD_COLS 20
+#define LCD_ROWS 4
+
+static char lcd_rows[LCD_ROWS][LCD_COLS + 1];
+static uint8_t lcd_col;
+static uint8_t lcd_row;
+
+static void lcd_op(void) {
+  sim_counters.lcd_ops++;
+  clock_to(now_us + sim_lcd_op_cost_us);
+}
+
+static void lcd_blank(void) {
+  for (int r = 0; r < LCD_ROWS; r++) {
+    memset(lcd_rows[r], ' ', LCD_COLS);
+    lcd_rows[r][LCD_COLS] = 0;
+  }
+  lcd_col = 0;
+  lcd_row = 0;
+}
+
+LiquidCrystal::LiquidCrystal(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t) {}
+LiquidCrystal::LiquidCrystal(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, uint8_t) {}
+
+void LiquidCrystal::begin(uint8_t, uint8_t) {
+  lcd_op();
+}
+
+void LiquidCrystal::clear() {
+  lcd_op();
+  lcd_blank();
+}
+
+void LiquidCrystal::setCursor(uint8_t col, uint8_t row) {
+  lcd_op();
+  lcd_col = col;
+  lcd_row = row;
+}
+
+void LiquidCrystal::createChar(uint8_t, uint8_t[]) {
+  lcd_op();
+}
+
+size_t LiquidCrystal::write(uint8_t c) {
+  lcd_op();
+  if (lcd_row < LCD_ROWS && lcd_col < LCD_COLS) {
+    // Custom characters 0-7 show up as digits so rows stay printable
+    lcd_rows[lcd_row][lcd_col] = c < 8 ? '0' + c : c;
+  }
+  lcd_col++;
+  return 1;
+}
+
+const char * sim_lcd_row(uint8_t row) {
+  return row < LCD_ROWS ? lcd_rows[row] : "";
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reset
+//////////////////////////////////////////////////////////////////////////////
+
+void sim_reset(void) {
+  now_us = 0;
+  memset(&sim_counters, 0, sizeof(sim_counters));
+  memset(eeprom, 0xff, sizeof(eeprom));
+  memset(ext_eeprom, 0xff, sizeof(ext_eeprom));
+  ext_eeprom_pointer = 0;
+  ext_eeprom_busy_until_us = 0;
+  sim_ext_eeprom_unplugged = false;
+  wire_tx_len = 0;
+  wire_rx_len = 0;
+  wire_rx_next = 0;
+  for (int i = 0; i < SIM_NUM_PINS; i++) {
+    pins[i].mode = INPUT;
+    pins[i].isr = NULL;
+    pins[i].isr_mode = 0;
+  }
+  memset((void *) sim_port_inputs, 0xff, sizeof(sim_port_inputs));
+  TCCR2A = 0;
+  TCCR2B = 0;
+  OCR2A = 0;
+  TCNT2 = 0;
+  TIMSK2 = 0;
+  TIFR2 = 0;
+  timer2_next_us = 0;
+  sim_timer_isr_cost_us = 0;
+  PCICR = 0;
+  PCIFR = 0;
+  memset((void *) sim_pcmsk, 0, sizeof(sim_pcmsk));
+  lcd_blank();
+  serial_close();
+  serial_open_pipes();
+}
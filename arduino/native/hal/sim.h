@@ -0,0 +1,92 @@
+// Controls for the simulated board.  Test and benchmark programs include this
+// to reset the board, move the clock, drive input pins and talk to the
+// firmware over Serial.
+//
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <string>
+
+#include <Arduino.h>
+
+// Defined by arduino.ino
+void setup();
+void loop();
+
+// EEPROM reads and writes count bytes moved to or from the internal or the
+// external EEPROM.
+struct sim_counters {
+  unsigned long eeprom_reads;
+  unsigned long eeprom_writes;
+  unsigned long i2c_transactions;
+  unsigned long lcd_ops;
+  unsigned long interrupts;
+};
+
+extern struct sim_counters sim_counters;
+
+// Simulated time charged for each EEPROM byte write and each LiquidCrystal
+// operation.  Both default to 0 so tests control the clock exactly;
+// benchmarks set them to model the real hardware's busy-waits.
+extern unsigned long sim_eeprom_write_cost_us;
+extern unsigned long sim_lcd_op_cost_us;
+
+// Time the UART takes to send one byte (87 at 115200 baud).  When it is not
+// 0, Serial's 64-byte transmit buffer drains at that rate and a write to a
+// full buffer waits for room, moving the clock.  Defaults to 0, an instant
+// UART.
+extern unsigned long sim_serial_tx_byte_cost_us;
+
+// Time the I2C bus takes per byte (23 at 400 kHz) and the time the external
+// EEPROM spends on each page write (5000 for a 24LC256), during which it
+// doesn't acknowledge its address.  Both default to 0.
+extern unsigned long sim_i2c_byte_cost_us;
+extern unsigned long sim_ext_eeprom_write_cycle_us;
+
+// While true the external EEPROM acknowledges nothing, as if it were
+// unplugged.  sim_reset() plugs it back in.
+extern bool sim_ext_eeprom_unplugged;
+
+// Time each Timer 2 interrupt takes.  The clock moves on by that much, and
+// the ISR finds it in TCNT2 as the counts since the compare match.  Defaults
+// to 0.
+extern unsigned long sim_timer_isr_cost_us;
+
+// Puts the board in its power-on state: erased (0xff) EEPROMs, clock at 0,
+// all input pins pulled HIGH, no interrupts attached, blank display, zeroed
+// counters and fresh Serial pipes.
+void sim_reset(void);
+
+// Clock
+uint64_t sim_now_us(void);
+void sim_set_us(uint64_t us);
+void sim_advance_us(uint64_t us);
+void sim_set_millis(unsigned long ms);
+void sim_advance_millis(unsigned long ms);
+
+// Pins.  Driving an input fires any external interrupt attached to it and
+// the pin change interrupt of its bank if the pin is masked in.
+void sim_pin_set(uint8_t pin, uint8_t level);
+uint8_t sim_pin_get(uint8_t pin);
+
+// EEPROM contents: the internal EEPROM (E2END + 1 bytes) and the external
+// I2C EEPROM (32 KiB)
+uint8_t * sim_eeprom(void);
+uint8_t * sim_ext_eeprom(void);
+
+// Serial.  By default Serial reads from and writes to pipes owned by the
+// simulator; sim_serial_attach() points it somewhere else, like stdin and
+// stdout.
+void sim_serial_attach(int in_fd, int out_fd);
+void sim_serial_send(const char * text);
+std::string sim_serial_take_output(void);
+
+// Sends one command line, runs loop() until the response ends in "ok" or
+// "err" (or max_loops passes) and returns everything printed meanwhile.
+std::string sim_command(const char * line, int max_loops = 1000);
+
+// Display contents, one NUL-terminated string per row.
+const char * sim_lcd_row(uint8_t row);
+
+#endif
@@ -0,0 +1,13 @@
+// Simulated avr-libc atomic blocks.  Simulated interrupts only fire from the
+// harness thread between firmware calls, so the block just runs its body once.
+//
+
+#ifndef UTIL_ATOMIC_H
+#define UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type) for (int _atomic_once = 1; _atomic_once; _atomic_once = 0)
+
+#endif
@@ -0,0 +1,31 @@
+// Runs the firmware with Serial on stdin and stdout, so the CLI can be used
+// interactively or driven by host software through a pipe or pty.
+//
+// The simulated clock follows the wall clock.
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+static uint64_t wall_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char ** argv) {
+  sim_reset();
+  sim_serial_attach(STDIN_FILENO, STDOUT_FILENO);
+
+  uint64_t start = wall_us();
+  setup();
+  for (;;) {
+    sim_set_us(wall_us() - start);
+    loop();
+    // Keep an idle simulator from spinning a CPU
+    usleep(200);
+  }
+  return 0;
+}
@@ -0,0 +1,85 @@
+// Minimal test support shared by the native tests and benchmarks.
+//
+
+#ifndef NATIVE_TEST_H
+#define NATIVE_TEST_H
+
+#include <stdio.h>
+#include <string>
+
+#include "sim.h"
+#include "config.h"
+#include "wiegand.h"
+#include "tick.h"
+
+// Unused by the benchmarks, which include this only for the helpers below
+static int test_failures __attribute__((unused)) = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_STR(actual, expected) do { \
+    std::string _a = (actual); \
+    std::string _e = (expected); \
+    if (_a != _e) { \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n  expected: \"%s\"\n  actual:   \"%s\"\n", \
+              __FILE__, __LINE__, #actual, _e.c_str(), _a.c_str()); \
+      test_failures++; \
+    } \
+  } while (0)
+
+// Runs a test function on a freshly reset and set up board.
+#define RUN_TEST(fn) do { \
+    sim_reset(); \
+    setup(); \
+    sim_serial_take_output(); \
+    fn(); \
+  } while (0)
+
+#define TEST_EXIT_STATUS (test_failures == 0 ? 0 : 1)
+
+// Reader DATA0/DATA1 pins, from config.h
+static const byte test_reader_pins[NUM_WIEGAND_READERS][2] = WIEGAND_READER_PINS;
+
+// Builds the 26 bits of a Wiegand-26 frame: even parity over the first 13
+// bits, 8 facility bits, 16 user bits and odd parity over the last 13 bits.
+static inline uint32_t wiegand26_frame(uint8_t facility, uint16_t user) {
+  uint32_t data = ((uint32_t) facility << 16) | user;
+  uint32_t bits = data << 1;
+  if (__builtin_popcount(data >> 12) % 2 == 1) {
+    bits |= 1UL << 25;
+  }
+  if (__builtin_popcount(data & 0xfff) % 2 == 0) {
+    bits |= 1;
+  }
+  return bits;
+}
+
+// Clocks count bits out on a reader's data lines, most significant first,
+// with 50 us pulses every 1 ms like a typical reader.
+static inline void send_wiegand_bits(byte reader, uint64_t bits, byte count) {
+  for (int i = count - 1; i >= 0; i--) {
+    byte pin = test_reader_pins[reader][(bits >> i) & 1];
+    sim_pin_set(pin, LOW);
+    sim_advance_us(50);
+    sim_pin_set(pin, HIGH);
+    sim_advance_us(950);
+  }
+}
+
+// Sends a complete frame and lets the lines go idle long enough to close
+// it, as the main loop would.  Frames shorter than the longest enabled
+// format only end when the reader goes quiet.
+static inline void send_wiegand_frame(byte reader, uint64_t bits, byte count) {
+  send_wiegand_bits(reader, bits, count);
+  sim_advance_millis(WIEGAND_INPUT_TIMEOUT_MS + 1);
+  // As the start of a loop iteration would
+  tick_update();
+  wiegand_readers_loop();
+}
+
+#endif
@@ -0,0 +1,306 @@
+// Command line interface tests.  Built once per WIEGAND26_LAYOUT.
+//
+
+#include "test.h"
+#include "storage.h"
+
+static void test_empty_command() {
+  CHECK_STR(sim_command(""), "ok\r\n");
+}
+
+static void test_invalid_command() {
+  CHECK_STR(sim_command("z"), "invalid command\r\nerr\r\n");
+  CHECK_STR(sim_command("r"), "missing type\r\nerr\r\n");
+  CHECK_STR(sim_command("r w99 1"), "invalid type\r\nerr\r\n");
+  CHECK_STR(sim_command("r w26"), "missing index\r\nerr\r\n");
+  CHECK_STR(sim_command("r w26 x"), "invalid index\r\nerr\r\n");
+}
+
+static void test_command_too_long() {
+  std::string line(60, 'w');
+  std::string out = sim_command(line.c_str());
+  CHECK(out.find("command too long\r\nerr\r\n") != std::string::npos);
+  CHECK_STR(sim_command(""), "ok\r\n");
+}
+
+static void test_write_read() {
+  CHECK_STR(sim_command("w w26 3 103 26441"), "ok\r\n");
+  CHECK_STR(sim_command("r w26 3"), "3 103 26441\r\nok\r\n");
+  char line[40];
+  snprintf(line, sizeof(line), "r w26 %d", WIEGAND26_MAX_CREDS);
+  CHECK_STR(sim_command(line), "index too large\r\nerr\r\n");
+}
+
+static void test_clear_and_list() {
+  // Erased slots are already empty and are left alone
+  CHECK_STR(sim_command("w w26 2 1 1"), "ok\r\n");
+  CHECK_STR(sim_command("w w26 5 0 0"), "ok\r\n");
+  unsigned long writes = sim_counters.eeprom_writes;
+  CHECK_STR(sim_command("x w26"), "ok\r\n");
+  CHECK(sim_counters.eeprom_writes - writes == 2);
+  std::string expected;
+  for (int i = 0; i < WIEGAND26_MAX_CREDS; i++) {
+    expected += std::to_string(i) + (i == 2 || i == 5 ? " 0 0\r\n" : " 255 65535\r\n");
+  }
+  expected += "ok\r\n";
+  CHECK_STR(sim_command("l w26", 100000), expected);
+}
+
+static void test_clear_runs_across_loops() {
+  for (int i = 0; i < 10; i++) {
+    char line[40];
+    snprintf(line, sizeof(line), "w w26 %d 1 %d", i, i + 1);
+    sim_command(line);
+  }
+  sim_serial_send("x w26\nr w26 0\n");
+  int loops = 0;
+  std::string out;
+  while (out.find("ok\r\n") == std::string::npos && loops < 1000) {
+    loop();
+    loops++;
+    out += sim_serial_take_output();
+    // The read waits for the clear
+    CHECK(out.find("0 1 1") == std::string::npos);
+  }
+  CHECK(loops >= 10);
+  // The read runs in the pass that finishes the clear
+  CHECK_STR(out, "ok\r\n0 0 0\r\nok\r\n");
+}
+
+static void test_list_runs_across_loops() {
+  sim_command("a w26 1 1");
+  sim_serial_send("l w26\n");
+  loop();
+  loop();
+  // A credential presented during the listing is checked right away
+  send_wiegand_frame(0, wiegand26_frame(1, 1), 26);
+  loop();
+  loop();
+  CHECK(sim_pin_get(8) == HIGH);
+  std::string out = sim_serial_take_output();
+  CHECK(out.find("0 ") == 0);
+  CHECK(out.find("!access 1 ") != std::string::npos);
+  CHECK(out.find("\r\nok\r\n") == std::string::npos);
+  for (int i = 0; i < 100000 && out.find("\r\nok\r\n") == std::string::npos; i++) {
+    loop();
+    out += sim_serial_take_output();
+  }
+  // Every slot is listed
+  std::string last = std::to_string(WIEGAND26_MAX_CREDS - 1) + " ";
+  CHECK(out.find("\r\n" + last) != std::string::npos);
+  CHECK(out.find("\r\n" + last) < out.find("\r\nok\r\n"));
+}
+
+static void test_list_lines_between_traces() {
+  sim_command("a w26 1 1");
+  sim_serial_send("l w26\n");
+  loop();
+  loop();
+  send_wiegand_frame(0, wiegand26_frame(1, 1), 26);
+  std::string out = sim_serial_take_output();
+  for (int i = 0; i < 100000 && out.find("\r\nok\r\n") == std::string::npos; i++) {
+    loop();
+    out += sim_serial_take_output();
+  }
+
+  // The badge's traces and event land inside the response, and every other
+  // line is the next slot
+  int traces = 0;
+  int granted = 0;
+  int index = 0;
+  size_t start = 0;
+  for (size_t end; (end = out.find("\r\n", start)) != std::string::npos; start = end + 2) {
+    std::string line = out.substr(start, end - start);
+    if (line[0] == '#') {
+      traces++;
+    } else if (line[0] == '!') {
+      granted += line.find("!access 1 ") == 0;
+    } else if (line != "ok") {
+      unsigned facility;
+      unsigned user;
+      char rest;
+      CHECK(sscanf(line.c_str(), "%*d %u %u%c", &facility, &user, &rest) == 2);
+      CHECK(line.find(std::to_string(index++) + " ") == 0);
+    }
+  }
+  CHECK(out.find("0 ") == 0);
+  CHECK(traces > 0);
+  CHECK(granted == 1);
+  CHECK(index == WIEGAND26_MAX_CREDS);
+  CHECK(out.find("\r\nok\r\n") == out.size() - 6);
+}
+
+static void test_writes_skip_unchanged_bytes() {
+  sim_command("w w26 3 103 26441");
+  unsigned long writes = sim_counters.eeprom_writes;
+  CHECK_STR(sim_command("w w26 3 103 26441"), "ok\r\n");
+  CHECK(sim_counters.eeprom_writes == writes);
+  // Only the low user byte changes
+  CHECK_STR(sim_command("w w26 3 103 26442"), "ok\r\n");
+  CHECK(sim_counters.eeprom_writes == writes + 1);
+}
+
+static void test_wear() {
+  std::string before = sim_command("e");
+  CHECK(before.find("w26 0 ") == 0);
+  // 30 byte writes, 3 per credential, save the count when it passes 16
+  for (int i = 0; i < 10; i++) {
+    char line[40];
+    snprintf(line, sizeof(line), "w w26 %d 1 %d", i, i + 1);
+    sim_command(line);
+  }
+  char expected[80];
+  snprintf(expected, sizeof(expected), "w26 30 %d\r\nw34 0 %d\r\nw37 0 %d\r\nok\r\n",
+           WIEGAND26_MAX_CREDS * 3, WIEGAND34_MAX_CREDS * 4, WIEGAND37_MAX_CREDS * 5);
+  CHECK_STR(sim_command("e"), expected);
+
+  // After a reset the saved count is back, less what wasn't saved yet
+  setup();
+  sim_serial_take_output();
+  CHECK(sim_command("e").find("w26 18 ") == 0);
+}
+
+static void test_add_delete() {
+  sim_command("x w26");
+  std::string added = sim_command("a w26 103 26441");
+  CHECK(added.find(" 103 26441\r\nok\r\n") != std::string::npos);
+  CHECK_STR(sim_command("a w26 103 26441"), added);
+  CHECK_STR(sim_command("d w26 103 26441"), added);
+  CHECK_STR(sim_command("d w26 103 26441"), "not found\r\nerr\r\n");
+  CHECK_STR(sim_command("a w26 0 0"), "reserved credential\r\nerr\r\n");
+}
+
+static void test_info() {
+  char expected[80];
+  snprintf(expected, sizeof(expected),
+           "w26 %d %s\r\nw34 %d flat\r\nw37 %d flat\r\nr26 %d rule\r\nok\r\n",
+           WIEGAND26_MAX_CREDS, WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED ? "hash" : "flat",
+           WIEGAND34_MAX_CREDS, WIEGAND37_MAX_CREDS, WIEGAND26_MAX_RULES);
+  CHECK_STR(sim_command("i"), expected);
+}
+
+static void test_longer_formats() {
+  CHECK_STR(sim_command("w w26 0 5 5"), "ok\r\n");
+  CHECK_STR(sim_command("x w34"), "ok\r\n");
+  CHECK_STR(sim_command("w w34 2 65535 60000"), "ok\r\n");
+  CHECK_STR(sim_command("r w34 2"), "2 65535 60000\r\nok\r\n");
+  CHECK_STR(sim_command("w w34 2 65536 1"), "missing facility\r\nerr\r\n");
+  CHECK_STR(sim_command("w w34 2 1 -1"), "missing user\r\nerr\r\n");
+  CHECK_STR(sim_command("a w34 65535 65535"), "reserved credential\r\nerr\r\n");
+
+  CHECK_STR(sim_command("x w37"), "ok\r\n");
+  CHECK_STR(sim_command("a w37 65535 524287"), "0 65535 524287\r\nok\r\n");
+  CHECK_STR(sim_command("a w37 1 2"), "1 1 2\r\nok\r\n");
+  CHECK_STR(sim_command("a w37 1 524288"), "missing user\r\nerr\r\n");
+  CHECK_STR(sim_command("d w37 65535 524287"), "0 65535 524287\r\nok\r\n");
+  CHECK_STR(sim_command("a w37 7 7"), "0 7 7\r\nok\r\n");
+  CHECK_STR(sim_command("d w37 65535 524287"), "not found\r\nerr\r\n");
+
+  // Zones are separate
+  CHECK_STR(sim_command("r w34 2"), "2 65535 60000\r\nok\r\n");
+  CHECK_STR(sim_command("r w26 0"), "0 5 5\r\nok\r\n");
+
+  // w35 has no storage by default
+  CHECK_STR(sim_command("l w35"), "invalid type\r\nerr\r\n");
+}
+
+static void test_longer_formats_on_erased_eeprom() {
+  // Erased slots are free without clearing the zone first
+  CHECK_STR(sim_command("a w37 1 1"), "0 1 1\r\nok\r\n");
+  CHECK_STR(sim_command("a w34 2 2"), "0 2 2\r\nok\r\n");
+  CHECK_STR(sim_command("a w37 65535 524287"), "1 65535 524287\r\nok\r\n");
+  CHECK_STR(sim_command("d w37 1 1"), "0 1 1\r\nok\r\n");
+  CHECK_STR(sim_command("a w37 3 3"), "0 3 3\r\nok\r\n");
+}
+
+static void test_rules() {
+  CHECK_STR(sim_command("w r26 0 allow 103 1000 1199"), "ok\r\n");
+  CHECK_STR(sim_command("r r26 0"), "0 allow 103 1000 1199\r\nok\r\n");
+  CHECK_STR(sim_command("w r26 1 allow 104"), "ok\r\n");
+  CHECK_STR(sim_command("r r26 1"), "1 allow 104 0 65535\r\nok\r\n");
+  CHECK_STR(sim_command("a r26 deny 103 1042"), "2 deny 103 1042 1042\r\nok\r\n");
+  CHECK_STR(sim_command("a r26 deny 103 1042"), "2 deny 103 1042 1042\r\nok\r\n");
+
+  CHECK_STR(sim_command("w r26 3"), "missing rule\r\nerr\r\n");
+  CHECK_STR(sim_command("w r26 3 grant 1"), "invalid rule\r\nerr\r\n");
+  CHECK_STR(sim_command("w r26 3 allow 256"), "missing facility\r\nerr\r\n");
+  CHECK_STR(sim_command("w r26 3 allow 1 5 4"), "missing user\r\nerr\r\n");
+  CHECK_STR(sim_command("a r26 none"), "invalid rule\r\nerr\r\n");
+  char line[40];
+  snprintf(line, sizeof(line), "w r26 %d allow 1", WIEGAND26_MAX_RULES);
+  CHECK_STR(sim_command(line), "index too large\r\nerr\r\n");
+
+  // A batch member opens the door without being stored, a denied one doesn't
+  send_wiegand_frame(0, wiegand26_frame(103, 1100), 26);
+  loop();
+  loop();
+  CHECK(sim_pin_get(8) == HIGH);
+  CHECK(sim_serial_take_output().find(" 103 1100 grant") != std::string::npos);
+  send_wiegand_frame(0, wiegand26_frame(103, 1042), 26);
+  loop();
+  loop();
+  CHECK(sim_serial_take_output().find(" 103 1042 deny") != std::string::npos);
+
+  CHECK_STR(sim_command("d r26 deny 103 1042"), "2 deny 103 1042 1042\r\nok\r\n");
+  CHECK_STR(sim_command("d r26 deny 103 1042"), "not found\r\nerr\r\n");
+  CHECK_STR(sim_command("w r26 0 none"), "ok\r\n");
+  std::string expected = "0 none 0 0 0\r\n1 allow 104 0 65535\r\n";
+  for (int i = 2; i < WIEGAND26_MAX_RULES; i++) {
+    expected += std::to_string(i) + " none 0 0 0\r\n";
+  }
+  CHECK_STR(sim_command("l r26"), expected + "ok\r\n");
+  CHECK_STR(sim_command("x r26"), "ok\r\n");
+  CHECK_STR(sim_command("r r26 1"), "1 none 0 0 0\r\nok\r\n");
+}
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+
+static void test_storage_failed() {
+  CHECK_STR(sim_command("w w26 0 103 26441"), "ok\r\n");
+  // Reads the cache already holds still work
+  storage_backend_read_byte(STORAGE_BACKEND_SIZE - 1);
+  sim_ext_eeprom_unplugged = true;
+  CHECK_STR(sim_command("r w26 0"), "storage failed\r\nerr\r\n");
+  CHECK_STR(sim_command("w w26 0 1 1"), "storage failed\r\nerr\r\n");
+  CHECK_STR(sim_command("a w26 1 1"), "storage failed\r\nerr\r\n");
+  CHECK_STR(sim_command("d w26 103 26441"), "storage failed\r\nerr\r\n");
+  CHECK_STR(sim_command("x w26", 100000), "storage failed\r\nerr\r\n");
+
+  // Nothing was changed
+  sim_ext_eeprom_unplugged = false;
+  CHECK_STR(sim_command("r w26 0"), "0 103 26441\r\nok\r\n");
+}
+
+#endif
+
+static void test_open_door() {
+  CHECK_STR(sim_command("o 9"), "invalid door\r\nerr\r\n");
+  CHECK_STR(sim_command("o 1"), "ok\r\n");
+  loop();
+  byte strike_pins[NUM_DOORS] = DOOR_STRIKE_PINS;
+  CHECK(sim_pin_get(strike_pins[1]) == HIGH);
+  CHECK(sim_pin_get(strike_pins[0]) == LOW);
+}
+
+int main() {
+  RUN_TEST(test_empty_command);
+  RUN_TEST(test_invalid_command);
+  RUN_TEST(test_command_too_long);
+  RUN_TEST(test_write_read);
+  RUN_TEST(test_clear_and_list);
+  RUN_TEST(test_clear_runs_across_loops);
+  RUN_TEST(test_list_runs_across_loops);
+  RUN_TEST(test_list_lines_between_traces);
+  RUN_TEST(test_writes_skip_unchanged_bytes);
+  RUN_TEST(test_wear);
+  RUN_TEST(test_add_delete);
+  RUN_TEST(test_info);
+  RUN_TEST(test_longer_formats);
+  RUN_TEST(test_longer_formats_on_erased_eeprom);
+  RUN_TEST(test_rules);
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+  RUN_TEST(test_storage_failed);
+#endif
+  RUN_TEST(test_open_door);
+  return TEST_EXIT_STATUS;
+}
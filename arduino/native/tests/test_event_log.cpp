@@ -0,0 +1,247 @@
+// Event log tests.  Also built with the log kept in EEPROM.
+//
+
+#include <vector>
+
+#include "test.h"
+#include "event_log.h"
+#include "storage.h"
+
+static void present(byte reader, uint8_t facility, uint16_t user) {
+  send_wiegand_frame(reader, wiegand26_frame(facility, user), 26);
+  loop();
+}
+
+// Runs "log" and returns its event lines without the timestamps, then "ok".
+static std::vector<std::string> log_lines(const char * command) {
+  std::string out = sim_command(command);
+  std::vector<std::string> lines;
+  size_t start = 0;
+  size_t end;
+  while ((end = out.find("\r\n", start)) != std::string::npos) {
+    std::string line = out.substr(start, end - start);
+    size_t first = line.find(' ');
+    size_t second = line.find(' ', first + 1);
+    size_t third = line.find(' ', second + 1);
+    if (first != std::string::npos && second != std::string::npos
+      && third != std::string::npos) {
+      line.erase(first, third - first);
+    }
+    lines.push_back(line);
+    start = end + 2;
+  }
+  return lines;
+}
+
+// Lets the log task finish saving events.
+static void settle() {
+  for (int i = 0; i < 200; i++) {
+    loop();
+  }
+}
+
+static void test_decisions_logged() {
+  CHECK(log_lines("log").size() == 1);
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  present(0, 103, 26441);
+  present(1, 103, 26442);
+  // Invalid frames are not decisions
+  send_wiegand_frame(1, wiegand26_frame(103, 26441) ^ 1, 26);
+  loop();
+  sim_serial_take_output();
+  CHECK(event_log_last() == 2);
+
+  std::vector<std::string> lines = log_lines("log");
+  CHECK(lines.size() == 3);
+  CHECK_STR(lines[0], "1 0 w26 103 26441 grant");
+  CHECK_STR(lines[1], "2 1 w26 103 26442 deny");
+  CHECK_STR(lines[2], "ok");
+
+  lines = log_lines("log 1");
+  CHECK(lines.size() == 2);
+  CHECK_STR(lines[0], "2 1 w26 103 26442 deny");
+  CHECK(log_lines("log 2").size() == 1);
+}
+
+static void test_timestamps() {
+  sim_advance_millis(123456);
+  present(0, 1, 2);
+  struct event_log_entry e;
+  CHECK(event_log_next(0, &e) == 1);
+  CHECK(e.time.era == 0 && e.time.ms >= 123456 && e.time.ms <= millis());
+  CHECK(e.result == EVENT_DENIED);
+  CHECK(e.cred.facility == 1 && e.cred.user == 2);
+}
+
+static void test_timestamps_across_rollover() {
+  sim_set_millis(0xffffffffUL - 10);
+  loop();
+  sim_advance_millis(20);
+  present(0, 1, 2);
+  struct event_log_entry e;
+  CHECK(event_log_next(0, &e) == 1);
+  CHECK(e.time.era == 1 && e.time.ms < 1000);
+  CHECK(sim_command("log").find("1 1 ") == 0);
+#if EVENT_LOG_EEPROM_SIZE > 0
+  // The era is saved with the event
+  settle();
+  setup();
+  sim_serial_take_output();
+  CHECK(event_log_next(0, &e) == 1);
+  CHECK(e.time.era == 1 && e.time.ms < 1000);
+#endif
+}
+
+static void test_oldest_events_dropped() {
+  for (int i = 1; i <= EVENT_LOG_SIZE + 4; i++) {
+    present(0, 7, i);
+    settle();
+  }
+  sim_serial_take_output();
+  std::vector<std::string> lines = log_lines("log");
+  CHECK(lines.size() == EVENT_LOG_SIZE + 1);
+#if EVENT_LOG_EEPROM_SIZE >= EVENT_LOG_SIZE + 4
+  // The older events are still in EEPROM, but one call prints at most
+  // EVENT_LOG_SIZE of them
+  CHECK_STR(lines[0], "1 0 w26 7 1 deny");
+  lines = log_lines("log 16");
+  CHECK(lines.size() == 5);
+  CHECK_STR(lines[0], "17 0 w26 7 17 deny");
+#else
+  CHECK_STR(lines[0], "5 0 w26 7 5 deny");
+  // Asking for dropped events gets the oldest held
+  CHECK_STR(log_lines("log 2")[0], "5 0 w26 7 5 deny");
+#endif
+}
+
+static void test_seq_ahead_of_log() {
+  present(0, 1, 1);
+  present(0, 1, 2);
+  sim_serial_take_output();
+  // A host that saw events before a reset
+  std::vector<std::string> lines = log_lines("log 500");
+  CHECK(lines.size() == 3);
+  CHECK_STR(lines[0], "1 0 w26 1 1 deny");
+}
+
+static void test_invalid_seq() {
+  CHECK_STR(sim_command("log x"), "invalid seq\r\nerr\r\n");
+  CHECK_STR(sim_command("log -1"), "invalid seq\r\nerr\r\n");
+}
+
+static void test_events_pushed() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  sim_advance_millis(1000);
+  present(1, 103, 26441);
+  loop();
+  std::string out = sim_serial_take_output();
+  CHECK(out.find("\r\n!access 1 0 10") != std::string::npos);
+  CHECK(out.find(" 1 w26 103 26441 grant\r\n") != std::string::npos);
+  CHECK(out.find("\r\n!door 1 open\r\n") != std::string::npos);
+  CHECK(out.find("!door 0") == std::string::npos);
+
+  sim_advance_millis(10000);
+  loop();
+  CHECK_STR(sim_serial_take_output(), "!door 1 closed\r\n");
+}
+
+#if EVENT_LOG_EEPROM_SIZE > 0
+
+static void test_log_survives_reset() {
+  for (int i = 1; i <= 3; i++) {
+    present(i % 2, 9, i);
+  }
+  settle();
+  // A reset keeps EEPROM but nothing in SRAM
+  setup();
+  sim_serial_take_output();
+  CHECK(event_log_last() == 3);
+  present(0, 9, 4);
+  std::vector<std::string> lines = log_lines("log 2");
+  CHECK(lines.size() == 3);
+  CHECK_STR(lines[0], "3 1 w26 9 3 deny");
+  CHECK_STR(lines[1], "4 0 w26 9 4 deny");
+}
+
+static void test_saving_spread_over_loops() {
+  present(0, 9, 1);
+  unsigned long writes = sim_counters.eeprom_writes;
+  loop();
+  CHECK(sim_counters.eeprom_writes - writes <= EVENT_LOG_EEPROM_WRITES_PER_LOOP);
+  settle();
+
+  // A reset before the record's number is written loses only that event
+  present(0, 9, 2);
+  loop();
+  setup();
+  sim_serial_take_output();
+  CHECK(event_log_last() == 1);
+}
+
+static void test_wraps_around_eeprom() {
+  for (int i = 1; i <= EVENT_LOG_EEPROM_SIZE + 3; i++) {
+    present(0, 5, i);
+    settle();
+  }
+  setup();
+  sim_serial_take_output();
+  CHECK(event_log_last() == EVENT_LOG_EEPROM_SIZE + 3);
+  struct event_log_entry e;
+  CHECK(event_log_next(0, &e) == 4);
+  CHECK(e.cred.user == 4);
+}
+
+static void test_cut_short_record_never_newest() {
+  // The next record's number shares no bytes with the one it replaces, so a
+  // number cut short part way could read as larger than the newest
+  uint32_t newest = 0x10001;
+  struct event_log_entry e;
+  memset(&e, 0, sizeof(e));
+  for (uint32_t seq = newest - EVENT_LOG_EEPROM_SIZE + 1; seq <= newest; seq++) {
+    byte step = 0;
+    CHECK(storage_write_event(seq % EVENT_LOG_EEPROM_SIZE, seq, &e, &step, 255));
+  }
+  uint32_t seq = newest + 1;
+  byte step = 0;
+  while (!storage_write_event(seq % EVENT_LOG_EEPROM_SIZE, seq, &e, &step, 1)) {
+    // A reset after each byte
+    event_log_init();
+    CHECK(event_log_last() == newest);
+  }
+  event_log_init();
+  CHECK(event_log_last() == seq);
+}
+
+static void test_record_being_rewritten_skipped() {
+  for (int i = 1; i <= EVENT_LOG_EEPROM_SIZE; i++) {
+    present(0, 5, i);
+    settle();
+  }
+  // Starts overwriting event 1's record, which is no longer in SRAM
+  present(0, 5, EVENT_LOG_EEPROM_SIZE + 1);
+  struct event_log_entry e;
+  CHECK(event_log_next(0, &e) == 2);
+  CHECK(e.cred.user == 2);
+}
+
+#endif
+
+int main() {
+  RUN_TEST(test_decisions_logged);
+  RUN_TEST(test_timestamps);
+  RUN_TEST(test_timestamps_across_rollover);
+  RUN_TEST(test_oldest_events_dropped);
+  RUN_TEST(test_seq_ahead_of_log);
+  RUN_TEST(test_invalid_seq);
+  RUN_TEST(test_events_pushed);
+#if EVENT_LOG_EEPROM_SIZE > 0
+  RUN_TEST(test_log_survives_reset);
+  RUN_TEST(test_saving_spread_over_loops);
+  RUN_TEST(test_wraps_around_eeprom);
+  RUN_TEST(test_cut_short_record_never_newest);
+  RUN_TEST(test_record_being_rewritten_skipped);
+#endif
+  return TEST_EXIT_STATUS;
+}
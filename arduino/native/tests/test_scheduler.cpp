@@ -0,0 +1,116 @@
+// Scheduler tests, with test tasks added after the firmware's own.
+//
+
+#include "test.h"
+#include "scheduler.h"
+
+static std::string ran;
+
+static byte task_a() {
+  ran += 'a';
+  return TASK_DONE;
+}
+
+static byte task_b() {
+  ran += 'b';
+  return TASK_DONE;
+}
+
+// Works through 3 steps, yielding between them
+static int steps_left = 0;
+
+static byte task_steps() {
+  ran += 's';
+  return --steps_left > 0 ? TASK_YIELD : TASK_DONE;
+}
+
+static byte task_slow() {
+  sim_advance_us(500);
+  return TASK_DONE;
+}
+
+static void test_priority_order() {
+  ran = "";
+  CHECK(scheduler_add_task("b", task_b, 20, 0, 100));
+  CHECK(scheduler_add_task("a", task_a, 10, 0, 100));
+  loop();
+  CHECK_STR(ran, "ab");
+
+  // The firmware's tasks run first, lowest priority number first
+  struct task_stats stats;
+  CHECK(scheduler_get_task_stats(0, &stats));
+  CHECK_STR(stats.name, "wiegand");
+  CHECK(scheduler_num_tasks() == 9);
+  CHECK(scheduler_get_task_stats(7, &stats));
+  CHECK_STR(stats.name, "a");
+}
+
+static void test_period() {
+  ran = "";
+  scheduler_add_task("a", task_a, 10, 100, 100);
+  // Due on the first pass, then every 100 ms
+  loop();
+  loop();
+  CHECK_STR(ran, "a");
+  sim_advance_millis(99);
+  loop();
+  CHECK_STR(ran, "a");
+  sim_advance_millis(1);
+  loop();
+  CHECK_STR(ran, "aa");
+}
+
+static void test_yield_resumes_next_pass() {
+  ran = "";
+  steps_left = 3;
+  scheduler_add_task("s", task_steps, 10, 1000, 100);
+  scheduler_add_task("b", task_b, 20, 1000, 100);
+  for (int i = 0; i < 5; i++) {
+    loop();
+  }
+  // The period doesn't hold back a task that yielded
+  CHECK_STR(ran, "sbss");
+}
+
+static void test_frames_checked_in_one_pass() {
+  ran = "";
+  scheduler_add_task("a", task_a, 10, 0, 100);
+  for (byte r = 0; r < NUM_WIEGAND_READERS; r++) {
+    send_wiegand_bits(r, wiegand26_frame(1, 100 + r), 26);
+  }
+  sim_advance_millis(WIEGAND_INPUT_TIMEOUT_MS + 1);
+  // Every waiting frame is checked before a lower priority task runs
+  loop();
+  CHECK(wiegand_frames_waiting() == 0);
+  CHECK_STR(ran, "a");
+}
+
+static void test_overruns_counted() {
+  scheduler_add_task("slow", task_slow, 10, 0, 400);
+  scheduler_add_task("fast", task_a, 11, 0, 400);
+  for (int i = 0; i < 3; i++) {
+    loop();
+  }
+  // The CLI runs before the test tasks in the pass that prints this
+  std::string out = sim_command("t");
+  CHECK(out.find("slow 3 3 500\r\n") != std::string::npos);
+  CHECK(out.find("fast 3 0 0\r\n") != std::string::npos);
+  CHECK(out.find("wiegand 4 0 ") == 0);
+}
+
+static void test_table_full() {
+  while (scheduler_num_tasks() < SCHEDULER_MAX_TASKS) {
+    CHECK(scheduler_add_task("a", task_a, 10, 0, 100));
+  }
+  CHECK(!scheduler_add_task("a", task_a, 10, 0, 100));
+}
+
+int main() {
+  RUN_TEST(test_priority_order);
+  RUN_TEST(test_period);
+  RUN_TEST(test_yield_resumes_next_pass);
+  RUN_TEST(test_frames_checked_in_one_pass);
+  RUN_TEST(test_overruns_counted);
+  RUN_TEST(test_table_full);
+  return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,116 @@
+// Statistics tests.  Also built with STATS_ENABLED set to 0.
+//
+
+#include "test.h"
+#include "stats.h"
+
+static const byte strike_pins[NUM_DOORS] = DOOR_STRIKE_PINS;
+
+#if STATS_ENABLED
+
+// Returns the line of the "stats" output that starts with name.
+static std::string stats_line(const std::string & out, const char * name) {
+  size_t start = out.find(std::string(name) + " ");
+  if (start == std::string::npos) {
+    return "";
+  }
+  return out.substr(start, out.find("\r\n", start) - start);
+}
+
+// Sums the buckets of a histogram line.
+static unsigned long bucket_total(const std::string & line) {
+  unsigned long total = 0;
+  size_t pos = line.find(' ');
+  while (pos != std::string::npos) {
+    total += strtoul(line.c_str() + pos + 1, NULL, 10);
+    pos = line.find(' ', pos + 1);
+  }
+  return total;
+}
+
+static void test_buckets() {
+  stats_reset();
+  stats_record(STATS_LOOKUP_DURATION, 0);
+  stats_record(STATS_LOOKUP_DURATION, 1);
+  stats_record(STATS_LOOKUP_DURATION, 2);
+  stats_record(STATS_LOOKUP_DURATION, 3);
+  stats_record(STATS_LOOKUP_DURATION, 4);
+  stats_record(STATS_LOOKUP_DURATION, 0xffffffff);
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, 0) == 1);
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, 1) == 1);
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, 2) == 2);
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, 3) == 1);
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, STATS_NUM_BUCKETS - 1) == 1);
+
+  for (long i = 0; i < 70000; i++) {
+    stats_record(STATS_LOOKUP_DURATION, 0);
+  }
+  CHECK(stats_get_bucket(STATS_LOOKUP_DURATION, 0) == 0xffff);
+}
+
+static void test_reader_events_counted() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  sim_command("stats reset");
+
+  send_wiegand_frame(0, wiegand26_frame(103, 26441), 26);
+  loop();
+  send_wiegand_frame(1, wiegand26_frame(103, 26442), 26);
+  loop();
+  send_wiegand_frame(1, wiegand26_frame(103, 26441) ^ 1, 26);
+  loop();
+  // Too short to queue, and a length no format has
+  send_wiegand_frame(0, 0x5, 3);
+  send_wiegand_frame(0, 0x5, 30);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+
+  std::string out = sim_command("stats");
+  CHECK_STR(stats_line(out, "grants"), "grants 1");
+  CHECK_STR(stats_line(out, "denials"), "denials 1");
+  CHECK_STR(stats_line(out, "parity"), "parity 1");
+  CHECK_STR(stats_line(out, "timeouts"), "timeouts 2");
+  CHECK(bucket_total(stats_line(out, "lookup")) == 2);
+  CHECK(bucket_total(stats_line(out, "isr")) == 26 * 3 + 3 + 30);
+  CHECK(bucket_total(stats_line(out, "loop")) > 0);
+  // The frame closed WIEGAND_INPUT_TIMEOUT_MS + 1 after its last bit and
+  // was looked up right away: 8-15 ms
+  CHECK(stats_line(out, "unlock").find("unlock 0 0 0 0 1 0 ") == 0);
+}
+
+static void test_reset() {
+  stats_reset();
+  send_wiegand_frame(1, wiegand26_frame(1, 2), 26);
+  loop();
+  std::string out = sim_command("stats reset");
+  CHECK_STR(stats_line(out, "denials"), "denials 1");
+  out = sim_command("stats");
+  CHECK_STR(stats_line(out, "denials"), "denials 0");
+  CHECK(bucket_total(stats_line(out, "isr")) == 0);
+  CHECK_STR(sim_command("stats x"), "invalid command\r\nerr\r\n");
+}
+
+#else
+
+static void test_compiled_out() {
+  CHECK_STR(sim_command("stats"), "invalid command\r\nerr\r\n");
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  send_wiegand_frame(0, wiegand26_frame(103, 26441), 26);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+}
+
+#endif
+
+int main() {
+#if STATS_ENABLED
+  RUN_TEST(test_buckets);
+  RUN_TEST(test_reader_events_counted);
+  RUN_TEST(test_reset);
+#else
+  RUN_TEST(test_compiled_out);
+#endif
+  return TEST_EXIT_STATUS;
+}
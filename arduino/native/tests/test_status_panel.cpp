@@ -0,0 +1,77 @@
+// Status panel tests: what the LCD shows and how much LCD I/O it takes.
+//
+
+#include "test.h"
+#include "status_panel.h"
+
+static const unsigned int open_periods[NUM_DOORS] = DOOR_STRIKE_OPEN_PERIODS;
+
+// Runs the loop until the panel has caught up, starting one panel period
+// from now.
+static void settle() {
+  sim_advance_millis(STATUS_PANEL_PERIOD_MS);
+  do {
+    loop();
+  } while (status_panel_pending());
+}
+
+static void test_shows_doors_and_heart() {
+  settle();
+  // The heart glyphs show as their character numbers in the simulation
+  CHECK_STR(sim_lcd_row(0), "0:closed            ");
+  CHECK_STR(sim_lcd_row(1), "1:closed       1    ");
+
+  sim_advance_millis(300);
+  settle();
+  CHECK_STR(sim_lcd_row(1), "1:closed       0    ");
+}
+
+static void test_idle_loop_writes_nothing() {
+  settle();
+  unsigned long ops = sim_counters.lcd_ops;
+  // Within one heartbeat phase
+  for (int i = 0; i < 100; i++) {
+    sim_advance_millis(1);
+    loop();
+  }
+  CHECK(sim_counters.lcd_ops == ops);
+}
+
+static void test_writes_only_changed_cells() {
+  sim_advance_millis(300);
+  settle();
+  sim_command("o 0");
+  loop();
+  settle();
+  char expected[21];
+  // settle() took a panel period, so the first second has started
+  snprintf(expected, sizeof(expected), "0:open %-13u", open_periods[0] / 1000 - 1);
+  CHECK_STR(sim_lcd_row(0), expected);
+
+  // A second passing changes one digit: a cursor move and one character
+  sim_advance_millis(1000);
+  unsigned long ops = sim_counters.lcd_ops;
+  settle();
+  CHECK(sim_counters.lcd_ops - ops == 2);
+}
+
+static void test_writes_are_bounded_per_loop() {
+  settle();
+  sim_command("o 0");
+  sim_command("o 1");
+  unsigned long ops = sim_counters.lcd_ops;
+  loop();
+  // Each cell written may need a cursor move
+  CHECK(sim_counters.lcd_ops - ops <= 2 * STATUS_PANEL_MAX_CELLS_PER_LOOP);
+  settle();
+  CHECK(std::string(sim_lcd_row(0)).find("0:open ") == 0);
+  CHECK(std::string(sim_lcd_row(1)).find("1:open ") == 0);
+}
+
+int main() {
+  RUN_TEST(test_shows_doors_and_heart);
+  RUN_TEST(test_idle_loop_writes_nothing);
+  RUN_TEST(test_writes_only_changed_cells);
+  RUN_TEST(test_writes_are_bounded_per_loop);
+  return TEST_EXIT_STATUS;
+}
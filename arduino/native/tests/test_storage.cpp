@@ -0,0 +1,525 @@
+// Credential storage tests.  Built once per WIEGAND26_LAYOUT.
+//
+
+#include "test.h"
+#include "storage.h"
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+# define DEVICE() sim_ext_eeprom()
+#else
+# define DEVICE() sim_eeprom()
+#endif
+
+static struct wiegand26_credential w26(uint8_t facility, uint16_t user) {
+  struct wiegand26_credential c;
+  c.facility = facility;
+  c.user = user;
+  return c;
+}
+
+static void test_read_write_round_trip() {
+  // A grouped table puts the credential in its sorted place
+  const int index = WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED ? 0 : 7;
+  struct wiegand26_credential c = w26(103, 26441);
+  struct wiegand26_credential r;
+  CHECK(storage_write_wiegand26_credential(7, &c));
+  CHECK(storage_read_wiegand26_credential(index, &r));
+  CHECK(r.facility == 103 && r.user == 26441);
+  CHECK(!storage_write_wiegand26_credential(WIEGAND26_SLOTS, &c));
+  CHECK(!storage_read_wiegand26_credential(WIEGAND26_SLOTS, &r));
+}
+
+static void test_reserved_never_match() {
+  // Erased EEPROM holds 255/65535 in every slot
+  struct wiegand26_credential erased = w26(255, 65535);
+  struct wiegand26_credential empty = w26(0, 0);
+  CHECK(!storage_find_wiegand26_credential(&erased));
+  sim_command("x w26");
+  CHECK(!storage_find_wiegand26_credential(&empty));
+
+  int index;
+  CHECK(!storage_add_wiegand26_credential(&empty, &index));
+  CHECK(!storage_add_wiegand26_credential(&erased, &index));
+}
+
+static void test_add_find_remove() {
+  sim_command("x w26");
+  struct wiegand26_credential a = w26(103, 26441);
+  struct wiegand26_credential b = w26(103, 26442);
+  int index_a, index_b, again;
+  CHECK(!storage_find_wiegand26_credential(&a));
+  CHECK(storage_add_wiegand26_credential(&a, &index_a));
+  CHECK(storage_add_wiegand26_credential(&b, &index_b));
+  CHECK(index_a != index_b);
+  CHECK(storage_find_wiegand26_credential(&a));
+  CHECK(storage_find_wiegand26_credential(&b));
+
+  // Adding again reuses the slot
+  CHECK(storage_add_wiegand26_credential(&a, &again));
+  CHECK(again == index_a);
+
+  CHECK(storage_remove_wiegand26_credential(&a, &again));
+  CHECK(again == index_a);
+  CHECK(!storage_find_wiegand26_credential(&a));
+  CHECK(storage_find_wiegand26_credential(&b));
+  CHECK(!storage_remove_wiegand26_credential(&a, &again));
+}
+
+static void test_fill_to_capacity() {
+  sim_command("x w26");
+  int index;
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    struct wiegand26_credential c = w26(1 + i % 3, 1000 + i);
+    CHECK(storage_add_wiegand26_credential(&c, &index));
+  }
+  struct wiegand26_credential extra = w26(9, 9);
+  CHECK(!storage_add_wiegand26_credential(&extra, &index));
+  CHECK(!storage_find_wiegand26_credential(&extra));
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    struct wiegand26_credential c = w26(1 + i % 3, 1000 + i);
+    CHECK(storage_find_wiegand26_credential(&c));
+  }
+
+  // Removing makes room again, and everything else is still found
+  struct wiegand26_credential first = w26(1, 1000);
+  CHECK(storage_remove_wiegand26_credential(&first, &index));
+  CHECK(storage_add_wiegand26_credential(&extra, &index));
+  for (int i = 1; i < WIEGAND26_SLOTS; i++) {
+    struct wiegand26_credential c = w26(1 + i % 3, 1000 + i);
+    CHECK(storage_find_wiegand26_credential(&c));
+  }
+}
+
+static void test_churn_matches_model() {
+  // Random adds and removes over a small key space, checked against a
+  // bitmap of what should be stored.
+  sim_command("x w26");
+  static bool stored[3][150];
+  memset(stored, 0, sizeof(stored));
+  int count = 0;
+  srand(26);
+  for (int n = 0; n < 20000; n++) {
+    uint8_t f = rand() % 3;
+    uint16_t u = rand() % 150;
+    struct wiegand26_credential c = w26(1 + f, 1 + u);
+    int index;
+    switch (rand() % 3) {
+    case 0:
+      if (storage_add_wiegand26_credential(&c, &index)) {
+        count += stored[f][u] ? 0 : 1;
+        stored[f][u] = true;
+      } else {
+        CHECK(count == WIEGAND26_SLOTS);
+      }
+      break;
+    case 1:
+      CHECK(storage_remove_wiegand26_credential(&c, &index) == stored[f][u]);
+      count -= stored[f][u] ? 1 : 0;
+      stored[f][u] = false;
+      break;
+    default:
+      CHECK(storage_find_wiegand26_credential(&c) == stored[f][u]);
+    }
+  }
+}
+
+static void test_filter_rejects_without_eeprom_reads() {
+  sim_command("x w26");
+  struct wiegand26_credential stored = w26(103, 26441);
+  int index;
+  CHECK(storage_add_wiegand26_credential(&stored, &index));
+
+  struct wiegand26_filter_stats before, after;
+  storage_get_wiegand26_filter_stats(&before);
+  CHECK(before.set_bits > 0 && before.set_bits <= WIEGAND26_FILTER_HASHES);
+
+  unsigned long rejected = 0;
+  for (uint16_t u = 0; u < 1000; u++) {
+    struct wiegand26_credential c = w26(7, u);
+    unsigned long reads = sim_counters.eeprom_reads;
+    storage_find_wiegand26_credential(&c);
+    if (sim_counters.eeprom_reads == reads) {
+      rejected++;
+    }
+  }
+  storage_get_wiegand26_filter_stats(&after);
+  CHECK(after.rejected - before.rejected == rejected);
+  CHECK(rejected > 990);
+  CHECK(storage_find_wiegand26_credential(&stored));
+
+  // Replacing the stored credential must not leave it findable
+  struct wiegand26_credential other = w26(104, 1);
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_FLAT
+  CHECK(storage_write_wiegand26_credential(index, &other));
+#else
+  CHECK(storage_remove_wiegand26_credential(&stored, &index));
+  CHECK(storage_add_wiegand26_credential(&other, &index));
+#endif
+  CHECK(!storage_find_wiegand26_credential(&stored));
+  CHECK(storage_find_wiegand26_credential(&other));
+
+  // The stale filter is used as it is until the background rebuild, so a
+  // lookup never scans the zone to rebuild it
+  struct wiegand26_credential unknown = w26(7, 1);
+  unsigned long reads = sim_counters.eeprom_reads;
+  CHECK(!storage_find_wiegand26_credential(&unknown));
+  CHECK(sim_counters.eeprom_reads == reads);
+  storage_refresh_wiegand26_filter();
+  reads = sim_counters.eeprom_reads;
+  CHECK(!storage_find_wiegand26_credential(&stored));
+  CHECK(sim_counters.eeprom_reads == reads);
+}
+
+static void test_wear_cells_take_turns() {
+  // Each write changes all 3 bytes of the slot
+  for (int i = 0; i < STORAGE_WEAR_SAVE_INTERVAL * STORAGE_WEAR_CELLS; i++) {
+    struct wiegand26_credential c = i % 2 ? w26(1, 0x0101) : w26(2, 0x0202);
+    CHECK(storage_write_wiegand26_credential(0, &c));
+  }
+  struct storage_wear_stats stats;
+  storage_get_wear_stats(WIEGAND_FORMAT_26, &stats);
+  uint32_t writes = stats.writes;
+  CHECK(writes >= 3UL * STORAGE_WEAR_SAVE_INTERVAL * STORAGE_WEAR_CELLS);
+
+  // Every cell has been used, and the largest count comes back after a reset
+  for (int cell = 0; cell < STORAGE_WEAR_CELLS; cell++) {
+    uint8_t * p = DEVICE() + STORAGE_WEAR_ADDR(WIEGAND_FORMAT_26, cell);
+    CHECK(!(p[0] == 0xff && p[1] == 0xff && p[2] == 0xff && p[3] == 0xff));
+  }
+  setup();
+  sim_serial_take_output();
+  storage_get_wear_stats(WIEGAND_FORMAT_26, &stats);
+  CHECK(stats.writes <= writes && writes - stats.writes < STORAGE_WEAR_SAVE_INTERVAL);
+}
+
+static struct wiegand26_rule rule(byte kind, uint8_t facility, uint16_t first, uint16_t last) {
+  struct wiegand26_rule r;
+  r.kind = kind;
+  r.facility = facility;
+  r.first_user = first;
+  r.last_user = last;
+  return r;
+}
+
+static boolean presented(uint8_t facility, uint16_t user) {
+  struct wiegand_credential c;
+  c.format = WIEGAND_FORMAT_26;
+  c.facility = facility;
+  c.user = user;
+  return storage_find_credential(&c);
+}
+
+static void test_rules_before_lookup() {
+  struct wiegand26_credential lost = w26(103, 1042);
+  struct wiegand26_credential other = w26(105, 7);
+  int index;
+  CHECK(storage_add_wiegand26_credential(&lost, &index));
+  CHECK(storage_add_wiegand26_credential(&other, &index));
+
+  // A batch takes one rule, and checking it reads no EEPROM
+  struct wiegand26_rule batch = rule(WIEGAND26_RULE_ALLOW, 103, 1000, 1199);
+  CHECK(storage_add_wiegand26_rule(&batch, &index));
+  unsigned long reads = sim_counters.eeprom_reads;
+  CHECK(presented(103, 1000) && presented(103, 1199));
+  CHECK(sim_counters.eeprom_reads == reads);
+  CHECK(!presented(103, 1200) && !presented(104, 1100));
+
+  // Deny overrides both the batch and the stored credential
+  struct wiegand26_rule deny = rule(WIEGAND26_RULE_DENY, 103, 1042, 1042);
+  CHECK(storage_add_wiegand26_rule(&deny, &index));
+  CHECK(!presented(103, 1042));
+  CHECK(storage_find_wiegand26_credential(&lost));
+  CHECK(presented(103, 1041) && presented(105, 7));
+
+  // A whole facility, and never a reserved credential
+  struct wiegand26_rule all = rule(WIEGAND26_RULE_ALLOW, 0, 0, 0xffff);
+  CHECK(storage_add_wiegand26_rule(&all, &index));
+  CHECK(presented(0, 65534) && !presented(0, 0) && !presented(0, 0xffff));
+
+  // Rules survive a reset
+  setup();
+  CHECK(presented(103, 1100) && !presented(103, 1042));
+  int again;
+  CHECK(storage_add_wiegand26_rule(&deny, &again));
+  CHECK(storage_remove_wiegand26_rule(&deny, &index) && index == again);
+  CHECK(presented(103, 1042));
+  CHECK(!storage_remove_wiegand26_rule(&deny, &index));
+}
+
+static void test_rule_slots() {
+  struct wiegand26_rule r;
+  // Erased EEPROM holds no rules
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    CHECK(storage_read_wiegand26_rule(i, &r) && r.kind == WIEGAND26_RULE_NONE);
+  }
+  CHECK(!storage_read_wiegand26_rule(WIEGAND26_MAX_RULES, &r));
+
+  struct wiegand26_rule backward = rule(WIEGAND26_RULE_ALLOW, 1, 5, 4);
+  struct wiegand26_rule unknown = rule(7, 1, 4, 5);
+  int index;
+  CHECK(!storage_write_wiegand26_rule(0, &backward));
+  CHECK(!storage_write_wiegand26_rule(0, &unknown));
+  CHECK(!storage_add_wiegand26_rule(&backward, &index));
+
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    r = rule(WIEGAND26_RULE_DENY, i, 0, 0xffff);
+    CHECK(storage_add_wiegand26_rule(&r, &index) && index == i);
+  }
+  r = rule(WIEGAND26_RULE_DENY, 200, 0, 0xffff);
+  CHECK(!storage_add_wiegand26_rule(&r, &index));
+
+  // Freeing a slot zeroes it
+  r = rule(WIEGAND26_RULE_NONE, 9, 9, 9);
+  CHECK(storage_write_wiegand26_rule(2, &r));
+  CHECK(storage_read_wiegand26_rule(2, &r));
+  CHECK(r.kind == WIEGAND26_RULE_NONE && r.facility == 0 && r.last_user == 0);
+  CHECK(DEVICE()[WIEGAND26_RULE_ADDR(2)] == 0);
+}
+
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+
+// Writes a credential into a 3 byte slot, as the flat and hashed layouts
+// store it.
+static void put_slot(int index, uint8_t facility, uint16_t user) {
+  uint8_t * p = DEVICE() + WIEGAND26_ZONE_ADDR(index);
+  p[0] = facility;
+  p[1] = user >> 8;
+  p[2] = user & 0xff;
+}
+
+static void test_groups_stay_sorted() {
+  sim_command("x w26");
+  int index;
+  srand(19);
+  for (int i = 0; i < 120; i++) {
+    struct wiegand26_credential c = w26(i % 2 ? 7 : 3, rand());
+    CHECK(storage_add_wiegand26_credential(&c, &index));
+  }
+  struct wiegand26_credential previous = w26(0, 0);
+  struct wiegand26_credential c;
+  int count = 0;
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    storage_read_wiegand26_credential(i, &c);
+    if (WIEGAND26_IS_EMPTY(c)) {
+      break;
+    }
+    if (c.facility == previous.facility) {
+      CHECK(c.user > previous.user);
+    }
+    previous = c;
+    count++;
+  }
+  CHECK(count == 120);
+
+  // Lookups are binary searches of 60 user codes: 6 reads of 2 bytes at most
+  for (int i = 0; i < 120; i++) {
+    storage_read_wiegand26_credential(i, &c);
+    unsigned long reads = sim_counters.eeprom_reads;
+    CHECK(storage_find_wiegand26_credential(&c));
+    CHECK(sim_counters.eeprom_reads - reads <= 12);
+  }
+}
+
+static void test_fits_more_than_flat() {
+  CHECK(WIEGAND26_SLOTS > WIEGAND26_MAX_CREDS * 4 / 3);
+  sim_command("x w26");
+  int index;
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    struct wiegand26_credential c = w26(1, i + 1);
+    CHECK(storage_add_wiegand26_credential(&c, &index));
+    CHECK(index == i);
+  }
+}
+
+static void test_facility_limit() {
+  sim_command("x w26");
+  int index;
+  for (int f = 0; f < WIEGAND26_MAX_FACILITIES; f++) {
+    struct wiegand26_credential c = w26(10 + f, 1);
+    CHECK(storage_add_wiegand26_credential(&c, &index));
+  }
+  struct wiegand26_credential extra = w26(99, 1);
+  CHECK(!storage_add_wiegand26_credential(&extra, &index));
+
+  // An emptied group is free again
+  struct wiegand26_credential first = w26(10, 1);
+  CHECK(storage_remove_wiegand26_credential(&first, &index));
+  CHECK(storage_add_wiegand26_credential(&extra, &index));
+  CHECK(storage_find_wiegand26_credential(&extra));
+  CHECK(!storage_find_wiegand26_credential(&first));
+}
+
+static void test_converts_slots() {
+  // A flat table with gaps, a tombstone, a duplicate and one facility too
+  // many
+  memset(DEVICE() + WIEGAND26_ZONE_START, 0, WIEGAND26_ZONE_END - WIEGAND26_ZONE_START);
+  DEVICE()[STORAGE_LAYOUT_ADDR] = STORAGE_LAYOUT_SLOTS;
+  int n = 0;
+  for (int i = 0; i < WIEGAND26_MAX_CREDS; i += 2) {
+    put_slot(i, 50 - i % 3, 60000 - i);
+    n++;
+  }
+  put_slot(1, WIEGAND26_TOMBSTONE_FACILITY, WIEGAND26_TOMBSTONE_USER);
+  put_slot(3, 50, 60000);
+  put_slot(5, 200, 1);
+  for (int f = 0; f < WIEGAND26_MAX_FACILITIES - 3; f++) {
+    put_slot(7 + 2 * f, 100 + f, 1);
+    n++;
+  }
+  setup();
+  sim_serial_take_output();
+  CHECK(DEVICE()[STORAGE_LAYOUT_ADDR] == STORAGE_LAYOUT_GROUPED);
+
+  struct wiegand26_credential c;
+  int found = 0;
+  for (int i = 0; i < WIEGAND26_MAX_CREDS; i += 2) {
+    c = w26(50 - i % 3, 60000 - i);
+    found += storage_find_wiegand26_credential(&c) ? 1 : 0;
+  }
+  CHECK(found == (WIEGAND26_MAX_CREDS + 1) / 2);
+  c = w26(200, 1);
+  CHECK(!storage_find_wiegand26_credential(&c));
+  storage_read_wiegand26_credential(n - 1, &c);
+  CHECK(!WIEGAND26_IS_EMPTY(c));
+  storage_read_wiegand26_credential(n, &c);
+  CHECK(WIEGAND26_IS_EMPTY(c));
+
+  // Starting again leaves it alone
+  unsigned long writes = sim_counters.eeprom_writes;
+  setup();
+  sim_serial_take_output();
+  CHECK(sim_counters.eeprom_writes == writes);
+  c = w26(50, 60000);
+  CHECK(storage_find_wiegand26_credential(&c));
+}
+
+static void test_cut_short_conversion_empties() {
+  put_slot(0, 1, 2);
+  DEVICE()[STORAGE_LAYOUT_ADDR] = STORAGE_LAYOUT_CONVERTING;
+  setup();
+  sim_serial_take_output();
+  CHECK(DEVICE()[STORAGE_LAYOUT_ADDR] == STORAGE_LAYOUT_GROUPED);
+  struct wiegand26_credential c;
+  storage_read_wiegand26_credential(0, &c);
+  CHECK(WIEGAND26_IS_EMPTY(c));
+}
+
+#else
+
+static void test_converts_groups() {
+  // Facility 5 with users 100 and 200, and facility 9 with user 7
+  const uint8_t groups[] = {5, 0, 2, 9, 0, 1};
+  const uint8_t users[] = {0, 100, 0, 200, 0, 7};
+  memset(DEVICE() + WIEGAND26_ZONE_START, 0, WIEGAND26_ZONE_END - WIEGAND26_ZONE_START);
+  memcpy(DEVICE() + WIEGAND26_GROUP_ADDR(0), groups, sizeof(groups));
+  memcpy(DEVICE() + WIEGAND26_USER_ADDR(0), users, sizeof(users));
+  DEVICE()[STORAGE_LAYOUT_ADDR] = STORAGE_LAYOUT_GROUPED;
+  setup();
+  sim_serial_take_output();
+  CHECK(DEVICE()[STORAGE_LAYOUT_ADDR] == STORAGE_LAYOUT_SLOTS);
+
+  struct wiegand26_credential c;
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_FLAT
+  storage_read_wiegand26_credential(0, &c);
+  CHECK(c.facility == 5 && c.user == 100);
+  storage_read_wiegand26_credential(1, &c);
+  CHECK(c.facility == 5 && c.user == 200);
+  storage_read_wiegand26_credential(2, &c);
+  CHECK(c.facility == 9 && c.user == 7);
+#endif
+  int stored = 0;
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    storage_read_wiegand26_credential(i, &c);
+    CHECK(!WIEGAND26_IS_TOMBSTONE(c));
+    stored += WIEGAND26_IS_EMPTY(c) ? 0 : 1;
+  }
+  CHECK(stored == 3);
+  c = w26(5, 100);
+  CHECK(storage_find_wiegand26_credential(&c));
+  c = w26(5, 200);
+  CHECK(storage_find_wiegand26_credential(&c));
+  c = w26(9, 7);
+  CHECK(storage_find_wiegand26_credential(&c));
+}
+
+static void test_converted_groups_are_found() {
+  // Two facilities of consecutive users filling three quarters of the
+  // table, which hashing spreads from where ungrouping packs them
+  int n = WIEGAND26_MAX_CREDS * 3 / 4;
+  int counts[2] = { n / 2, n - n / 2 };
+  const uint8_t facilities[2] = { 5, 9 };
+  memset(DEVICE() + WIEGAND26_ZONE_START, 0, WIEGAND26_ZONE_END - WIEGAND26_ZONE_START);
+  int i = 0;
+  for (int g = 0; g < 2; g++) {
+    uint8_t * group = DEVICE() + WIEGAND26_GROUP_ADDR(g);
+    group[0] = facilities[g];
+    group[1] = counts[g] >> 8;
+    group[2] = counts[g] & 0xff;
+    for (int u = 0; u < counts[g]; u++, i++) {
+      uint8_t * user = DEVICE() + WIEGAND26_USER_ADDR(i);
+      user[0] = (1000 + u) >> 8;
+      user[1] = (1000 + u) & 0xff;
+    }
+  }
+  DEVICE()[STORAGE_LAYOUT_ADDR] = STORAGE_LAYOUT_GROUPED;
+  setup();
+  sim_serial_take_output();
+  CHECK(DEVICE()[STORAGE_LAYOUT_ADDR] == STORAGE_LAYOUT_SLOTS);
+
+  struct wiegand26_credential c;
+  for (int g = 0; g < 2; g++) {
+    for (int u = 0; u < counts[g]; u++) {
+      c = w26(facilities[g], 1000 + u);
+      CHECK(storage_find_wiegand26_credential(&c));
+    }
+  }
+  c = w26(5, 1000 + counts[0]);
+  CHECK(!storage_find_wiegand26_credential(&c));
+
+  // Removing and adding still work on the converted table
+  int index;
+  c = w26(9, 1000);
+  CHECK(storage_remove_wiegand26_credential(&c, &index));
+  CHECK(!storage_find_wiegand26_credential(&c));
+  CHECK(storage_add_wiegand26_credential(&c, &index));
+  CHECK(storage_find_wiegand26_credential(&c));
+}
+
+static void test_cut_short_ungrouping_empties() {
+  // A reset while ungrouping leaves the table marked as cut short
+  const uint8_t slot[] = {5, 0, 100};
+  memcpy(DEVICE() + WIEGAND26_ZONE_ADDR(0), slot, sizeof(slot));
+  DEVICE()[STORAGE_LAYOUT_ADDR] = STORAGE_LAYOUT_CONVERTING;
+  setup();
+  sim_serial_take_output();
+  CHECK(DEVICE()[STORAGE_LAYOUT_ADDR] == STORAGE_LAYOUT_SLOTS);
+  struct wiegand26_credential c;
+  storage_read_wiegand26_credential(0, &c);
+  CHECK(WIEGAND26_IS_EMPTY(c));
+}
+
+#endif
+
+int main() {
+  RUN_TEST(test_read_write_round_trip);
+  RUN_TEST(test_reserved_never_match);
+  RUN_TEST(test_add_find_remove);
+  RUN_TEST(test_fill_to_capacity);
+  RUN_TEST(test_churn_matches_model);
+  RUN_TEST(test_filter_rejects_without_eeprom_reads);
+  RUN_TEST(test_wear_cells_take_turns);
+  RUN_TEST(test_rules_before_lookup);
+  RUN_TEST(test_rule_slots);
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+  RUN_TEST(test_groups_stay_sorted);
+  RUN_TEST(test_fits_more_than_flat);
+  RUN_TEST(test_facility_limit);
+  RUN_TEST(test_converts_slots);
+  RUN_TEST(test_cut_short_conversion_empties);
+#else
+  RUN_TEST(test_converts_groups);
+  RUN_TEST(test_converted_groups_are_found);
+  RUN_TEST(test_cut_short_ungrouping_empties);
+#endif
+  return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,142 @@
+// Storage backend tests.  Built once per STORAGE_BACKEND, each against its
+// simulated device.
+//
+
+#include "test.h"
+#include "storage.h"
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+# define DEVICE() sim_ext_eeprom()
+#else
+# define DEVICE() sim_eeprom()
+#endif
+
+static void fill_pattern(byte * buf, int len, byte seed) {
+  for (int i = 0; i < len; i++) {
+    buf[i] = seed + i * 7;
+  }
+}
+
+static void test_write_read_round_trip() {
+  // Crosses two 64 byte pages
+  byte out[100];
+  byte in[100];
+  fill_pattern(out, sizeof(out), 1);
+  storage_backend_write(50, out, sizeof(out));
+  CHECK(memcmp(DEVICE() + 50, out, sizeof(out)) == 0);
+  CHECK(DEVICE()[49] == 0xff && DEVICE()[150] == 0xff);
+
+  storage_backend_read(50, in, sizeof(in));
+  CHECK(memcmp(in, out, sizeof(in)) == 0);
+  CHECK(storage_backend_read_byte(149) == out[99]);
+  CHECK(storage_backend_read_byte(150) == 0xff);
+}
+
+static void test_reads_see_writes() {
+  byte out[3] = {1, 2, 3};
+  CHECK(storage_backend_read_byte(10) == 0xff);
+  storage_backend_write(10, out, 3);
+  CHECK(storage_backend_read_byte(10) == 1);
+  CHECK(storage_backend_read_byte(12) == 3);
+}
+
+static void test_credentials_at_the_end() {
+  struct wiegand26_credential c;
+  c.facility = 103;
+  c.user = 26441;
+  CHECK(storage_write_wiegand26_credential(WIEGAND26_MAX_CREDS - 1, &c));
+  struct wiegand26_credential r;
+  CHECK(storage_read_wiegand26_credential(WIEGAND26_MAX_CREDS - 1, &r));
+  CHECK(r.facility == 103 && r.user == 26441);
+  CHECK(DEVICE()[WIEGAND26_ZONE_ADDR(WIEGAND26_MAX_CREDS - 1)] == 103);
+}
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+
+static void test_page_writes_are_bursts() {
+  // 50-63, 64-93, 94-123, 124-127 and 128-149: one transaction each, split
+  // at pages and at 30 bytes
+  byte out[100];
+  fill_pattern(out, sizeof(out), 9);
+  unsigned long before = sim_counters.i2c_transactions;
+  unsigned long writes = sim_counters.eeprom_writes;
+  storage_backend_write(50, out, sizeof(out));
+  CHECK(sim_counters.i2c_transactions - before == 5);
+  CHECK(sim_counters.eeprom_writes - writes == 100);
+}
+
+static void test_reads_are_cached() {
+  // Start with something else in the cache
+  storage_backend_read_byte(STORAGE_BACKEND_SIZE - 1);
+
+  // An aligned 32 byte burst serves the next ten or eleven 3 byte slots:
+  // 192 bytes in 6 bursts of address + read
+  struct wiegand26_credential r;
+  unsigned long before = sim_counters.i2c_transactions;
+  unsigned long reads = sim_counters.eeprom_reads;
+  for (int i = 0; i < 64; i++) {
+    storage_read_wiegand26_credential(i, &r);
+  }
+  CHECK(sim_counters.i2c_transactions - before == 12);
+  CHECK(sim_counters.eeprom_reads - reads == 192);
+}
+
+static void test_waits_for_write_cycle() {
+  sim_ext_eeprom_write_cycle_us = 5000;
+  byte out[2] = {4, 5};
+  storage_backend_write(1000, out, 2);
+  uint64_t written = sim_now_us();
+  // The second write polls until the first has finished
+  storage_backend_write(2000, out, 2);
+  CHECK(sim_now_us() - written >= 5000);
+  CHECK(sim_ext_eeprom()[2000] == 4 && sim_ext_eeprom()[2001] == 5);
+
+  // So does a read that misses the cache
+  sim_advance_us(6000);
+  storage_backend_write(3000, out, 1);
+  written = sim_now_us();
+  CHECK(storage_backend_read_byte(1001) == 5);
+  CHECK(sim_now_us() - written >= 5000);
+  sim_ext_eeprom_write_cycle_us = 0;
+}
+
+static void test_failures_are_reported() {
+  struct wiegand26_credential c;
+  c.facility = 103;
+  c.user = 26441;
+  int index;
+  CHECK(storage_add_wiegand26_credential(&c, &index));
+  int addr = STORAGE_BACKEND_SIZE - 100;
+  DEVICE()[addr] = 7;
+  uint16_t errors = storage_backend_errors();
+
+  sim_ext_eeprom_unplugged = true;
+  byte out[3] = {1, 2, 3};
+  byte in[3];
+  CHECK(storage_backend_read_byte(addr) == -1);
+  CHECK(!storage_backend_read(addr, in, 3));
+  CHECK(!storage_backend_write(addr, out, 3));
+  CHECK(storage_backend_errors() - errors == 3);
+  // A credential that can't be read is not found
+  CHECK(!storage_find_wiegand26_credential(&c));
+
+  // Nothing was cached as erased
+  sim_ext_eeprom_unplugged = false;
+  CHECK(storage_backend_read_byte(addr) == 7);
+  CHECK(storage_find_wiegand26_credential(&c));
+}
+
+#endif
+
+int main() {
+  RUN_TEST(test_write_read_round_trip);
+  RUN_TEST(test_reads_see_writes);
+  RUN_TEST(test_credentials_at_the_end);
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+  RUN_TEST(test_page_writes_are_bursts);
+  RUN_TEST(test_reads_are_cached);
+  RUN_TEST(test_waits_for_write_cycle);
+  RUN_TEST(test_failures_are_reported);
+#endif
+  return TEST_EXIT_STATUS;
+}
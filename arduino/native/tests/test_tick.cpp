@@ -0,0 +1,54 @@
+// Loop-wide clock snapshot tests.
+//
+
+#include "test.h"
+#include "tick.h"
+#include "door.h"
+
+static const unsigned int open_periods[NUM_DOORS] = DOOR_STRIKE_OPEN_PERIODS;
+
+static void test_snapshot_holds_for_an_iteration() {
+  loop();
+  uint32_t opened = tick_millis();
+  CHECK(opened <= millis());
+  door_open(0);
+  CHECK(door_open_remaining_ms(0) == open_periods[0]);
+
+  // Time passing within an iteration isn't seen until the next one
+  sim_advance_millis(5);
+  CHECK(tick_millis() == opened);
+  CHECK(door_open_remaining_ms(0) == open_periods[0]);
+  uint32_t now = millis();
+  loop();
+  CHECK(tick_millis() == now);
+  CHECK(door_open_remaining_ms(0) == open_periods[0] - (now - opened));
+}
+
+static void test_era_counts_rollovers() {
+  const uint32_t opened = 0xffffffffUL - 10;
+  struct time t;
+  sim_set_millis(opened);
+  loop();
+  tick_get_time(&t);
+  CHECK(t.era == 0 && t.ms == opened);
+  door_open(0);
+
+  uint32_t now = millis() + 20;
+  sim_advance_millis(20);
+  loop();
+  tick_get_time(&t);
+  CHECK(t.era == 1 && t.ms == now);
+
+  // A door opened just before the rollover closes on time
+  CHECK(door_open_remaining_ms(0) == open_periods[0] - (now - opened));
+  sim_set_millis(opened + open_periods[0]);
+  loop();
+  CHECK(door_open_remaining_ms(0) == 0);
+  CHECK(sim_command("c").find("1 ") == 0);
+}
+
+int main() {
+  RUN_TEST(test_snapshot_holds_for_an_iteration);
+  RUN_TEST(test_era_counts_rollovers);
+  return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,99 @@
+// Serial output queue tests, with a UART that takes time to send.
+//
+
+#include "test.h"
+#include "tx_queue.h"
+
+// 115200 baud
+#define BYTE_US 87
+
+// Lets the UART send everything queued.
+static std::string drain() {
+  for (int i = 0; i < TX_QUEUE_SIZE; i++) {
+    sim_advance_us(BYTE_US * 64);
+    tx_queue_loop();
+  }
+  return sim_serial_take_output();
+}
+
+static int count(const std::string & s, const std::string & part) {
+  int n = 0;
+  for (size_t i = s.find(part); i != std::string::npos; i = s.find(part, i + 1)) {
+    n++;
+  }
+  return n;
+}
+
+static void test_debug_dropped_without_waiting() {
+  sim_serial_tx_byte_cost_us = BYTE_US;
+  uint64_t start = sim_now_us();
+  for (int i = 0; i < 50; i++) {
+    tx_debug.print("trace ");
+    tx_debug.println(i);
+  }
+  // Printing never waited for the UART
+  CHECK(sim_now_us() == start);
+
+  struct tx_queue_stats stats;
+  tx_queue_get_stats(&stats);
+  CHECK(stats.dropped > 0);
+
+  // Lines are dropped whole or cut short with a newline
+  std::string out = drain();
+  CHECK(out.find("# trace 0\r\n") == 0);
+  CHECK(count(out, "\r\n") == count(out, "# trace "));
+  // Cut lines gain their newline back
+  CHECK(out.size() + stats.dropped >= 10 * 9 + 40 * 10);
+  sim_serial_tx_byte_cost_us = 0;
+}
+
+static void test_protocol_never_dropped() {
+  sim_serial_tx_byte_cost_us = BYTE_US;
+  uint64_t start = sim_now_us();
+  std::string expected;
+  for (int i = 0; i < 50; i++) {
+    tx_protocol.print("line ");
+    tx_protocol.println(i);
+    expected += "line " + std::to_string(i) + "\r\n";
+  }
+  // It waited for the UART once the queue and transmit buffer were full
+  CHECK(sim_now_us() > start);
+  CHECK_STR(drain(), expected);
+  struct tx_queue_stats stats;
+  tx_queue_get_stats(&stats);
+  CHECK(stats.dropped == 0);
+  CHECK(stats.max_queued == TX_QUEUE_SIZE);
+  sim_serial_tx_byte_cost_us = 0;
+}
+
+static void test_order_kept_across_streams() {
+  tx_debug.println("debug 1");
+  tx_protocol.println("protocol 1");
+  tx_debug.println("debug 2");
+  tx_queue_loop();
+  CHECK_STR(sim_serial_take_output(), "# debug 1\r\nprotocol 1\r\n# debug 2\r\n");
+}
+
+static void test_debug_lines_prefixed() {
+  tx_debug.print("frame ");
+  tx_debug.print(26);
+  tx_debug.println();
+  tx_debug.println();
+  tx_queue_loop();
+  CHECK_STR(sim_serial_take_output(), "# frame 26\r\n# \r\n");
+}
+
+static void test_output_command() {
+  std::string out = sim_command("u");
+  CHECK(out.find("0 ") == 0);
+  CHECK(out.find(" 0\r\nok\r\n") != std::string::npos);
+}
+
+int main() {
+  RUN_TEST(test_debug_dropped_without_waiting);
+  RUN_TEST(test_protocol_never_dropped);
+  RUN_TEST(test_order_kept_across_streams);
+  RUN_TEST(test_debug_lines_prefixed);
+  RUN_TEST(test_output_command);
+  return TEST_EXIT_STATUS;
+}
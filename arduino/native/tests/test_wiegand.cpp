@@ -0,0 +1,401 @@
+// Reader input tests: frames on the data lines through to the door strike.
+// Also built with the Wiegand-35 zone enabled, with four readers on pin
+// change interrupts and with timer sampling.
+//
+
+#include "test.h"
+
+static const byte strike_pins[NUM_DOORS] = DOOR_STRIKE_PINS;
+static const unsigned int open_periods[NUM_DOORS] = DOOR_STRIKE_OPEN_PERIODS;
+
+static void present(byte reader, uint8_t facility, uint16_t user) {
+  send_wiegand_frame(reader, wiegand26_frame(facility, user), 26);
+  loop();
+}
+
+static void test_stored_credential_opens_door() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  present(0, 103, 26441);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+  CHECK(sim_pin_get(strike_pins[1]) == LOW);
+  CHECK(sim_serial_take_output().find("credential good") != std::string::npos);
+
+  // The strike closes when the open period ends
+  sim_advance_millis(open_periods[0] + 1);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == LOW);
+}
+
+static void test_unknown_credential_denied() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  present(1, 103, 26442);
+  loop();
+  CHECK(sim_pin_get(strike_pins[1]) == LOW);
+  CHECK(sim_serial_take_output().find("credential bad") != std::string::npos);
+}
+
+static void test_bad_parity_ignored() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  send_wiegand_frame(0, wiegand26_frame(103, 26441) ^ 1, 26);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == LOW);
+
+  // The reader is ready for the next frame
+  present(0, 103, 26441);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+}
+
+static void test_partial_frame_times_out() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  // Noise followed by a real frame after the input timeout
+  send_wiegand_bits(0, 0x5, 3);
+  sim_advance_millis(WIEGAND_INPUT_TIMEOUT_MS + 1);
+  present(0, 103, 26441);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+}
+
+static void test_readers_are_independent() {
+  sim_command("x w26");
+  sim_command("a w26 1 1");
+  sim_command("a w26 2 2");
+  send_wiegand_frame(0, wiegand26_frame(1, 1), 26);
+  send_wiegand_frame(1, wiegand26_frame(2, 2), 26);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+  CHECK(sim_pin_get(strike_pins[1]) == HIGH);
+}
+
+static void test_back_to_back_frames_all_processed() {
+  sim_command("x w26");
+  sim_command("a w26 1 1");
+  sim_command("a w26 2 2");
+  // All frames arrive on reader 1 before the loop runs
+  send_wiegand_frame(1, wiegand26_frame(1, 1), 26);
+  send_wiegand_frame(1, wiegand26_frame(9, 9), 26);
+  send_wiegand_frame(1, wiegand26_frame(2, 2), 26);
+  CHECK(wiegand_frames_waiting() == 3);
+  // One frame per loop pass, oldest first
+  loop();
+  loop();
+  loop();
+  std::string out = sim_serial_take_output();
+  size_t first = out.find("facility=1,");
+  size_t second = out.find("facility=9,");
+  size_t third = out.find("facility=2,");
+  CHECK(first != std::string::npos && first < second && second < third);
+  CHECK(out.find("credential bad") > second && out.find("credential bad") < third);
+  CHECK_STR(sim_command("q"), "0 0\r\nok\r\n");
+}
+
+static void test_queue_overflow_counted() {
+  for (int i = 0; i < WIEGAND_FRAME_QUEUE_SIZE + 2; i++) {
+    send_wiegand_frame(i % NUM_WIEGAND_READERS, wiegand26_frame(1, i), 26);
+  }
+  CHECK(wiegand_frames_waiting() == WIEGAND_FRAME_QUEUE_SIZE);
+  for (int i = 0; i < WIEGAND_FRAME_QUEUE_SIZE; i++) {
+    loop();
+  }
+  sim_serial_take_output();
+  CHECK_STR(sim_command("q"), "0 2\r\nok\r\n");
+}
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_PCINT
+
+static void test_pin_change_readers_share_banks() {
+  // Every reader sends at once with its pulses overlapping the others', and
+  // a pin that isn't a data line changes on the same port
+  uint32_t sent[NUM_WIEGAND_READERS];
+  for (byte r = 0; r < NUM_WIEGAND_READERS; r++) {
+    sent[r] = wiegand26_frame(10 + r, 1000 + r);
+  }
+  unsigned long interrupts = sim_counters.interrupts;
+  for (int i = 25; i >= 0; i--) {
+    for (byte r = 0; r < NUM_WIEGAND_READERS; r++) {
+      sim_pin_set(test_reader_pins[r][(sent[r] >> i) & 1], LOW);
+      sim_advance_us(10);
+    }
+    sim_pin_set(12, i % 2);
+    sim_advance_us(50);
+    for (byte r = 0; r < NUM_WIEGAND_READERS; r++) {
+      sim_pin_set(test_reader_pins[r][(sent[r] >> i) & 1], HIGH);
+    }
+    sim_advance_us(900);
+  }
+  // One interrupt per data line edge
+  CHECK(sim_counters.interrupts - interrupts == 2 * 26 * NUM_WIEGAND_READERS);
+
+  sim_advance_millis(WIEGAND_INPUT_TIMEOUT_MS + 1);
+  tick_update();
+  wiegand_readers_loop();
+  CHECK(wiegand_frames_waiting() == NUM_WIEGAND_READERS);
+  byte seen = 0;
+  struct wiegand_frame frame;
+  while (wiegand_next_frame(&frame)) {
+    struct wiegand_credential cred;
+    CHECK(wiegand_frame_decode(&frame, &cred));
+    CHECK(frame.bits == sent[frame.reader_num]);
+    CHECK(cred.facility == 10 + frame.reader_num && cred.user == 1000U + frame.reader_num);
+    seen |= 1 << frame.reader_num;
+  }
+  CHECK(seen == (1 << NUM_WIEGAND_READERS) - 1);
+}
+
+#endif
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+
+static void test_sampling_ignores_noise() {
+  sim_command("x w26");
+  sim_command("a w26 103 26441");
+  // 2 us glitches every 5 us for 20 ms interrupt no more often than the
+  // quiet lines
+  unsigned long interrupts = sim_counters.interrupts;
+  for (int i = 0; i < 4000; i++) {
+    sim_pin_set(test_reader_pins[0][i % 2], LOW);
+    sim_advance_us(2);
+    sim_pin_set(test_reader_pins[0][i % 2], HIGH);
+    sim_advance_us(3);
+  }
+  unsigned long samples = sim_counters.interrupts - interrupts;
+  CHECK(samples >= 20000 / WIEGAND_SAMPLE_US - 1 && samples <= 20000 / WIEGAND_SAMPLE_US + 1);
+
+  // Whatever the samples caught times out before a real frame
+  sim_advance_millis(WIEGAND_INPUT_TIMEOUT_MS + 1);
+  loop();
+  sim_serial_take_output();
+  present(0, 103, 26441);
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+}
+
+static void test_sampling_duty() {
+  // Each sample takes a fifth of the time between samples
+  sim_timer_isr_cost_us = WIEGAND_SAMPLE_US / 5;
+  sim_advance_millis(250);
+  char expected[40];
+  snprintf(expected, sizeof(expected), "%d 2000 2000 %d\r\nok\r\n",
+           WIEGAND_SAMPLE_US, WIEGAND_SAMPLE_US / 5 * 1000);
+  CHECK_STR(sim_command("s"), expected);
+
+  // The peaks stay until reset
+  sim_timer_isr_cost_us = 0;
+  sim_advance_millis(250);
+  snprintf(expected, sizeof(expected), "%d 0 2000 %d\r\nok\r\n",
+           WIEGAND_SAMPLE_US, WIEGAND_SAMPLE_US / 5 * 1000);
+  CHECK_STR(sim_command("s reset"), expected);
+  snprintf(expected, sizeof(expected), "%d 0 0 0\r\nok\r\n", WIEGAND_SAMPLE_US);
+  CHECK_STR(sim_command("s"), expected);
+  CHECK_STR(sim_command("s now"), "invalid command\r\nerr\r\n");
+}
+
+#endif
+
+// Encoders for the longer formats, written from the format descriptions
+// rather than the decoder's parity masks.  Bits are numbered from 1 in the
+// order they are sent.
+
+static inline int frame_bit(uint64_t frame, int len, int n) {
+  return (frame >> (len - n)) & 1;
+}
+
+static inline uint64_t set_frame_bit(uint64_t frame, int len, int n) {
+  return frame | ((uint64_t) 1 << (len - n));
+}
+
+// Sum of bits first through last
+static int frame_ones(uint64_t frame, int len, int first, int last) {
+  int ones = 0;
+  for (int n = first; n <= last; n++) {
+    ones += frame_bit(frame, len, n);
+  }
+  return ones;
+}
+
+// H10306: even parity, 16 facility bits, 16 user bits, odd parity.  Each
+// parity bit covers half of the data bits.
+static uint64_t wiegand34_frame(uint16_t facility, uint16_t user) {
+  uint64_t frame = (((uint64_t) facility << 16) | user) << 1;
+  if (frame_ones(frame, 34, 2, 17) % 2 == 1) {
+    frame = set_frame_bit(frame, 34, 1);
+  }
+  if (frame_ones(frame, 34, 18, 33) % 2 == 0) {
+    frame = set_frame_bit(frame, 34, 34);
+  }
+  return frame;
+}
+
+// H10304: even parity over bits 2-18, 16 facility bits, 19 user bits, odd
+// parity over bits 19-36.
+static uint64_t wiegand37_frame(uint16_t facility, uint32_t user) {
+  uint64_t frame = (((uint64_t) facility << 19) | user) << 1;
+  if (frame_ones(frame, 37, 2, 19) % 2 == 1) {
+    frame = set_frame_bit(frame, 37, 1);
+  }
+  if (frame_ones(frame, 37, 19, 36) % 2 == 0) {
+    frame = set_frame_bit(frame, 37, 37);
+  }
+  return frame;
+}
+
+// Corporate 1000: odd parity over the whole frame, even parity over bits 3-4,
+// 6-7 ... 33-34, 12 company bits, 20 card bits, odd parity over bits 2-3,
+// 5-6 ... 32-33.
+static uint64_t wiegand35_frame(uint16_t company, uint32_t card) {
+  uint64_t frame = (((uint64_t) company << 20) | card) << 1;
+  int ones = 0;
+  for (int n = 3; n <= 34; n += 3) {
+    ones += frame_bit(frame, 35, n) + frame_bit(frame, 35, n + 1);
+  }
+  if (ones % 2 == 1) {
+    frame = set_frame_bit(frame, 35, 2);
+  }
+  ones = 0;
+  for (int n = 2; n <= 33; n += 3) {
+    ones += frame_bit(frame, 35, n) + frame_bit(frame, 35, n + 1);
+  }
+  if (ones % 2 == 0) {
+    frame = set_frame_bit(frame, 35, 35);
+  }
+  if (frame_ones(frame, 35, 2, 35) % 2 == 0) {
+    frame = set_frame_bit(frame, 35, 1);
+  }
+  return frame;
+}
+
+static void test_wiegand34_opens_door() {
+  sim_command("x w34");
+  sim_command("a w34 65535 1");
+  send_wiegand_frame(0, wiegand34_frame(65535, 1), 34);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+  CHECK(sim_serial_take_output().find("format=1,facility=65535,user=1>") != std::string::npos);
+
+  // One flipped bit fails parity
+  send_wiegand_frame(1, wiegand34_frame(65535, 1) ^ 2, 34);
+  loop();
+  CHECK(sim_pin_get(strike_pins[1]) == LOW);
+  CHECK(sim_serial_take_output().find("frame invalid") != std::string::npos);
+}
+
+static void test_wiegand37_opens_door() {
+  sim_command("x w37");
+  sim_command("a w37 4321 524287");
+  send_wiegand_frame(1, wiegand37_frame(4321, 524286), 37);
+  loop();
+  CHECK(sim_pin_get(strike_pins[1]) == LOW);
+  CHECK(sim_serial_take_output().find("credential bad") != std::string::npos);
+
+  // 37 bits close the frame without waiting for the timeout
+  send_wiegand_bits(1, wiegand37_frame(4321, 524287), 37);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[1]) == HIGH);
+
+  // A wrong leading parity bit is rejected
+  send_wiegand_frame(0, wiegand37_frame(4321, 524287) ^ ((uint64_t) 1 << 36), 37);
+  loop();
+  CHECK(sim_serial_take_output().find("frame invalid") != std::string::npos);
+}
+
+static void test_wiegand35() {
+  for (uint32_t card = 0; card < 40; card++) {
+    send_wiegand_frame(0, wiegand35_frame(0xabc, card * 26183), 35);
+    loop();
+  }
+  std::string out = sim_serial_take_output();
+#if WIEGAND35_MAX_CREDS > 0
+  CHECK(out.find("frame invalid") == std::string::npos);
+  CHECK(out.find("format=2,facility=2748,user=26183>") != std::string::npos);
+  sim_command("a w35 2748 1000");
+  send_wiegand_frame(0, wiegand35_frame(2748, 1000), 35);
+  loop();
+  loop();
+  CHECK(sim_pin_get(strike_pins[0]) == HIGH);
+  // Any single flipped bit breaks one of the parity checks
+  for (int n = 0; n < 35; n++) {
+    send_wiegand_frame(1, wiegand35_frame(2748, 1000) ^ ((uint64_t) 1 << n), 35);
+    loop();
+    CHECK(sim_pin_get(strike_pins[1]) == LOW);
+  }
+#else
+  // Disabled formats are not decoded
+  CHECK(out.find("format=2") == std::string::npos);
+  CHECK(out.find("frame invalid") != std::string::npos);
+#endif
+}
+
+// The parity every check of an enabled format should report for a frame,
+// counted the slow way.
+static boolean reference_parity_ok(const struct wiegand_format * f, uint64_t bits) {
+  for (byte i = 0; i < f->num_parity_checks; i++) {
+    if ((__builtin_popcountll(bits & f->parity[i].mask) & 1) != f->parity[i].odd) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_parity_matches_popcount() {
+  srand(7);
+  for (byte format = 0; format < WIEGAND_NUM_FORMATS; format++) {
+    struct wiegand_format f;
+    if (!wiegand_get_format(format, &f)) {
+      continue;
+    }
+    int valid = 0;
+    for (int n = 0; n < 500; n++) {
+      uint64_t bits = (((uint64_t) rand() << 31) ^ rand()) & (((uint64_t) 1 << f.bits) - 1);
+      if (n < 64) {
+        // Single bits exercise every table position
+        bits = (uint64_t) 1 << (n % f.bits);
+      }
+      send_wiegand_frame(n % NUM_WIEGAND_READERS, bits, f.bits);
+
+      struct wiegand_frame frame;
+      CHECK(wiegand_next_frame(&frame));
+      CHECK(frame.count == f.bits);
+      for (byte i = 0; i < f.num_parity_checks; i++) {
+        int accumulator = (frame.parity >> (format * WIEGAND_MAX_PARITY_CHECKS + i)) & 1;
+        CHECK(accumulator == (__builtin_popcountll(bits & f.parity[i].mask) & 1));
+      }
+      struct wiegand_credential cred;
+      boolean ok = reference_parity_ok(&f, bits);
+      CHECK(wiegand_frame_decode(&frame, &cred) == ok);
+      valid += ok;
+    }
+    // Random frames pass all checks 1 time in 2^checks
+    CHECK(valid > 0);
+  }
+}
+
+int main() {
+  RUN_TEST(test_stored_credential_opens_door);
+  RUN_TEST(test_unknown_credential_denied);
+  RUN_TEST(test_bad_parity_ignored);
+  RUN_TEST(test_partial_frame_times_out);
+  RUN_TEST(test_readers_are_independent);
+  RUN_TEST(test_back_to_back_frames_all_processed);
+  RUN_TEST(test_queue_overflow_counted);
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_PCINT
+  RUN_TEST(test_pin_change_readers_share_banks);
+#endif
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+  RUN_TEST(test_sampling_ignores_noise);
+  RUN_TEST(test_sampling_duty);
+#endif
+  RUN_TEST(test_wiegand34_opens_door);
+  RUN_TEST(test_wiegand37_opens_door);
+  RUN_TEST(test_wiegand35);
+  RUN_TEST(test_parity_matches_popcount);
+  return TEST_EXIT_STATUS;
+}
@@ -0,0 +1,91 @@
+#include "scheduler.h"
+#include "tick.h"
+
+struct task {
+  const char * name;
+  task_function run;
+  byte priority;
+  boolean yielded;
+  uint16_t period_ms;
+  uint16_t budget_us;
+  // Millis when the task last started
+  uint32_t last_run;
+  uint32_t runs;
+  uint32_t overruns;
+  uint16_t max_us;
+};
+
+// Sorted by priority, so a pass just walks the table.
+static struct task tasks[SCHEDULER_MAX_TASKS];
+static byte num_tasks = 0;
+
+void scheduler_init() {
+  num_tasks = 0;
+}
+
+boolean scheduler_add_task(const char * name, task_function run, byte priority,
+                           uint16_t period_ms, uint16_t budget_us) {
+  if (num_tasks == SCHEDULER_MAX_TASKS) {
+    return false;
+  }
+
+  // After tasks of the same priority, so those keep the order they were added
+  byte i = num_tasks;
+  while (i > 0 && tasks[i - 1].priority > priority) {
+    tasks[i] = tasks[i - 1];
+    i--;
+  }
+  num_tasks++;
+
+  struct task * t = &tasks[i];
+  t->name = name;
+  t->run = run;
+  t->priority = priority;
+  t->period_ms = period_ms;
+  t->budget_us = budget_us;
+  // Due on the first pass
+  t->yielded = true;
+  t->last_run = tick_millis();
+  t->runs = 0;
+  t->overruns = 0;
+  t->max_us = 0;
+  return true;
+}
+
+void scheduler_loop() {
+  for (byte i = 0; i < num_tasks; i++) {
+    struct task * t = &tasks[i];
+    uint32_t now = tick_millis();
+    if (!t->yielded && t->period_ms > 0 && now - t->last_run < t->period_ms) {
+      continue;
+    }
+
+    t->last_run = now;
+    unsigned long start = micros();
+    t->yielded = t->run() == TASK_YIELD;
+    unsigned long elapsed = micros() - start;
+
+    t->runs++;
+    if (elapsed > t->budget_us) {
+      t->overruns++;
+    }
+    if (elapsed > t->max_us) {
+      t->max_us = elapsed > 0xffff ? 0xffff : elapsed;
+    }
+  }
+}
+
+byte scheduler_num_tasks() {
+  return num_tasks;
+}
+
+boolean scheduler_get_task_stats(byte task, struct task_stats * stats) {
+  if (task >= num_tasks) {
+    return false;
+  }
+  stats->name = tasks[task].name;
+  stats->runs = tasks[task].runs;
+  stats->overruns = tasks[task].overruns;
+  stats->max_us = tasks[task].max_us;
+  return true;
+}
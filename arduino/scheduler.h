@@ -0,0 +1,42 @@
+// Runs the firmware's subsystems as cooperative tasks.
+//
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+// A task function does a bounded amount of work and returns one of these.
+// TASK_YIELD means it stopped with more to do: it runs again on the next
+// pass even if its period hasn't elapsed, so long work is split into steps
+// that keep their place in static state between calls.
+#define TASK_DONE  0
+#define TASK_YIELD 1
+
+typedef byte (* task_function)(void);
+
+// Each pass of scheduler_loop() runs every task that is due, lowest priority
+// number first.  A task is due when period_ms has passed since it last ran
+// (0 means every pass) or it yielded.  A run longer than budget_us counts as
+// an overrun.  Returns false if the task table (SCHEDULER_MAX_TASKS) is full.
+boolean scheduler_add_task(const char * name, task_function run, byte priority,
+                           uint16_t period_ms, uint16_t budget_us);
+
+void scheduler_init();
+void scheduler_loop();
+
+struct task_stats {
+  const char * name;
+  uint32_t runs;
+  uint32_t overruns;
+  // Longest run
+  uint16_t max_us;
+};
+
+// Tasks are numbered from 0 in the order they run.
+byte scheduler_num_tasks();
+boolean scheduler_get_task_stats(byte task, struct task_stats * stats);
+
+#endif
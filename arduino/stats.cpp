@@ -0,0 +1,83 @@
+#include <util/atomic.h>
+
+#include "stats.h"
+
+#if STATS_ENABLED
+
+static uint16_t histograms[STATS_NUM_HISTOGRAMS][STATS_NUM_BUCKETS];
+static uint32_t counters[STATS_NUM_COUNTERS];
+
+static unsigned long last_loop_started = 0;
+static boolean loop_started = false;
+
+static const char * const histogram_names[STATS_NUM_HISTOGRAMS] = {
+  "loop", "isr", "lookup", "unlock"
+};
+
+static const char * const counter_names[STATS_NUM_COUNTERS] = {
+  "grants", "denials", "parity", "timeouts"
+};
+
+void stats_record(byte histogram, uint32_t value) {
+  // The number of significant bits is the bucket
+  byte bucket = 0;
+  while (value != 0 && bucket < STATS_NUM_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (histograms[histogram][bucket] != 0xffff) {
+      histograms[histogram][bucket]++;
+    }
+  }
+}
+
+void stats_count(byte counter) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    counters[counter]++;
+  }
+}
+
+void stats_loop_started() {
+  unsigned long now = micros();
+  if (loop_started) {
+    stats_record(STATS_LOOP_PERIOD, now - last_loop_started);
+  }
+  last_loop_started = now;
+  loop_started = true;
+}
+
+uint16_t stats_get_bucket(byte histogram, byte bucket) {
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = histograms[histogram][bucket];
+  }
+  return count;
+}
+
+uint32_t stats_get_counter(byte counter) {
+  uint32_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = counters[counter];
+  }
+  return count;
+}
+
+const char * stats_histogram_name(byte histogram) {
+  return histogram_names[histogram];
+}
+
+const char * stats_counter_name(byte counter) {
+  return counter_names[counter];
+}
+
+void stats_reset() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    memset(histograms, 0, sizeof(histograms));
+    memset(counters, 0, sizeof(counters));
+  }
+  // The next pass starts a new period
+  loop_started = false;
+}
+
+#endif
@@ -0,0 +1,57 @@
+// Latency histograms and event counters kept in SRAM.  Set STATS_ENABLED to
+// 0 in config.h to compile the instrumentation out.
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+// Histograms.  Bucket 0 counts values of 0 and bucket b > 0 counts values
+// from 2^(b-1) to 2^b - 1.  The last bucket also counts everything larger.
+#define STATS_LOOP_PERIOD      0  // us from the start of one loop pass to the next
+#define STATS_ISR_DURATION     1  // us in a reader data line ISR
+#define STATS_LOOKUP_DURATION  2  // us to look a presented credential up
+#define STATS_UNLOCK_LATENCY   3  // ms from the last bit of a frame to door_open()
+#define STATS_NUM_HISTOGRAMS   4
+
+#define STATS_NUM_BUCKETS      16
+
+// Counters
+#define STATS_GRANTS           0  // credentials that opened a door
+#define STATS_DENIALS          1  // credentials not stored
+#define STATS_PARITY_FAILURES  2  // frames of a known length with bad parity
+#define STATS_INPUT_TIMEOUTS   3  // frames the idle timeout ended that match no format
+#define STATS_NUM_COUNTERS     4
+
+#if STATS_ENABLED
+
+// Histogram buckets saturate at 65535.  Safe to call from ISRs.
+void stats_record(byte histogram, uint32_t value);
+void stats_count(byte counter);
+// Records the loop period.  Call at the start of each loop pass.
+void stats_loop_started();
+
+uint16_t stats_get_bucket(byte histogram, byte bucket);
+uint32_t stats_get_counter(byte counter);
+const char * stats_histogram_name(byte histogram);
+const char * stats_counter_name(byte counter);
+void stats_reset();
+
+# define STATS_START(var)        unsigned long var = micros()
+# define STATS_RECORD(h, value)  stats_record((h), (value))
+# define STATS_COUNT(c)          stats_count(c)
+# define STATS_LOOP_STARTED()    stats_loop_started()
+
+#else
+
+# define STATS_START(var)
+# define STATS_RECORD(h, value)
+# define STATS_COUNT(c)
+# define STATS_LOOP_STARTED()
+
+#endif
+
+#endif
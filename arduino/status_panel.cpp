@@ -3,6 +3,7 @@
 #include "status_panel.h"
 #include "dorbo_utils.h"
 #include "door.h"
+#include "tick.h"
 
 static LiquidCrystal lcd(STATUS_PANEL_LIQUID_CRYSTAL_CONST_ARGS);
 
@@ -30,35 +31,131 @@ byte closed_heart_bytes[8] = {
   0b00000
 };
 
+// Door rows are this wide; the heart sits in the last column of row 1.
+#define DOOR_ROW_COLS 16
+#define HEART_COL 15
+#define HEART_ROW 1
+
+#if NUM_DOORS > STATUS_PANEL_ROWS || HEART_ROW >= STATUS_PANEL_ROWS
+# error The status panel needs a row per door and room for the heart.
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Framebuffer
+//////////////////////////////////////////////////////////////////////////////
+
+// What the display should show, and what it shows now.  Rendering only
+// touches frame; flush_frame() sends the LCD the cells that differ.
+static byte frame[STATUS_PANEL_ROWS][STATUS_PANEL_COLS];
+static byte shown[STATUS_PANEL_ROWS][STATUS_PANEL_COLS];
+
+// True when frame may differ from shown
+static boolean frame_dirty = false;
+
+// Where flush_frame() resumes scanning, so a large change is sent in order
+static byte flush_cell = 0;
+
+#define NUM_CELLS (STATUS_PANEL_ROWS * STATUS_PANEL_COLS)
+
+// Writes a string into a row of frame, returning the column after it.
+static byte put_string(byte row, byte col, const char * s) {
+  while (*s && col < STATUS_PANEL_COLS) {
+    frame[row][col++] = *s++;
+  }
+  return col;
+}
+
+static byte put_number(byte row, byte col, uint32_t n) {
+  char digits[11];
+  byte i = sizeof(digits) - 1;
+  digits[i] = 0;
+  do {
+    digits[--i] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+  return put_string(row, col, &digits[i]);
+}
+
+// Sends up to STATUS_PANEL_MAX_CELLS_PER_LOOP changed cells to the LCD.
+// Runs of changed cells are written without moving the cursor in between.
+static void flush_frame() {
+  if (!frame_dirty) {
+    return;
+  }
+  byte written = 0;
+  byte cursor = NUM_CELLS;
+  for (byte scanned = 0; scanned < NUM_CELLS; scanned++) {
+    byte cell = flush_cell;
+    byte row = cell / STATUS_PANEL_COLS;
+    byte col = cell % STATUS_PANEL_COLS;
+    if (frame[row][col] != shown[row][col]) {
+      if (written == STATUS_PANEL_MAX_CELLS_PER_LOOP) {
+        // Pick up here next time
+        return;
+      }
+      if (cursor != cell) {
+        lcd.setCursor(col, row);
+      }
+      lcd.write(frame[row][col]);
+      shown[row][col] = frame[row][col];
+      written++;
+      // The LCD moves the cursor along the row
+      cursor = col + 1 < STATUS_PANEL_COLS ? cell + 1 : NUM_CELLS;
+    }
+    flush_cell = cell + 1 < NUM_CELLS ? cell + 1 : 0;
+  }
+  frame_dirty = false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Rendering
+//////////////////////////////////////////////////////////////////////////////
+
+// The state last rendered into frame.  Seconds are -1 for a closed door.
+static long rendered_seconds[NUM_DOORS];
+
+static void render_door(byte i, long seconds) {
+  byte col = put_number(i, 0, i);
+  col = put_string(i, col, ":");
+  if (seconds >= 0) {
+    col = put_string(i, col, "open ");
+    col = put_number(i, col, seconds);
+  } else {
+    col = put_string(i, col, "closed");
+  }
+  // Fill the rest of the row with spaces
+  while (col < DOOR_ROW_COLS) {
+    frame[i][col++] = ' ';
+  }
+  frame_dirty = true;
+}
+
 void status_panel_init() {
   lcd.createChar(OPEN_HEART, open_heart_bytes);
   lcd.createChar(CLOSED_HEART, closed_heart_bytes);
-  lcd.begin(20,4);
+  lcd.begin(STATUS_PANEL_COLS, STATUS_PANEL_ROWS);
   lcd.clear();
   delay(1);
+
+  // The display is blank, and everything gets rendered on the first loop
+  memset(shown, ' ', sizeof(shown));
+  memset(frame, ' ', sizeof(frame));
+  flush_cell = 0;
+  frame_dirty = false;
+  for (byte i = 0; i < NUM_DOORS; i++) {
+    rendered_seconds[i] = -2;
+  }
 }
 
 void status_panel_loop() {
-  unsigned long now = millis();
+  uint32_t now = tick_millis();
   
   for (byte i = 0; i < NUM_DOORS; i++) {
-    byte num_printed = 0;
-    
-    lcd.setCursor(0, i);
-    num_printed += lcd.print(i);
-    num_printed += lcd.print(':');
-    
-    long ms_remaining = door_open_remaining_ms(i);
-    if (ms_remaining > 0) {
-      num_printed += lcd.print("open ");
-      num_printed += lcd.print(ms_remaining / 1000);
-    } else {
-      num_printed += lcd.print("closed");
-    }
-    
-    // Fill the rest of the row with spaces
-    for (byte i = num_printed; i < 16; i++) {
-      lcd.print(' ');
+    uint32_t ms_remaining = door_open_remaining_ms(i);
+    long seconds = ms_remaining > 0 ? (long) (ms_remaining / 1000) : -1;
+    if (seconds != rendered_seconds[i]) {
+      rendered_seconds[i] = seconds;
+      render_door(i, seconds);
     }
   }
   
@@ -67,7 +164,16 @@ void status_panel_loop() {
   // so this is a good trade-off.
 
   // Light the LED for 256 of the 1024 ms in our period.
-  lcd.setCursor(15, 1);
-  lcd.write((byte) ((now & 0x3ff) < 256 ? CLOSED_HEART : OPEN_HEART));
+  byte heart = (now & 0x3ff) < 256 ? CLOSED_HEART : OPEN_HEART;
+  // Also puts the heart back if a door row's padding covered it
+  if (frame[HEART_ROW][HEART_COL] != heart) {
+    frame[HEART_ROW][HEART_COL] = heart;
+    frame_dirty = true;
+  }
+
+  flush_frame();
 }
 
+boolean status_panel_pending() {
+  return frame_dirty;
+}
@@ -10,6 +10,9 @@
 
 void status_panel_init();
 void status_panel_loop();
+
+// True while changes are still waiting to be written to the display.
+boolean status_panel_pending();
  
 #endif
 
@@ -1,37 +1,1585 @@
-#include <EEPROM.h>
 #include "storage.h"
 
-// Wiegand functions
+//////////////////////////////////////////////////////////////////////////////
+// Wiegand-26 Bloom Filter
+//////////////////////////////////////////////////////////////////////////////
 
-boolean storage_write_wiegand26_credential(int index, struct wiegand26_credential * cred) {
-  if (index >= WIEGAND26_MAX_CREDS) {
+#if WIEGAND26_FILTER_BITS > 0
+
+// A bit is set for each of WIEGAND26_FILTER_HASHES hashes of every stored 
+// credential.  A credential with any of its bits clear is definitely not
+// stored.  Bloom filters can't forget, so when a stored credential is
+// overwritten the filter is marked stale.  A stale filter still holds the
+// bits of every stored credential and stays in use; the background task
+// rebuilds it from EEPROM, never a lookup.  A credential that can't be
+// read could be any, so a build cut short by a failed read sets every bit
+// and leaves the filter stale.
+static uint8_t wiegand26_filter[WIEGAND26_FILTER_BITS / 8];
+static boolean wiegand26_filter_stale = true;
+static uint32_t wiegand26_filter_rejected = 0;
+static uint32_t wiegand26_filter_false_positives = 0;
+
+// Double hashing: bit i is h1 + i * h2, with both hashes taken from the high
+// halves of two multiplicative hashes of the 24-bit key.  h2 is odd so the
+// bits differ for every i.
+#define FOR_EACH_WIEGAND26_FILTER_BIT(c, bit) \
+  uint32_t _key = ((uint32_t) (c)->facility << 16) | (c)->user; \
+  uint16_t bit = (_key * 2654435761UL) >> 16; \
+  uint16_t _h2 = (((_key ^ (_key >> 12)) * 2246822519UL) >> 16) | 1; \
+  for (byte _i = 0; _i < WIEGAND26_FILTER_HASHES; _i++, bit += _h2)
+
+#define WIEGAND26_FILTER_BYTE(bit) wiegand26_filter[((bit) & (WIEGAND26_FILTER_BITS - 1)) >> 3]
+#define WIEGAND26_FILTER_MASK(bit) (1 << ((bit) & 7))
+
+static void add_to_wiegand26_filter(struct wiegand26_credential * c) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return;
+  }
+  FOR_EACH_WIEGAND26_FILTER_BIT(c, bit) {
+    WIEGAND26_FILTER_BYTE(bit) |= WIEGAND26_FILTER_MASK(bit);
+  }
+}
+
+static void build_wiegand26_filter() {
+  struct wiegand26_credential cred;
+  memset(wiegand26_filter, 0, sizeof(wiegand26_filter));
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    if (!storage_read_wiegand26_credential(i, &cred)) {
+      memset(wiegand26_filter, 0xff, sizeof(wiegand26_filter));
+      wiegand26_filter_stale = true;
+      return;
+    }
+    add_to_wiegand26_filter(&cred);
+  }
+  wiegand26_filter_stale = false;
+}
+
+static boolean wiegand26_filter_may_contain(struct wiegand26_credential * c) {
+  FOR_EACH_WIEGAND26_FILTER_BIT(c, bit) {
+    if (!(WIEGAND26_FILTER_BYTE(bit) & WIEGAND26_FILTER_MASK(bit))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void storage_clear_wiegand26_filter() {
+  memset(wiegand26_filter, 0, sizeof(wiegand26_filter));
+  wiegand26_filter_stale = false;
+}
+
+void storage_refresh_wiegand26_filter() {
+  if (wiegand26_filter_stale) {
+    build_wiegand26_filter();
+  }
+}
+
+void storage_get_wiegand26_filter_stats(struct wiegand26_filter_stats * stats) {
+  if (wiegand26_filter_stale) {
+    build_wiegand26_filter();
+  }
+  stats->set_bits = 0;
+  for (uint16_t i = 0; i < sizeof(wiegand26_filter); i++) {
+    for (uint8_t b = wiegand26_filter[i]; b != 0; b &= b - 1) {
+      stats->set_bits++;
+    }
+  }
+  stats->bits = WIEGAND26_FILTER_BITS;
+  stats->rejected = wiegand26_filter_rejected;
+  stats->false_positives = wiegand26_filter_false_positives;
+}
+
+#else
+
+void storage_clear_wiegand26_filter() {
+}
+
+void storage_refresh_wiegand26_filter() {
+}
+
+void storage_get_wiegand26_filter_stats(struct wiegand26_filter_stats * stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Zone Writes
+//////////////////////////////////////////////////////////////////////////////
+
+// Byte writes per credential zone, indexed by WIEGAND_FORMAT_*.  Saved to the
+// wear zone every STORAGE_WEAR_SAVE_INTERVAL writes rather than every write,
+// and to the next of the zone's STORAGE_WEAR_CELLS cells each time, which
+// keeps the counters from wearing out first.
+static uint32_t zone_writes[WIEGAND_NUM_FORMATS];
+// The cell each count was last saved to
+static byte zone_writes_cell[WIEGAND_NUM_FORMATS];
+
+static void load_zone_writes() {
+  for (byte format = 0; format < WIEGAND_NUM_FORMATS; format++) {
+    // With every cell erased the first save goes to cell 0
+    zone_writes[format] = 0;
+    zone_writes_cell[format] = STORAGE_WEAR_CELLS - 1;
+    for (byte cell = 0; cell < STORAGE_WEAR_CELLS; cell++) {
+      byte bytes[4];
+      if (!storage_backend_read(STORAGE_WEAR_ADDR(format, cell), bytes, 4)) {
+        continue;
+      }
+      uint32_t writes = 0;
+      for (int i = 3; i >= 0; i--) {
+        writes = (writes << 8) | bytes[i];
+      }
+      if (writes != 0xffffffff && writes >= zone_writes[format]) {
+        zone_writes[format] = writes;
+        zone_writes_cell[format] = cell;
+      }
+    }
+  }
+}
+
+// Writes the bytes that differ from what EEPROM holds, each run of them in
+// one backend write.  Bytes that can't be read are written too.  Returns the
+// number of bytes written, or -1 if a write failed.
+static int update_bytes(int addr, const byte * buf, int len) {
+  int written = 0;
+  int i = 0;
+  while (i < len) {
+    if (storage_backend_read_byte(addr + i) == buf[i]) {
+      i++;
+      continue;
+    }
+    int run = 1;
+    while (i + run < len && storage_backend_read_byte(addr + i + run) != buf[i + run]) {
+      run++;
+    }
+    if (!storage_backend_write(addr + i, buf + i, run)) {
+      return -1;
+    }
+    written += run;
+    i += run;
+  }
+  return written;
+}
+
+static void save_zone_writes(byte format) {
+  uint32_t writes = zone_writes[format];
+  byte bytes[4];
+  for (byte i = 0; i < 4; i++) {
+    bytes[i] = writes & 0xff;
+    writes >>= 8;
+  }
+  byte cell = (zone_writes_cell[format] + 1) % STORAGE_WEAR_CELLS;
+  if (update_bytes(STORAGE_WEAR_ADDR(format, cell), bytes, 4) >= 0) {
+    zone_writes_cell[format] = cell;
+  }
+}
+
+// Writes the bytes of a credential zone that don't already hold their value.
+// Returns false if a write failed.
+static boolean update_zone_bytes(byte format, int addr, const byte * buf, int len) {
+  int written = update_bytes(addr, buf, len);
+  if (written < 0) {
     return false;
   }
-  EEPROM.write(WIEGAND26_ZONE_ADDR(index), cred->facility);
-  EEPROM.write(WIEGAND26_ZONE_ADDR(index) + 1, (cred->user >> 8) & 0xff);
-  EEPROM.write(WIEGAND26_ZONE_ADDR(index) + 2, (cred->user) & 0xff);
+  uint32_t before = zone_writes[format];
+  zone_writes[format] += written;
+  if (zone_writes[format] / STORAGE_WEAR_SAVE_INTERVAL != before / STORAGE_WEAR_SAVE_INTERVAL) {
+    save_zone_writes(format);
+  }
   return true;
 }
 
-boolean storage_read_wiegand26_credential(int index, struct wiegand26_credential * c) {
-  if (index >= WIEGAND26_MAX_CREDS) {
+static boolean convert_wiegand26_zone();
+static boolean load_wiegand26_rules();
+
+// True once the Wiegand-26 zone is known to hold WIEGAND26_LAYOUT, which
+// takes a conversion that neither failed to read nor failed to write (or
+// none to do).  Until then every operation tries again and fails, rather
+// than read another layout's bytes as credentials.
+static boolean wiegand26_zone_converted = false;
+
+static boolean wiegand26_zone_ready() {
+  if (!wiegand26_zone_converted) {
+    wiegand26_zone_converted = convert_wiegand26_zone();
+  }
+  return wiegand26_zone_converted;
+}
+
+void storage_init() {
+  storage_backend_init();
+  load_zone_writes();
+  wiegand26_zone_converted = convert_wiegand26_zone();
+  load_wiegand26_rules();
+#if WIEGAND26_FILTER_BITS > 0
+  build_wiegand26_filter();
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Wiegand-26 Credentials
+//////////////////////////////////////////////////////////////////////////////
+
+// Flat and hashed tables keep a credential in each 3 byte slot, and so do
+// tables on their way to or from the grouped layout.
+static boolean read_wiegand26_slot(int index, struct wiegand26_credential * c) {
+  byte bytes[WIEGAND26_ZONE_CRED_SIZE];
+  if (!storage_backend_read(WIEGAND26_ZONE_ADDR(index), bytes, WIEGAND26_ZONE_CRED_SIZE)) {
     return false;
   }
-  c->facility = EEPROM.read(WIEGAND26_ZONE_ADDR(index));
-  c->user = (EEPROM.read(WIEGAND26_ZONE_ADDR(index) + 1) << 8) 
-          | (EEPROM.read(WIEGAND26_ZONE_ADDR(index) + 2) << 0);
+  c->facility = bytes[0];
+  c->user = (bytes[1] << 8) | (bytes[2] << 0);
   return true;
 }
 
-boolean storage_find_wiegand26_credential(struct wiegand26_credential * c) {
+static boolean write_wiegand26_slot(int index, struct wiegand26_credential * c) {
+  byte bytes[WIEGAND26_ZONE_CRED_SIZE];
+  bytes[0] = c->facility;
+  bytes[1] = (c->user >> 8) & 0xff;
+  bytes[2] = (c->user) & 0xff;
+  return update_zone_bytes(WIEGAND_FORMAT_26, WIEGAND26_ZONE_ADDR(index), bytes,
+                           WIEGAND26_ZONE_CRED_SIZE);
+}
+
+static boolean set_storage_layout(byte layout) {
+  return update_bytes(STORAGE_LAYOUT_ADDR, &layout, 1) >= 0;
+}
+
+#if WIEGAND26_LAYOUT != WIEGAND26_LAYOUT_GROUPED
+
+boolean storage_write_wiegand26_credential(int index, struct wiegand26_credential * cred) {
+  if (index >= WIEGAND26_SLOTS || !wiegand26_zone_ready()) {
+    return false;
+  }
+#if WIEGAND26_FILTER_BITS > 0
+  // An old credential that can't be read may be overwritten
+  struct wiegand26_credential old;
+  if (!read_wiegand26_slot(index, &old) || (!WIEGAND26_IS_RESERVED(old) 
+    && (old.facility != cred->facility || old.user != cred->user))) {
+    wiegand26_filter_stale = true;
+  }
+  add_to_wiegand26_filter(cred);
+#endif
+  return write_wiegand26_slot(index, cred);
+}
+
+boolean storage_read_wiegand26_credential(int index, struct wiegand26_credential * c) {
+  if (index >= WIEGAND26_SLOTS || !wiegand26_zone_ready()) {
+    return false;
+  }
+  return read_wiegand26_slot(index, c);
+}
+
+static boolean write_wiegand26_empty(int index) {
+  struct wiegand26_credential empty;
+  empty.facility = 0;
+  empty.user = 0;
+  return storage_write_wiegand26_credential(index, &empty);
+}
+
+// Expands a grouped table into slots 0 to n - 1 and returns n, or -1 if a
+// read or write failed.  Slot i covers grouped bytes that are no longer
+// needed once i is at least UNGROUP_BUFFERED, so slots are written last to
+// first, and the credentials of the lower slots are read into SRAM before
+// any are written.
+#define UNGROUP_BUFFERED (3 * WIEGAND26_MAX_FACILITIES)
+
+static int ungroup_wiegand26() {
+  byte facilities[WIEGAND26_MAX_FACILITIES];
+  uint16_t counts[WIEGAND26_MAX_FACILITIES];
+  long total = 0;
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    byte bytes[WIEGAND26_GROUP_SIZE];
+    if (!storage_backend_read(WIEGAND26_GROUP_ADDR(g), bytes, WIEGAND26_GROUP_SIZE)) {
+      // Nothing is written yet, so the table is still grouped
+      return -1;
+    }
+    facilities[g] = bytes[0];
+    counts[g] = (bytes[1] << 8) | bytes[2];
+    total += counts[g];
+  }
+
+  // Slot writes overwrite user codes that are still to be read, so a reset
+  // from here on must find the table marked as cut short
+  if (!set_storage_layout(STORAGE_LAYOUT_CONVERTING)) {
+    return -1;
+  }
+  if (total > WIEGAND26_GROUPED_SLOTS) {
+    // Not a grouped table after all
+    return 0;
+  }
+  int n = total;
+  if (n > WIEGAND26_SLOTS) {
+    P("Dropped w26 credentials: ");
+    PLDEC(n - WIEGAND26_SLOTS);
+    n = WIEGAND26_SLOTS;
+  }
+
+  struct wiegand26_credential low[UNGROUP_BUFFERED];
+  struct wiegand26_credential c;
+  for (int i = n - 1; i >= 0; i--) {
+    int rest = i;
+    byte g = 0;
+    while (rest >= counts[g]) {
+      rest -= counts[g++];
+    }
+    c.facility = facilities[g];
+    byte bytes[WIEGAND26_USER_SIZE];
+    if (!storage_backend_read(WIEGAND26_USER_ADDR(i), bytes, WIEGAND26_USER_SIZE)) {
+      return -1;
+    }
+    c.user = (bytes[0] << 8) | bytes[1];
+    if (i < UNGROUP_BUFFERED) {
+      low[i] = c;
+    } else if (!write_wiegand26_slot(i, &c)) {
+      return -1;
+    }
+  }
+  for (int i = (n < UNGROUP_BUFFERED ? n : UNGROUP_BUFFERED) - 1; i >= 0; i--) {
+    if (!write_wiegand26_slot(i, &low[i])) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED
+static void rehash_wiegand26_slots(int n);
+#endif
+
+// Converts a grouped table to a flat or hashed one, or empties a table whose
+// conversion was cut short.  Returns false if a read or write failed, which
+// cuts the conversion short too.
+static boolean convert_wiegand26_zone() {
+  int layout = storage_backend_read_byte(STORAGE_LAYOUT_ADDR);
+  if (layout < 0) {
+    return false;
+  }
+  if (layout != STORAGE_LAYOUT_GROUPED && layout != STORAGE_LAYOUT_CONVERTING) {
+    return true;
+  }
+  uint16_t errors = storage_backend_errors();
+  int n = 0;
+  if (layout == STORAGE_LAYOUT_GROUPED) {
+    n = ungroup_wiegand26();
+    if (n < 0) {
+      return false;
+    }
+  }
+  struct wiegand26_credential empty;
+  empty.facility = 0;
+  empty.user = 0;
+  for (int i = n; i < WIEGAND26_SLOTS; i++) {
+    write_wiegand26_slot(i, &empty);
+  }
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED
+  rehash_wiegand26_slots(n);
+#endif
+  return storage_backend_errors() == errors && set_storage_layout(STORAGE_LAYOUT_SLOTS);
+}
+
+#endif
+
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_FLAT
+
+// Returns the index of the slot holding c, or -1 (also if a slot can't be
+// read).
+static int find_wiegand26_index(struct wiegand26_credential * c) {
   struct wiegand26_credential candidate;
+  for (int i = 0; i < WIEGAND26_SLOTS; i++) {
+    if (!storage_read_wiegand26_credential(i, &candidate)) {
+      return -1;
+    }
+    if (c->facility == candidate.facility && c->user == candidate.user) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+boolean storage_add_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return false;
+  }
+  struct wiegand26_credential candidate;
+  int free_index = -1;
   for (int i = 0; i < WIEGAND26_MAX_CREDS; i++) {
-    storage_read_wiegand26_credential(i, &candidate);
+    if (!storage_read_wiegand26_credential(i, &candidate)) {
+      return false;
+    }
+    if (c->facility == candidate.facility && c->user == candidate.user) {
+      *index = i;
+      return true;
+    }
+    if (free_index < 0 && WIEGAND26_IS_EMPTY(candidate)) {
+      free_index = i;
+    }
+  }
+  if (free_index < 0) {
+    return false;
+  }
+  *index = free_index;
+  return storage_write_wiegand26_credential(free_index, c);
+}
+
+boolean storage_remove_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return false;
+  }
+  int i = find_wiegand26_index(c);
+  if (i < 0) {
+    return false;
+  }
+  *index = i;
+  return write_wiegand26_empty(i);
+}
+
+#elif WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_HASHED
+
+// The slot where probing for c starts.  Fobs are issued in runs of
+// consecutive user codes, so the key is scrambled with a multiplicative hash
+// (Knuth's 2^32 / golden ratio) before reducing it to a slot.  Taking the
+// modulus of the raw key would lay a batch out as one long run of occupied
+// slots, and every unknown credential that hashed into the run would have to
+// probe to its end.
+static int wiegand26_home_index(struct wiegand26_credential * c) {
+  uint32_t key = ((uint32_t) c->facility << 16) | c->user;
+  uint32_t hash = key * 2654435761UL;
+  return (uint16_t) (hash >> 16) % WIEGAND26_MAX_CREDS;
+}
+
+static inline int next_wiegand26_index(int i) {
+  return (i + 1 == WIEGAND26_MAX_CREDS) ? 0 : i + 1;
+}
+
+// Probes from c's home slot.  Returns the index of the slot holding c, or -1.
+// When free_index is not NULL it is set to the first tombstone or empty slot
+// seen, which is where c belongs if it is not stored (-1 if the table is
+// full, or a slot can't be read).
+static int probe_wiegand26(struct wiegand26_credential * c, int * free_index) {
+  struct wiegand26_credential candidate;
+  int i = wiegand26_home_index(c);
+  if (free_index != NULL) {
+    *free_index = -1;
+  }
+  for (int probes = 0; probes < WIEGAND26_MAX_CREDS; probes++) {
+    if (!storage_read_wiegand26_credential(i, &candidate)) {
+      if (free_index != NULL) {
+        *free_index = -1;
+      }
+      return -1;
+    }
     if (c->facility == candidate.facility && c->user == candidate.user) {
+      return i;
+    }
+    if (WIEGAND26_IS_EMPTY(candidate)) {
+      // The end of the probe sequence
+      if (free_index != NULL && *free_index < 0) {
+        *free_index = i;
+      }
+      return -1;
+    }
+    if (free_index != NULL && *free_index < 0 && WIEGAND26_IS_TOMBSTONE(candidate)) {
+      *free_index = i;
+    }
+    i = next_wiegand26_index(i);
+  }
+  return -1;
+}
+
+static int find_wiegand26_index(struct wiegand26_credential * c) {
+  return probe_wiegand26(c, NULL);
+}
+
+// Moves the credentials that ungrouping packed into slots 0 to n - 1 to
+// where probing finds them.  Each one leaves a tombstone behind so the probe
+// sequences of those already moved stay unbroken, and tombstones that end
+// up followed by an empty slot are emptied at the end.  Slots that can't be
+// read are left alone.
+static void rehash_wiegand26_slots(int n) {
+  struct wiegand26_credential tombstone;
+  tombstone.facility = WIEGAND26_TOMBSTONE_FACILITY;
+  tombstone.user = WIEGAND26_TOMBSTONE_USER;
+  struct wiegand26_credential c;
+  for (int i = 0; i < n; i++) {
+    if (!read_wiegand26_slot(i, &c)
+      || (!WIEGAND26_IS_RESERVED(c) && wiegand26_home_index(&c) == i)) {
+      continue;
+    }
+    if (!write_wiegand26_slot(i, &tombstone)) {
+      continue;
+    }
+    int free_index;
+    if (!WIEGAND26_IS_RESERVED(c) && probe_wiegand26(&c, &free_index) < 0 && free_index >= 0) {
+      write_wiegand26_slot(free_index, &c);
+    }
+  }
+
+  // Walking backwards twice catches runs of tombstones that wrap around
+  struct wiegand26_credential empty;
+  empty.facility = 0;
+  empty.user = 0;
+  boolean next_empty = read_wiegand26_slot(0, &c) && WIEGAND26_IS_EMPTY(c);
+  for (int k = 2 * WIEGAND26_MAX_CREDS - 1; k >= 0; k--) {
+    int i = k % WIEGAND26_MAX_CREDS;
+    if (!read_wiegand26_slot(i, &c)) {
+      next_empty = false;
+      continue;
+    }
+    if (next_empty && WIEGAND26_IS_TOMBSTONE(c) && write_wiegand26_slot(i, &empty)) {
+      c = empty;
+    }
+    next_empty = WIEGAND26_IS_EMPTY(c);
+  }
+}
+
+boolean storage_add_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return false;
+  }
+  int free_index;
+  int i = probe_wiegand26(c, &free_index);
+  if (i >= 0) {
+    *index = i;
+    return true;
+  }
+  if (free_index < 0) {
+    return false;
+  }
+  *index = free_index;
+  return storage_write_wiegand26_credential(free_index, c);
+}
+
+boolean storage_remove_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return false;
+  }
+  int i = find_wiegand26_index(c);
+  if (i < 0) {
+    return false;
+  }
+  *index = i;
+
+  // A tombstone is only needed if another credential's probe sequence runs
+  // through this slot.  If the next slot is empty no sequence continues past
+  // here, so the slot (and any tombstones just before it) can become empty.
+  // A next slot that can't be read may continue one.
+  struct wiegand26_credential next;
+  if (!read_wiegand26_slot(next_wiegand26_index(i), &next) || !WIEGAND26_IS_EMPTY(next)) {
+    struct wiegand26_credential tombstone;
+    tombstone.facility = WIEGAND26_TOMBSTONE_FACILITY;
+    tombstone.user = WIEGAND26_TOMBSTONE_USER;
+    return storage_write_wiegand26_credential(i, &tombstone);
+  }
+  for (int n = 0; n < WIEGAND26_MAX_CREDS; n++) {
+    if (!write_wiegand26_empty(i)) {
+      return false;
+    }
+    i = (i == 0) ? WIEGAND26_MAX_CREDS - 1 : i - 1;
+    struct wiegand26_credential previous;
+    if (!read_wiegand26_slot(i, &previous) || !WIEGAND26_IS_TOMBSTONE(previous)) {
+      break;
+    }
+  }
+  return true;
+}
+
+#elif WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+
+// The group headers, kept in SRAM.  A group with no credentials is free.
+// When a header can't be written the copies may differ, so they are loaded
+// again (see wiegand26_zone_ready()).
+static byte group_facility[WIEGAND26_MAX_FACILITIES];
+static uint16_t group_count[WIEGAND26_MAX_FACILITIES];
+
+static boolean load_wiegand26_groups() {
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    byte bytes[WIEGAND26_GROUP_SIZE];
+    if (!storage_backend_read(WIEGAND26_GROUP_ADDR(g), bytes, WIEGAND26_GROUP_SIZE)) {
+      memset(group_count, 0, sizeof(group_count));
+      return false;
+    }
+    group_facility[g] = bytes[0];
+    group_count[g] = (bytes[1] << 8) | bytes[2];
+    if (group_count[g] > WIEGAND26_SLOTS) {
+      group_count[g] = 0;
+    }
+  }
+  return true;
+}
+
+static boolean save_wiegand26_group(byte g) {
+  byte bytes[WIEGAND26_GROUP_SIZE];
+  bytes[0] = group_facility[g];
+  bytes[1] = group_count[g] >> 8;
+  bytes[2] = group_count[g] & 0xff;
+  if (!update_zone_bytes(WIEGAND_FORMAT_26, WIEGAND26_GROUP_ADDR(g), bytes, WIEGAND26_GROUP_SIZE)) {
+    wiegand26_zone_converted = false;
+    return false;
+  }
+  return true;
+}
+
+static int wiegand26_total() {
+  int total = 0;
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    total += group_count[g];
+  }
+  return total;
+}
+
+// The index of the first credential of group g
+static int wiegand26_group_start(byte g) {
+  int start = 0;
+  for (byte h = 0; h < g; h++) {
+    start += group_count[h];
+  }
+  return start;
+}
+
+// Returns the group of facility, or -1.
+static int find_wiegand26_group(byte facility) {
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    if (group_count[g] > 0 && group_facility[g] == facility) {
+      return g;
+    }
+  }
+  return -1;
+}
+
+static boolean read_wiegand26_user(int index, uint16_t * user) {
+  byte bytes[WIEGAND26_USER_SIZE];
+  if (!storage_backend_read(WIEGAND26_USER_ADDR(index), bytes, WIEGAND26_USER_SIZE)) {
+    return false;
+  }
+  *user = (bytes[0] << 8) | bytes[1];
+  return true;
+}
+
+static boolean write_wiegand26_user(int index, uint16_t user) {
+  byte bytes[WIEGAND26_USER_SIZE];
+  bytes[0] = user >> 8;
+  bytes[1] = user & 0xff;
+  return update_zone_bytes(WIEGAND_FORMAT_26, WIEGAND26_USER_ADDR(index), bytes,
+                           WIEGAND26_USER_SIZE);
+}
+
+// Binary search of group g for user.  Returns the index holding it, or -1.
+// When insert_index is not NULL it is set to where user belongs (-1 if a
+// user code can't be read).
+static int search_wiegand26_group(byte g, uint16_t user, int * insert_index) {
+  int low = wiegand26_group_start(g);
+  int high = low + group_count[g];
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    uint16_t candidate;
+    if (!read_wiegand26_user(mid, &candidate)) {
+      low = -1;
+      break;
+    }
+    if (candidate == user) {
+      return mid;
+    }
+    if (candidate < user) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (insert_index != NULL) {
+    *insert_index = low;
+  }
+  return -1;
+}
+
+// Moves count user codes from index from to index to, a buffer at a time,
+// starting from the end that doesn't overwrite codes still to be moved.
+// Codes that land on an equal code cost no writes, and the high bytes of
+// neighbouring codes are often equal.  Returns false if a read or write
+// failed part way.
+#define MOVE_BUFFER_USERS 16
+
+static boolean move_wiegand26_users(int from, int to, int count) {
+  byte buffer[MOVE_BUFFER_USERS * WIEGAND26_USER_SIZE];
+  while (count > 0) {
+    int n = count < MOVE_BUFFER_USERS ? count : MOVE_BUFFER_USERS;
+    int offset = to > from ? count - n : 0;
+    if (!storage_backend_read(WIEGAND26_USER_ADDR(from + offset), buffer,
+                              n * WIEGAND26_USER_SIZE)
+      || !update_zone_bytes(WIEGAND_FORMAT_26, WIEGAND26_USER_ADDR(to + offset), buffer,
+                            n * WIEGAND26_USER_SIZE)) {
+      return false;
+    }
+    count -= n;
+    if (to < from) {
+      from += n;
+      to += n;
+    }
+  }
+  return true;
+}
+
+static boolean remove_wiegand26_user(byte g, int index) {
+#if WIEGAND26_FILTER_BITS > 0
+  wiegand26_filter_stale = true;
+#endif
+  if (!move_wiegand26_users(index + 1, index, wiegand26_total() - index - 1)) {
+    return false;
+  }
+  group_count[g]--;
+  return save_wiegand26_group(g);
+}
+
+static int find_wiegand26_index(struct wiegand26_credential * c) {
+  if (!wiegand26_zone_ready()) {
+    return -1;
+  }
+  int g = find_wiegand26_group(c->facility);
+  if (g < 0) {
+    return -1;
+  }
+  return search_wiegand26_group(g, c->user, NULL);
+}
+
+boolean storage_read_wiegand26_credential(int index, struct wiegand26_credential * c) {
+  if (index < 0 || index >= WIEGAND26_SLOTS || !wiegand26_zone_ready()) {
+    return false;
+  }
+  int start = 0;
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    if (index < start + group_count[g]) {
+      c->facility = group_facility[g];
+      return read_wiegand26_user(index, &c->user);
+    }
+    start += group_count[g];
+  }
+  // Slots past the last credential are empty
+  c->facility = 0;
+  c->user = 0;
+  return true;
+}
+
+boolean storage_add_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c) || !wiegand26_zone_ready()) {
+    return false;
+  }
+  int insert_index;
+  int g = find_wiegand26_group(c->facility);
+  if (g >= 0) {
+    int i = search_wiegand26_group(g, c->user, &insert_index);
+    if (i >= 0) {
+      *index = i;
+      return true;
+    }
+    if (insert_index < 0) {
+      return false;
+    }
+  }
+  int total = wiegand26_total();
+  if (total == WIEGAND26_SLOTS) {
+    return false;
+  }
+  if (g < 0) {
+    // Start a group in the first free header
+    for (g = 0; g < WIEGAND26_MAX_FACILITIES && group_count[g] > 0; g++) {
+    }
+    if (g == WIEGAND26_MAX_FACILITIES) {
+      return false;
+    }
+    group_facility[g] = c->facility;
+    insert_index = wiegand26_group_start(g);
+  }
+  // In the filter before it can be found, even if a write fails
+#if WIEGAND26_FILTER_BITS > 0
+  add_to_wiegand26_filter(c);
+#endif
+  *index = insert_index;
+  if (!move_wiegand26_users(insert_index, insert_index + 1, total - insert_index)
+    || !write_wiegand26_user(insert_index, c->user)) {
+    return false;
+  }
+  group_count[g]++;
+  return save_wiegand26_group(g);
+}
+
+boolean storage_remove_wiegand26_credential(struct wiegand26_credential * c, int * index) {
+  if (WIEGAND26_IS_RESERVED(*c) || !wiegand26_zone_ready()) {
+    return false;
+  }
+  int g = find_wiegand26_group(c->facility);
+  if (g < 0) {
+    return false;
+  }
+  int i = search_wiegand26_group(g, c->user, NULL);
+  if (i < 0) {
+    return false;
+  }
+  *index = i;
+  return remove_wiegand26_user(g, i);
+}
+
+// Replaces the credential at index, if there is one, with cred, which goes
+// to its sorted position.  A reserved cred just removes.
+boolean storage_write_wiegand26_credential(int index, struct wiegand26_credential * cred) {
+  struct wiegand26_credential old;
+  if (!storage_read_wiegand26_credential(index, &old)) {
+    return false;
+  }
+  if (old.facility == cred->facility && old.user == cred->user) {
+    return true;
+  }
+  if (index < wiegand26_total() && !remove_wiegand26_user(find_wiegand26_group(old.facility), index)) {
+    return false;
+  }
+  if (WIEGAND26_IS_RESERVED(*cred)) {
+    return true;
+  }
+  int added;
+  return storage_add_wiegand26_credential(cred, &added);
+}
+
+// Empties the table.  Returns true if it held anything and every header was
+// written.
+static boolean clear_wiegand26_groups() {
+  if (!wiegand26_zone_ready()) {
+    return false;
+  }
+  boolean cleared = false;
+  for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+    if (group_count[g] > 0) {
+      group_count[g] = 0;
+      if (!save_wiegand26_group(g)) {
+        return false;
+      }
+      cleared = true;
+    }
+  }
+  return cleared;
+}
+
+// Converting a flat or hashed table takes three steps.  The credentials are
+// packed into the first slots, sorted by facility and user, and then their
+// user codes are written over the slots.  The first two steps leave a table
+// the old layout can still read, and STORAGE_LAYOUT_CONVERTING marks the
+// last one, which can't be resumed.  Each step stops at a failed read, since
+// going on could overwrite the credential it couldn't read.
+
+// Returns the number of credentials, or -1.
+static int pack_wiegand26_slots() {
+  struct wiegand26_credential c;
+  int n = 0;
+  for (int i = 0; i < WIEGAND26_MAX_CREDS; i++) {
+    if (!read_wiegand26_slot(i, &c)) {
+      return -1;
+    }
+    if (WIEGAND26_IS_RESERVED(c)) {
+      continue;
+    }
+    if (i != n) {
+      write_wiegand26_slot(n, &c);
+    }
+    n++;
+  }
+  return n;
+}
+
+static uint32_t wiegand26_key(struct wiegand26_credential * c) {
+  return ((uint32_t) c->facility << 16) | c->user;
+}
+
+// Sorts slots 0 to n - 1.  Each pass over the unsorted slots picks out the
+// SORT_BATCH smallest and swaps them into place, so sorting reads the table
+// about n / SORT_BATCH times and writes each credential at most twice.
+#define SORT_BATCH 16
+
+static boolean sort_wiegand26_slots(int n) {
+  uint32_t keys[SORT_BATCH];
+  int indexes[SORT_BATCH];
+  struct wiegand26_credential c;
+  int sorted = 0;
+  while (sorted < n) {
+    byte m = 0;
+    for (int i = sorted; i < n; i++) {
+      if (!read_wiegand26_slot(i, &c)) {
+        return false;
+      }
+      uint32_t key = wiegand26_key(&c);
+      if (m == SORT_BATCH && key >= keys[m - 1]) {
+        continue;
+      }
+      byte j = m < SORT_BATCH ? m++ : m - 1;
+      for (; j > 0 && keys[j - 1] > key; j--) {
+        keys[j] = keys[j - 1];
+        indexes[j] = indexes[j - 1];
+      }
+      keys[j] = key;
+      indexes[j] = i;
+    }
+    for (byte b = 0; b < m; b++) {
+      int target = sorted + b;
+      int source = indexes[b];
+      if (source == target) {
+        continue;
+      }
+      struct wiegand26_credential moving, displaced;
+      if (!read_wiegand26_slot(source, &moving) || !read_wiegand26_slot(target, &displaced)) {
+        return false;
+      }
+      write_wiegand26_slot(target, &moving);
+      write_wiegand26_slot(source, &displaced);
+      for (byte later = b + 1; later < m; later++) {
+        if (indexes[later] == target) {
+          indexes[later] = source;
+        }
+      }
+    }
+    sorted += m;
+  }
+  return true;
+}
+
+// User code i is written once the slot after it has been read, and it ends
+// before that slot starts for all but the first few, which wait in SRAM.
+#define GROUP_PENDING (WIEGAND26_MAX_FACILITIES + 2)
+
+static boolean group_wiegand26_slots(int n) {
+  uint16_t pending[GROUP_PENDING];
+  byte pending_first = 0;
+  byte pending_count = 0;
+  int stored = 0;
+  int written = 0;
+  int dropped = 0;
+  byte groups = 0;
+  uint32_t last_key = 0xffffffff;
+  struct wiegand26_credential c;
+  for (int i = 0; i < n; i++) {
+    if (!read_wiegand26_slot(i, &c)) {
+      return false;
+    }
+    uint32_t key = wiegand26_key(&c);
+    if (key == last_key) {
+      // Flat tables can hold a credential twice
+      continue;
+    }
+    last_key = key;
+    if (groups == 0 || group_facility[groups - 1] != c.facility) {
+      if (groups == WIEGAND26_MAX_FACILITIES) {
+        dropped++;
+        continue;
+      }
+      group_facility[groups++] = c.facility;
+    }
+    if (stored == WIEGAND26_SLOTS) {
+      dropped++;
+      continue;
+    }
+    group_count[groups - 1]++;
+    stored++;
+    pending[(pending_first + pending_count++) % GROUP_PENDING] = c.user;
+    while (pending_count > 0 && WIEGAND26_USER_ADDR(written + 1) <= WIEGAND26_ZONE_ADDR(i + 1)) {
+      write_wiegand26_user(written++, pending[pending_first]);
+      pending_first = (pending_first + 1) % GROUP_PENDING;
+      pending_count--;
+    }
+  }
+  while (pending_count > 0) {
+    write_wiegand26_user(written++, pending[pending_first]);
+    pending_first = (pending_first + 1) % GROUP_PENDING;
+    pending_count--;
+  }
+  if (dropped > 0) {
+    P("Dropped w26 credentials: ");
+    PLDEC(dropped);
+  }
+  return true;
+}
+
+// Converts a flat or hashed table, or empties one whose conversion was cut
+// short, then loads the group headers.  Returns false if a read or write
+// failed, which leaves the table as the last step that succeeded did.
+static boolean convert_wiegand26_zone() {
+  int layout = storage_backend_read_byte(STORAGE_LAYOUT_ADDR);
+  if (layout < 0) {
+    return false;
+  }
+  if (layout != STORAGE_LAYOUT_GROUPED) {
+    uint16_t errors = storage_backend_errors();
+    memset(group_count, 0, sizeof(group_count));
+    if (layout != STORAGE_LAYOUT_CONVERTING) {
+      int n = pack_wiegand26_slots();
+      if (n < 0 || !sort_wiegand26_slots(n) || storage_backend_errors() != errors
+        || !set_storage_layout(STORAGE_LAYOUT_CONVERTING)) {
+        return false;
+      }
+      if (!group_wiegand26_slots(n)) {
+        return false;
+      }
+    }
+    for (byte g = 0; g < WIEGAND26_MAX_FACILITIES; g++) {
+      save_wiegand26_group(g);
+    }
+    if (storage_backend_errors() != errors || !set_storage_layout(STORAGE_LAYOUT_GROUPED)) {
+      return false;
+    }
+  }
+  return load_wiegand26_groups();
+}
+
+#else
+# error Unknown WIEGAND26_LAYOUT
+#endif
+
+boolean storage_find_wiegand26_credential(struct wiegand26_credential * c) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return false;
+  }
+#if WIEGAND26_FILTER_BITS > 0
+  if (!wiegand26_filter_may_contain(c)) {
+    wiegand26_filter_rejected++;
+    return false;
+  }
+  if (find_wiegand26_index(c) < 0) {
+    wiegand26_filter_false_positives++;
+    return false;
+  }
+  return true;
+#else
+  return find_wiegand26_index(c) >= 0;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Wiegand-26 Rules
+//////////////////////////////////////////////////////////////////////////////
+
+#if WIEGAND26_MAX_RULES > 0
+
+// A copy of the rule zone, so checking a presented credential reads no
+// EEPROM.  Free slots hold WIEGAND26_RULE_NONE.  It is read again after a
+// failed read or write, until then rule functions fail.
+static struct wiegand26_rule wiegand26_rules[WIEGAND26_MAX_RULES];
+static boolean wiegand26_rules_loaded = false;
+
+static boolean wiegand26_rule_is_valid(struct wiegand26_rule * r) {
+  return (r->kind == WIEGAND26_RULE_NONE || r->kind == WIEGAND26_RULE_ALLOW
+    || r->kind == WIEGAND26_RULE_DENY) && r->first_user <= r->last_user;
+}
+
+static boolean wiegand26_rules_equal(struct wiegand26_rule * a, struct wiegand26_rule * b) {
+  return a->kind == b->kind && a->facility == b->facility
+    && a->first_user == b->first_user && a->last_user == b->last_user;
+}
+
+static boolean load_wiegand26_rules() {
+  wiegand26_rules_loaded = false;
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    byte bytes[WIEGAND26_RULE_SIZE];
+    if (!storage_backend_read(WIEGAND26_RULE_ADDR(i), bytes, WIEGAND26_RULE_SIZE)) {
+      return false;
+    }
+    struct wiegand26_rule * r = &wiegand26_rules[i];
+    r->kind = bytes[0];
+    r->facility = bytes[1];
+    r->first_user = (bytes[2] << 8) | bytes[3];
+    r->last_user = (bytes[4] << 8) | bytes[5];
+    if (r->kind == WIEGAND26_RULE_NONE || !wiegand26_rule_is_valid(r)) {
+      memset(r, 0, sizeof(*r));
+    }
+  }
+  wiegand26_rules_loaded = true;
+  return true;
+}
+
+static boolean wiegand26_rules_ready() {
+  return wiegand26_rules_loaded || load_wiegand26_rules();
+}
+
+boolean storage_write_wiegand26_rule(int index, struct wiegand26_rule * r) {
+  if (index < 0 || index >= WIEGAND26_MAX_RULES || !wiegand26_rule_is_valid(r)
+    || !wiegand26_rules_ready()) {
+    return false;
+  }
+  struct wiegand26_rule stored = *r;
+  if (stored.kind == WIEGAND26_RULE_NONE) {
+    memset(&stored, 0, sizeof(stored));
+  }
+  byte bytes[WIEGAND26_RULE_SIZE];
+  bytes[0] = stored.kind;
+  bytes[1] = stored.facility;
+  bytes[2] = stored.first_user >> 8;
+  bytes[3] = stored.first_user;
+  bytes[4] = stored.last_user >> 8;
+  bytes[5] = stored.last_user;
+  if (update_bytes(WIEGAND26_RULE_ADDR(index), bytes, WIEGAND26_RULE_SIZE) < 0) {
+    wiegand26_rules_loaded = false;
+    return false;
+  }
+  wiegand26_rules[index] = stored;
+  return true;
+}
+
+boolean storage_read_wiegand26_rule(int index, struct wiegand26_rule * r) {
+  if (index < 0 || index >= WIEGAND26_MAX_RULES || !wiegand26_rules_ready()) {
+    return false;
+  }
+  *r = wiegand26_rules[index];
+  return true;
+}
+
+boolean storage_add_wiegand26_rule(struct wiegand26_rule * r, int * index) {
+  if (r->kind == WIEGAND26_RULE_NONE || !wiegand26_rule_is_valid(r)
+    || !wiegand26_rules_ready()) {
+    return false;
+  }
+  int free_index = -1;
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    if (wiegand26_rules_equal(&wiegand26_rules[i], r)) {
+      *index = i;
       return true;
     }
+    if (free_index < 0 && wiegand26_rules[i].kind == WIEGAND26_RULE_NONE) {
+      free_index = i;
+    }
+  }
+  if (free_index < 0) {
+    return false;
+  }
+  *index = free_index;
+  return storage_write_wiegand26_rule(free_index, r);
+}
+
+boolean storage_remove_wiegand26_rule(struct wiegand26_rule * r, int * index) {
+  if (r->kind == WIEGAND26_RULE_NONE || !wiegand26_rules_ready()) {
+    return false;
+  }
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    if (wiegand26_rules_equal(&wiegand26_rules[i], r)) {
+      struct wiegand26_rule empty;
+      memset(&empty, 0, sizeof(empty));
+      *index = i;
+      return storage_write_wiegand26_rule(i, &empty);
+    }
+  }
+  return false;
+}
+
+byte storage_check_wiegand26_rules(struct wiegand26_credential * c) {
+  if (WIEGAND26_IS_RESERVED(*c)) {
+    return WIEGAND26_RULE_NONE;
+  }
+  if (!wiegand26_rules_ready()) {
+    // Any of them could be a deny rule
+    return WIEGAND26_RULE_DENY;
+  }
+  byte result = WIEGAND26_RULE_NONE;
+  for (int i = 0; i < WIEGAND26_MAX_RULES; i++) {
+    struct wiegand26_rule * r = &wiegand26_rules[i];
+    if (r->kind == WIEGAND26_RULE_NONE || r->facility != c->facility
+      || c->user < r->first_user || c->user > r->last_user) {
+      continue;
+    }
+    if (r->kind == WIEGAND26_RULE_DENY) {
+      return WIEGAND26_RULE_DENY;
+    }
+    result = WIEGAND26_RULE_ALLOW;
   }
+  return result;
+}
+
+#else
+
+static boolean load_wiegand26_rules() {
+  return true;
+}
+
+boolean storage_write_wiegand26_rule(int index, struct wiegand26_rule * r) {
+  return false;
+}
+
+boolean storage_read_wiegand26_rule(int index, struct wiegand26_rule * r) {
   return false;
 }
-  
 
+boolean storage_add_wiegand26_rule(struct wiegand26_rule * r, int * index) {
+  return false;
+}
+
+boolean storage_remove_wiegand26_rule(struct wiegand26_rule * r, int * index) {
+  return false;
+}
+
+byte storage_check_wiegand26_rules(struct wiegand26_credential * c) {
+  return WIEGAND26_RULE_NONE;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// Credentials of Any Format
+//////////////////////////////////////////////////////////////////////////////
+
+struct credential_zone {
+  int start;
+  int max_creds;
+  byte cred_size;
+};
+
+// Indexed by WIEGAND_FORMAT_*
+static const struct credential_zone zones[WIEGAND_NUM_FORMATS] = {
+  { WIEGAND26_ZONE_START, WIEGAND26_SLOTS, WIEGAND26_ZONE_CRED_SIZE },
+  { WIEGAND34_ZONE_START, WIEGAND34_MAX_CREDS, WIEGAND34_ZONE_CRED_SIZE },
+  { WIEGAND35_ZONE_START, WIEGAND35_MAX_CREDS, WIEGAND35_ZONE_CRED_SIZE },
+  { WIEGAND37_ZONE_START, WIEGAND37_MAX_CREDS, WIEGAND37_ZONE_CRED_SIZE },
+};
+
+#define MAX_ZONE_CRED_SIZE 5
+
+static void to_wiegand26(struct wiegand_credential * c, struct wiegand26_credential * c26) {
+  c26->facility = c->facility;
+  c26->user = c->user;
+}
+
+// Packs c into its zone's byte layout.  Returns the number of bytes.
+static byte pack_credential(struct wiegand_credential * c, byte * bytes) {
+  struct wiegand_format f;
+  wiegand_get_format(c->format, &f);
+  byte size = zones[c->format].cred_size;
+  uint64_t value = ((uint64_t) c->facility << f.user_bits) | c->user;
+  for (int i = size - 1; i >= 0; i--) {
+    bytes[i] = value & 0xff;
+    value >>= 8;
+  }
+  return size;
+}
+
+// Free slots of formats other than Wiegand-26 are all 0x00 (removed) or all
+// 0xff (erased).
+static boolean is_free_slot(byte * bytes, byte size) {
+  byte all_zeros = 0x00;
+  byte all_ones = 0xff;
+  for (byte i = 0; i < size; i++) {
+    all_zeros |= bytes[i];
+    all_ones &= bytes[i];
+  }
+  return all_zeros == 0x00 || all_ones == 0xff;
+}
+
+static void unpack_credential(byte format, byte * bytes, struct wiegand_credential * c) {
+  struct wiegand_format f;
+  wiegand_get_format(format, &f);
+  uint64_t value = 0;
+  for (byte i = 0; i < zones[format].cred_size; i++) {
+    value = (value << 8) | bytes[i];
+  }
+  c->format = format;
+  c->user = value & ((1UL << f.user_bits) - 1);
+  c->facility = value >> f.user_bits;
+}
+
+int storage_max_credentials(byte format) {
+  if (format >= WIEGAND_NUM_FORMATS || !WIEGAND_FORMAT_ENABLED(format)) {
+    return 0;
+  }
+  return zones[format].max_creds;
+}
+
+boolean storage_credential_is_reserved(struct wiegand_credential * c) {
+  if (c->format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    to_wiegand26(c, &c26);
+    return WIEGAND26_IS_RESERVED(c26);
+  }
+  byte bytes[MAX_ZONE_CRED_SIZE];
+  byte size = pack_credential(c, bytes);
+  return is_free_slot(bytes, size);
+}
+
+// Reads the raw bytes of a slot in the zone of a format other than
+// Wiegand-26 and checks them, since an erased slot doesn't survive being
+// unpacked and packed again.  A slot that can't be read is not free.
+static boolean slot_is_free(byte format, int index) {
+  byte bytes[MAX_ZONE_CRED_SIZE];
+  byte size = zones[format].cred_size;
+  return storage_backend_read(zones[format].start + index * size, bytes, size)
+    && is_free_slot(bytes, size);
+}
+
+boolean storage_write_credential(int index, struct wiegand_credential * c) {
+  if (index < 0 || index >= storage_max_credentials(c->format)) {
+    return false;
+  }
+  if (c->format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    to_wiegand26(c, &c26);
+    return storage_write_wiegand26_credential(index, &c26);
+  }
+  byte bytes[MAX_ZONE_CRED_SIZE];
+  byte size = pack_credential(c, bytes);
+  int addr = zones[c->format].start + index * size;
+  return update_zone_bytes(c->format, addr, bytes, size);
+}
+
+boolean storage_read_credential(byte format, int index, struct wiegand_credential * c) {
+  if (index < 0 || index >= storage_max_credentials(format)) {
+    return false;
+  }
+  if (format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    if (!storage_read_wiegand26_credential(index, &c26)) {
+      return false;
+    }
+    c->format = format;
+    c->facility = c26.facility;
+    c->user = c26.user;
+    return true;
+  }
+  byte bytes[MAX_ZONE_CRED_SIZE];
+  byte size = zones[format].cred_size;
+  int addr = zones[format].start + index * size;
+  if (!storage_backend_read(addr, bytes, size)) {
+    return false;
+  }
+  unpack_credential(format, bytes, c);
+  return true;
+}
+
+// Scans the zone of a format other than Wiegand-26 for c.  Returns the index
+// of the slot holding it, or -1.  When free_index is not NULL it is set to
+// the first free slot (-1 if there is none, or a slot can't be read).
+static int scan_zone(struct wiegand_credential * c, int * free_index) {
+  const struct credential_zone * zone = &zones[c->format];
+  byte key[MAX_ZONE_CRED_SIZE];
+  pack_credential(c, key);
+  if (free_index != NULL) {
+    *free_index = -1;
+  }
+  int addr = zone->start;
+  for (int i = 0; i < zone->max_creds; i++, addr += zone->cred_size) {
+    // Compare a byte at a time so most slots cost one read
+    byte j = 0;
+    for (; j < zone->cred_size; j++) {
+      int b = storage_backend_read_byte(addr + j);
+      if (b < 0) {
+        if (free_index != NULL) {
+          *free_index = -1;
+        }
+        return -1;
+      }
+      if (b != key[j]) {
+        break;
+      }
+    }
+    if (j == zone->cred_size) {
+      return i;
+    }
+    if (free_index != NULL && *free_index < 0 && slot_is_free(c->format, i)) {
+      *free_index = i;
+    }
+  }
+  return -1;
+}
+
+boolean storage_find_credential(struct wiegand_credential * c) {
+  if (storage_max_credentials(c->format) == 0) {
+    return false;
+  }
+  if (c->format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    to_wiegand26(c, &c26);
+    byte rule = storage_check_wiegand26_rules(&c26);
+    if (rule != WIEGAND26_RULE_NONE) {
+      return rule == WIEGAND26_RULE_ALLOW;
+    }
+    return storage_find_wiegand26_credential(&c26);
+  }
+  if (storage_credential_is_reserved(c)) {
+    return false;
+  }
+  return scan_zone(c, NULL) >= 0;
+}
+
+boolean storage_add_credential(struct wiegand_credential * c, int * index) {
+  if (storage_max_credentials(c->format) == 0 || storage_credential_is_reserved(c)) {
+    return false;
+  }
+  if (c->format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    to_wiegand26(c, &c26);
+    return storage_add_wiegand26_credential(&c26, index);
+  }
+  int free_index;
+  int i = scan_zone(c, &free_index);
+  if (i >= 0) {
+    *index = i;
+    return true;
+  }
+  if (free_index < 0) {
+    return false;
+  }
+  *index = free_index;
+  return storage_write_credential(free_index, c);
+}
+
+boolean storage_remove_credential(struct wiegand_credential * c, int * index) {
+  if (storage_max_credentials(c->format) == 0 || storage_credential_is_reserved(c)) {
+    return false;
+  }
+  if (c->format == WIEGAND_FORMAT_26) {
+    struct wiegand26_credential c26;
+    to_wiegand26(c, &c26);
+    return storage_remove_wiegand26_credential(&c26, index);
+  }
+  int i = scan_zone(c, NULL);
+  if (i < 0) {
+    return false;
+  }
+  struct wiegand_credential empty;
+  empty.format = c->format;
+  empty.facility = 0;
+  empty.user = 0;
+  *index = i;
+  return storage_write_credential(i, &empty);
+}
+
+boolean storage_clear_credential(byte format, int index) {
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+  if (format == WIEGAND_FORMAT_26) {
+    return index == 0 && clear_wiegand26_groups();
+  }
+#endif
+  struct wiegand_credential c;
+  if (!storage_read_credential(format, index, &c)) {
+    return false;
+  }
+  if (format == WIEGAND_FORMAT_26) {
+    // Tombstones are cleared too
+    struct wiegand26_credential c26;
+    to_wiegand26(&c, &c26);
+    if (WIEGAND26_IS_EMPTY(c26)) {
+      return false;
+    }
+  } else if (slot_is_free(format, index)) {
+    return false;
+  }
+  c.facility = 0;
+  c.user = 0;
+  return storage_write_credential(index, &c);
+}
+
+void storage_get_wear_stats(byte format, struct storage_wear_stats * stats) {
+  stats->writes = zone_writes[format];
+  if (format == WIEGAND_FORMAT_26) {
+    stats->bytes = WIEGAND26_ZONE_END - WIEGAND26_ZONE_START;
+  } else {
+    stats->bytes = zones[format].max_creds * zones[format].cred_size;
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Event Log
+//////////////////////////////////////////////////////////////////////////////
+
+static void pack_event(uint32_t seq, struct event_log_entry * e, byte * bytes) {
+  // Two bytes, in case era is made a uint16_t (see time.h)
+  bytes[0] = e->time.era >> 8;
+  bytes[1] = e->time.era;
+  bytes[2] = e->time.ms >> 24;
+  bytes[3] = e->time.ms >> 16;
+  bytes[4] = e->time.ms >> 8;
+  bytes[5] = e->time.ms;
+  bytes[6] = e->reader;
+  bytes[7] = e->result;
+  bytes[8] = e->cred.format;
+  bytes[9] = e->cred.facility >> 8;
+  bytes[10] = e->cred.facility;
+  bytes[11] = e->cred.user >> 16;
+  bytes[12] = e->cred.user >> 8;
+  bytes[13] = e->cred.user;
+  // EVENT_SEQ_OFFSET
+  bytes[14] = seq >> 24;
+  bytes[15] = seq >> 16;
+  bytes[16] = seq >> 8;
+  bytes[17] = seq;
+}
+
+uint32_t storage_read_event(int slot, struct event_log_entry * e) {
+  if (slot < 0 || slot >= EVENT_LOG_EEPROM_SIZE) {
+    return 0;
+  }
+  byte bytes[EVENT_LOG_ZONE_RECORD_SIZE];
+  if (!storage_backend_read(EVENT_LOG_ZONE_ADDR(slot), bytes, EVENT_LOG_ZONE_RECORD_SIZE)) {
+    return 0;
+  }
+  uint32_t seq = ((uint32_t) bytes[14] << 24) | ((uint32_t) bytes[15] << 16)
+    | ((uint32_t) bytes[16] << 8) | bytes[17];
+  if (seq == 0xffffffff) {
+    return 0;
+  }
+  e->time.era = ((uint16_t) bytes[0] << 8) | bytes[1];
+  e->time.ms = ((uint32_t) bytes[2] << 24) | ((uint32_t) bytes[3] << 16)
+    | ((uint32_t) bytes[4] << 8) | bytes[5];
+  e->reader = bytes[6];
+  e->result = bytes[7];
+  e->cred.format = bytes[8];
+  e->cred.facility = ((uint16_t) bytes[9] << 8) | bytes[10];
+  e->cred.user = ((uint32_t) bytes[11] << 16) | ((uint32_t) bytes[12] << 8) | bytes[13];
+  return seq;
+}
+
+// Writes the bytes of buf from *done on that differ from what EEPROM holds,
+// until *writes reaches max_writes or a write fails.  Returns true when all
+// len are written.
+static boolean update_event_bytes(int addr, const byte * buf, byte len, byte * done,
+                                  byte * writes, byte max_writes) {
+  while (*done < len) {
+    if (storage_backend_read_byte(addr + *done) == buf[*done]) {
+      (*done)++;
+      continue;
+    }
+    if (*writes == max_writes) {
+      return false;
+    }
+    // Write the run of differing bytes that starts here, up to max_writes
+    byte run = 1;
+    while (*done + run < len && *writes + run < max_writes
+      && storage_backend_read_byte(addr + *done + run) != buf[*done + run]) {
+      run++;
+    }
+    if (!storage_backend_write(addr + *done, buf + *done, run)) {
+      return false;
+    }
+    *writes += run;
+    *done += run;
+  }
+  return true;
+}
+
+// The first EVENT_SEQ_SIZE steps of writing a record zero the number it
+// holds, and the rest write the new record, number last.  Numbers are
+// written most significant byte first, so one cut short by a reset reads as
+// no larger than the number it replaces or the one being written, and the
+// record never looks newer than the newest complete one.
+#define EVENT_SEQ_OFFSET 14
+#define EVENT_SEQ_SIZE   4
+
+boolean storage_write_event(int slot, uint32_t seq, struct event_log_entry * e,
+                            byte * next_byte, byte max_writes) {
+  if (slot < 0 || slot >= EVENT_LOG_EEPROM_SIZE) {
+    return true;
+  }
+  int addr = EVENT_LOG_ZONE_ADDR(slot);
+  byte writes = 0;
+  if (*next_byte < EVENT_SEQ_SIZE) {
+    const byte zeros[EVENT_SEQ_SIZE] = { 0, 0, 0, 0 };
+    if (!update_event_bytes(addr + EVENT_SEQ_OFFSET, zeros, EVENT_SEQ_SIZE, next_byte,
+                            &writes, max_writes)) {
+      return false;
+    }
+  }
+  byte bytes[EVENT_LOG_ZONE_RECORD_SIZE];
+  pack_event(seq, e, bytes);
+  byte done = *next_byte - EVENT_SEQ_SIZE;
+  boolean complete = update_event_bytes(addr, bytes, EVENT_LOG_ZONE_RECORD_SIZE, &done,
+                                        &writes, max_writes);
+  *next_byte = done + EVENT_SEQ_SIZE;
+  return complete;
+}
@@ -8,6 +8,8 @@
 
 #include "config.h"
 #include "wiegand.h"
+#include "event_log.h"
+#include "storage_backend.h"
 
 // EEPROM data map.  _START are inclusive, _END are exclusive.
 
@@ -17,20 +19,220 @@
 #define WIEGAND26_ZONE_END         (WIEGAND26_ZONE_START + (WIEGAND26_ZONE_CRED_SIZE * WIEGAND26_MAX_CREDS))
 #define WIEGAND26_ZONE_ADDR(I)     (WIEGAND26_ZONE_START + (WIEGAND26_ZONE_CRED_SIZE * (I)))
 
+// Reserved Wiegand-26 values.  Facility 0, user 0 marks an empty slot (it is
+// what "x w26" writes) and facility 255, user 65535 is what erased EEPROM
+// reads as, so both are free slots and never match a presented credential.
+// The hashed layout marks removed credentials with a tombstone so lookups
+// keep probing past them.
+#define WIEGAND26_IS_EMPTY(c)      (((c).facility == 0 && (c).user == 0) \
+                                 || ((c).facility == 0xff && (c).user == 0xffff))
+#define WIEGAND26_TOMBSTONE_FACILITY 0
+#define WIEGAND26_TOMBSTONE_USER     0xffff
+#define WIEGAND26_IS_TOMBSTONE(c)  ((c).facility == WIEGAND26_TOMBSTONE_FACILITY \
+                                 && (c).user == WIEGAND26_TOMBSTONE_USER)
+#define WIEGAND26_IS_RESERVED(c)   (WIEGAND26_IS_EMPTY(c) || WIEGAND26_IS_TOMBSTONE(c))
+
+// The grouped layout (WIEGAND26_LAYOUT_GROUPED) uses the same zone as
+// WIEGAND26_MAX_FACILITIES group headers, each a facility and its number of
+// credentials (2 bytes), followed by the user codes (2 bytes each) of every
+// group in header order, sorted within each group.  All values are most
+// significant byte first.
+#define WIEGAND26_GROUP_SIZE       3
+#define WIEGAND26_GROUP_ADDR(G)    (WIEGAND26_ZONE_START + (WIEGAND26_GROUP_SIZE * (G)))
+#define WIEGAND26_USERS_START      WIEGAND26_GROUP_ADDR(WIEGAND26_MAX_FACILITIES)
+#define WIEGAND26_USER_SIZE        2
+#define WIEGAND26_USER_ADDR(I)     (WIEGAND26_USERS_START + (WIEGAND26_USER_SIZE * (I)))
+
+#define WIEGAND26_GROUPED_SLOTS    ((WIEGAND26_ZONE_END - WIEGAND26_USERS_START) / WIEGAND26_USER_SIZE)
+
+// Number of Wiegand-26 slots
+#if WIEGAND26_LAYOUT == WIEGAND26_LAYOUT_GROUPED
+# define WIEGAND26_SLOTS           WIEGAND26_GROUPED_SLOTS
+#else
+# define WIEGAND26_SLOTS           WIEGAND26_MAX_CREDS
+#endif
+
+// Longer Wiegand formats, one zone each.  A credential is stored as 
+// (facility << user bits) | user, most significant byte first.  All 0 bytes
+// is an empty slot and all 1 bytes (erased EEPROM) is free too.
+#define WIEGAND34_ZONE_START       WIEGAND26_ZONE_END
+#define WIEGAND34_ZONE_CRED_SIZE   4
+#define WIEGAND34_ZONE_END         (WIEGAND34_ZONE_START + (WIEGAND34_ZONE_CRED_SIZE * WIEGAND34_MAX_CREDS))
+
+#define WIEGAND35_ZONE_START       WIEGAND34_ZONE_END
+#define WIEGAND35_ZONE_CRED_SIZE   4
+#define WIEGAND35_ZONE_END         (WIEGAND35_ZONE_START + (WIEGAND35_ZONE_CRED_SIZE * WIEGAND35_MAX_CREDS))
+
+#define WIEGAND37_ZONE_START       WIEGAND35_ZONE_END
+#define WIEGAND37_ZONE_CRED_SIZE   5
+#define WIEGAND37_ZONE_END         (WIEGAND37_ZONE_START + (WIEGAND37_ZONE_CRED_SIZE * WIEGAND37_MAX_CREDS))
+
+// EEPROM byte writes made to each credential zone, STORAGE_WEAR_CELLS
+// uint32_t cells per format indexed by WIEGAND_FORMAT_*, least significant
+// byte first.  Saves go to each cell in turn, so the largest count is the
+// latest.  Erased EEPROM reads as no writes.
+#define STORAGE_WEAR_ZONE_START    WIEGAND37_ZONE_END
+#define STORAGE_WEAR_ZONE_END      (STORAGE_WEAR_ZONE_START + 4 * STORAGE_WEAR_CELLS * WIEGAND_NUM_FORMATS)
+#define STORAGE_WEAR_ADDR(F, C)    (STORAGE_WEAR_ZONE_START + 4 * (STORAGE_WEAR_CELLS * (F) + (C)))
+
+// Event log records (see EVENT_LOG_EEPROM_SIZE), event n in slot
+// n % EVENT_LOG_EEPROM_SIZE.  A record is the event's era (2 bytes) and
+// millis (4 bytes), reader, result, credential format, facility (2 bytes),
+// user (3 bytes) and number (4 bytes), most significant byte first.  The number is zeroed before the
+// record is rewritten and written last, so a record cut short by a reset
+// doesn't look like the newest event.
+#define EVENT_LOG_ZONE_START       STORAGE_WEAR_ZONE_END
+#define EVENT_LOG_ZONE_RECORD_SIZE 18
+#define EVENT_LOG_ZONE_END         (EVENT_LOG_ZONE_START + (EVENT_LOG_ZONE_RECORD_SIZE * EVENT_LOG_EEPROM_SIZE))
+#define EVENT_LOG_ZONE_ADDR(I)     (EVENT_LOG_ZONE_START + (EVENT_LOG_ZONE_RECORD_SIZE * (I)))
+
+// Which layout the Wiegand-26 zone holds, so the grouped layout can be
+// converted to and from the others.  Firmware from before the grouped layout
+// leaves it erased.
+#define STORAGE_LAYOUT_ADDR        EVENT_LOG_ZONE_END
+#define STORAGE_LAYOUT_SLOTS       0xff
+#define STORAGE_LAYOUT_GROUPED     'G'
+#define STORAGE_LAYOUT_CONVERTING  'C'
+
+// Wiegand-26 rules (see WIEGAND26_MAX_RULES).  A rule is its kind 
+// (WIEGAND26_RULE_*), facility, first user and last user (2 bytes each), 
+// most significant byte first.  Other kinds, including erased EEPROM, mark
+// free slots.
+#define WIEGAND26_RULE_ZONE_START  (STORAGE_LAYOUT_ADDR + 1)
+#define WIEGAND26_RULE_SIZE        6
+#define WIEGAND26_RULE_ZONE_END    (WIEGAND26_RULE_ZONE_START + (WIEGAND26_RULE_SIZE * WIEGAND26_MAX_RULES))
+#define WIEGAND26_RULE_ADDR(I)     (WIEGAND26_RULE_ZONE_START + (WIEGAND26_RULE_SIZE * (I)))
+
 // Add other storage zones here
 
+#define STORAGE_END                WIEGAND26_RULE_ZONE_END
+
 // Check that the last byte of the last zone will fit.
-#ifndef E2END
-# error E2END not defined for this architecture.
-#elif (WIEGAND_ZONE_END - 1) > E2END
-# error Not enough room on this chip for the configured EEPROM data.  Consider adjusting the storage limits.
+#if STORAGE_END > STORAGE_BACKEND_SIZE
+# error Not enough room in the storage backend for the configured EEPROM data.  Consider adjusting the storage limits or STORAGE_BACKEND.
+#endif
+
+#if WIEGAND26_MAX_FACILITIES < 1 || WIEGAND26_GROUPED_SLOTS < 1
+# error WIEGAND26_MAX_CREDS is too small for WIEGAND26_MAX_FACILITIES groups.
+#endif
+
+#if WIEGAND26_FILTER_BITS > 0 \
+  && ((WIEGAND26_FILTER_BITS & (WIEGAND26_FILTER_BITS - 1)) != 0 || WIEGAND26_FILTER_BITS < 8)
+# error WIEGAND26_FILTER_BITS must be 0 or a power of 2 no smaller than 8.
 #endif
 
-// Wiegand functions
+// Loads RAM state derived from EEPROM, converting the Wiegand-26 zone first
+// if it holds another layout than WIEGAND26_LAYOUT.  Call once from setup().
+// Whatever can't be read yet is loaded by the first function that needs it.
+void storage_init();
+
+// Wiegand functions.  Every function that reads or writes EEPROM fails when
+// a read or write does (see storage_backend_errors()), and a credential
+// that can't be read is never found.
 
 boolean storage_write_wiegand26_credential(int index, struct wiegand26_credential * c);
 boolean storage_read_wiegand26_credential(int index, struct wiegand26_credential * c);
 boolean storage_find_wiegand26_credential(struct wiegand26_credential * c);
 
-#endif
+// Store or remove a credential by value.  On success index is set to the slot
+// that holds (or held) the credential.  Adding a credential that is already
+// stored succeeds without writing.  Adding fails if the credential is
+// reserved or the table is full; removing fails if it is not stored.
+boolean storage_add_wiegand26_credential(struct wiegand26_credential * c, int * index);
+boolean storage_remove_wiegand26_credential(struct wiegand26_credential * c, int * index);
+
+// The Bloom filter that storage_find_wiegand26_credential() checks before
+// reading EEPROM.  Call storage_clear_wiegand26_filter() after setting every
+// slot empty.
+struct wiegand26_filter_stats {
+  // Bits set and total bits
+  uint16_t set_bits;
+  uint16_t bits;
+  // Credentials rejected by the filter alone
+  uint32_t rejected;
+  // Credentials that passed the filter but were not stored
+  uint32_t false_positives;
+};
+
+void storage_clear_wiegand26_filter();
+void storage_get_wiegand26_filter_stats(struct wiegand26_filter_stats * stats);
+// Rebuilds the filter from EEPROM if overwritten credentials left it stale
+// (see WIEGAND26_FILTER_REBUILD_MS).  Lookups only use the filter as it is.
+void storage_refresh_wiegand26_filter();
+
+// Wiegand-26 rules, which grant or deny every credential of a facility with
+// a user code from first_user to last_user.  storage_find_credential() 
+// checks them before the stored credentials: a matching deny rule denies 
+// even a stored credential, and a matching allow rule grants without 
+// reading EEPROM.  Reserved credentials match no rule.
+#define WIEGAND26_RULE_NONE        0
+#define WIEGAND26_RULE_ALLOW       1
+#define WIEGAND26_RULE_DENY        2
+
+struct wiegand26_rule {
+  byte kind;
+  byte facility;
+  uint16_t first_user;
+  uint16_t last_user;
+};
+
+// Index-based access to the WIEGAND26_MAX_RULES rule slots, like the 
+// credential functions.  Writing a rule of kind WIEGAND26_RULE_NONE frees 
+// the slot.  Writing fails if the index is too large or the rule is invalid
+// (an unknown kind or first_user > last_user).
+boolean storage_write_wiegand26_rule(int index, struct wiegand26_rule * r);
+boolean storage_read_wiegand26_rule(int index, struct wiegand26_rule * r);
+
+// Store or remove a rule by value, like the credential functions.  Adding 
+// fails if the rule is invalid or every slot holds a rule.
+boolean storage_add_wiegand26_rule(struct wiegand26_rule * r, int * index);
+boolean storage_remove_wiegand26_rule(struct wiegand26_rule * r, int * index);
+
+// WIEGAND26_RULE_DENY if a deny rule matches c, else WIEGAND26_RULE_ALLOW if
+// an allow rule does, else WIEGAND26_RULE_NONE.  Rules are kept in SRAM, so
+// this reads no EEPROM once they are loaded, and it returns
+// WIEGAND26_RULE_DENY while they can't be.
+byte storage_check_wiegand26_rules(struct wiegand26_credential * c);
 
+// Wear of a credential zone.  Each EEPROM byte is good for about 100,000 
+// writes, so writes / bytes is the average wear per byte.  Writes that would
+// store the value a byte already holds are skipped and not counted.
+struct storage_wear_stats {
+  uint32_t writes;
+  uint16_t bytes;
+};
+
+void storage_get_wear_stats(byte format, struct storage_wear_stats * stats);
+
+// Functions for credentials of any format.  They behave like the Wiegand-26
+// functions above, which they use for Wiegand-26 credentials.
+
+// The number of slots for the format, 0 if it is disabled.
+int storage_max_credentials(byte format);
+// True for values that mark free slots and can't be stored.
+boolean storage_credential_is_reserved(struct wiegand_credential * c);
+
+boolean storage_write_credential(int index, struct wiegand_credential * c);
+boolean storage_read_credential(byte format, int index, struct wiegand_credential * c);
+boolean storage_find_credential(struct wiegand_credential * c);
+boolean storage_add_credential(struct wiegand_credential * c, int * index);
+boolean storage_remove_credential(struct wiegand_credential * c, int * index);
+
+// Makes a slot empty unless it already is (all 0 or erased).  Returns true if
+// EEPROM was written.  Clearing a table this way only writes the slots in
+// use, and callers can spread it across loop iterations.  In the grouped
+// layout clearing slot 0 empties the table and other slots are left alone.
+boolean storage_clear_credential(byte format, int index);
+
+// Event log records.  storage_read_event() returns the number of the event
+// in a slot, 0 if it holds none or can't be read.  storage_write_event()
+// writes the bytes of a record that differ from what the slot holds,
+// starting at step *next_byte (0 for a new record) and stopping after
+// max_writes EEPROM writes or a failed one, so callers can spread a record
+// across loop iterations.  It advances *next_byte and returns true when the
+// record is complete.
+uint32_t storage_read_event(int slot, struct event_log_entry * e);
+boolean storage_write_event(int slot, uint32_t seq, struct event_log_entry * e,
+                            byte * next_byte, byte max_writes);
+
+#endif
@@ -0,0 +1,115 @@
+#include "storage_backend.h"
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+
+#include <Wire.h>
+
+// The Wire library moves at most BUFFER_LENGTH (32) bytes per transaction,
+// and a write spends 2 of them on the memory address.
+#define READ_BURST  BUFFER_LENGTH
+#define WRITE_BURST (BUFFER_LENGTH - 2)
+
+// The aligned READ_BURST bytes around the last byte read.  A lookup reads
+// a few bytes of one slot and a scan reads slots in order, so one bus
+// transaction serves many reads.  Writes keep it up to date.
+static byte cache[READ_BURST];
+static int cache_start;
+static boolean cache_valid = false;
+
+static uint16_t errors = 0;
+
+#define IN_CACHE(addr) (cache_valid && (addr) >= cache_start && (addr) < cache_start + READ_BURST)
+
+// Sends a memory address and any bytes to write after it.  The EEPROM
+// doesn't acknowledge its address while it finishes a write, so this retries
+// until it does (acknowledge polling) or STORAGE_24LC256_TIMEOUT_MS passes.
+static boolean send(int addr, const byte * buf, byte len) {
+  unsigned long start = millis();
+  do {
+    Wire.beginTransmission(STORAGE_24LC256_I2C_ADDRESS);
+    Wire.write((byte) (addr >> 8));
+    Wire.write((byte) addr);
+    Wire.write(buf, len);
+    if (Wire.endTransmission() == 0) {
+      return true;
+    }
+  } while (millis() - start < STORAGE_24LC256_TIMEOUT_MS);
+  return false;
+}
+
+// Returns false, leaving the cache empty, if the EEPROM doesn't send the
+// whole burst.
+static boolean fill_cache(int addr) {
+  cache_start = addr & ~(READ_BURST - 1);
+  cache_valid = false;
+  byte n = 0;
+  if (send(cache_start, NULL, 0)) {
+    Wire.requestFrom((uint8_t) STORAGE_24LC256_I2C_ADDRESS, (uint8_t) READ_BURST);
+    while (n < READ_BURST && Wire.available()) {
+      cache[n++] = Wire.read();
+    }
+  }
+  if (n < READ_BURST) {
+    errors++;
+    return false;
+  }
+  cache_valid = true;
+  return true;
+}
+
+void storage_backend_init() {
+  Wire.begin();
+  cache_valid = false;
+}
+
+int storage_backend_read_byte(int addr) {
+  if (!IN_CACHE(addr) && !fill_cache(addr)) {
+    return -1;
+  }
+  return cache[addr - cache_start];
+}
+
+boolean storage_backend_read(int addr, byte * buf, int len) {
+  for (int i = 0; i < len; i++) {
+    int b = storage_backend_read_byte(addr + i);
+    if (b < 0) {
+      return false;
+    }
+    buf[i] = b;
+  }
+  return true;
+}
+
+boolean storage_backend_write(int addr, const byte * buf, int len) {
+  while (len > 0) {
+    // One page write per burst, which may not cross a page boundary
+    int n = STORAGE_24LC256_PAGE_SIZE - (addr & (STORAGE_24LC256_PAGE_SIZE - 1));
+    if (n > WRITE_BURST) {
+      n = WRITE_BURST;
+    }
+    if (n > len) {
+      n = len;
+    }
+    if (!send(addr, buf, n)) {
+      // What the EEPROM holds now is unknown
+      cache_valid = false;
+      errors++;
+      return false;
+    }
+    for (int i = 0; i < n; i++) {
+      if (IN_CACHE(addr + i)) {
+        cache[addr + i - cache_start] = buf[i];
+      }
+    }
+    addr += n;
+    buf += n;
+    len -= n;
+  }
+  return true;
+}
+
+uint16_t storage_backend_errors() {
+  return errors;
+}
+
+#endif
@@ -0,0 +1,46 @@
+// The memory that storage.cpp keeps its zones in, chosen with STORAGE_BACKEND
+// in config.h.  Each backend is its own source file: storage_eeprom.cpp for
+// the internal EEPROM and storage_24lc256.cpp for an external I2C EEPROM.
+//
+
+#ifndef STORAGE_BACKEND_H
+#define STORAGE_BACKEND_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_INTERNAL
+# ifndef E2END
+#  error E2END not defined for this architecture.
+# endif
+# define STORAGE_BACKEND_SIZE (E2END + 1L)
+#elif STORAGE_BACKEND == STORAGE_BACKEND_24LC256
+# define STORAGE_BACKEND_SIZE 32768L
+// Writes may not cross a page boundary
+# define STORAGE_24LC256_PAGE_SIZE 64
+#else
+# error Unknown STORAGE_BACKEND.
+#endif
+
+// Call once from setup() before storage_init().
+void storage_backend_init();
+
+// Reads len bytes starting at addr.  Returns false if any of them can't be
+// read (the external EEPROM doesn't answer), and then buf holds nothing
+// useful: a failed read must never be taken for erased EEPROM.
+// storage_backend_read_byte() returns -1 for a byte it can't read.
+int storage_backend_read_byte(int addr);
+boolean storage_backend_read(int addr, byte * buf, int len);
+
+// Writes len bytes starting at addr.  Every byte is written, so callers skip
+// bytes that already hold their value to save time and wear.  Returns false
+// if any of them can't be written.
+boolean storage_backend_write(int addr, const byte * buf, int len);
+
+// The number of reads and writes that failed since startup.  Operations made
+// of many reads and writes compare it before and after to tell a failure
+// from their own reasons for giving up.
+uint16_t storage_backend_errors();
+
+#endif
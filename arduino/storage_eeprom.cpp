@@ -0,0 +1,33 @@
+#include "storage_backend.h"
+
+#if STORAGE_BACKEND == STORAGE_BACKEND_INTERNAL
+
+#include <EEPROM.h>
+
+void storage_backend_init() {
+}
+
+int storage_backend_read_byte(int addr) {
+  return EEPROM.read(addr);
+}
+
+boolean storage_backend_read(int addr, byte * buf, int len) {
+  for (int i = 0; i < len; i++) {
+    buf[i] = EEPROM.read(addr + i);
+  }
+  return true;
+}
+
+boolean storage_backend_write(int addr, const byte * buf, int len) {
+  for (int i = 0; i < len; i++) {
+    EEPROM.write(addr + i, buf[i]);
+  }
+  return true;
+}
+
+// The internal EEPROM always answers
+uint16_t storage_backend_errors() {
+  return 0;
+}
+
+#endif
@@ -0,0 +1,16 @@
+#include "tick.h"
+
+struct time tick_time;
+
+void tick_init() {
+  tick_time.era = 0;
+  tick_time.ms = millis();
+}
+
+void tick_update() {
+  uint32_t now = millis();
+  if (now < tick_time.ms) {
+    tick_time.era++;
+  }
+  tick_time.ms = now;
+}
@@ -0,0 +1,39 @@
+// The clock as of the start of the current loop iteration.  loop() reads
+// millis() once into a snapshot and the tasks read the snapshot, so every
+// task in an iteration sees the same time: a door's remaining time, the
+// panel's countdown and an event's timestamp agree, and none of them pays
+// for millis() turning interrupts off and on to copy its counter.
+//
+// Interrupt handlers and code that waits on hardware within a task read
+// millis() themselves, as the snapshot doesn't move during an iteration.
+//
+
+#ifndef TICK_H
+#define TICK_H
+
+#include <Arduino.h>
+
+#include "time.h"
+
+// Read it with the functions below
+extern struct time tick_time;
+
+// Starts the era count.  Call first thing in setup().
+void tick_init();
+
+// Takes the snapshot, counting a new era when millis() has rolled over since
+// the last one.  Call at the start of each loop iteration, at least once
+// every 49.7 days.
+void tick_update();
+
+// millis() as of the snapshot
+inline uint32_t tick_millis() {
+  return tick_time.ms;
+}
+
+// The snapshot with its era
+inline void tick_get_time(struct time * t) {
+  *t = tick_time;
+}
+
+#endif
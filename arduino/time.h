@@ -1,6 +1,14 @@
 #ifndef TIME_H
 #define TIME_H
 
+// A time that outlasts system millis, which roll over every 2^32 ms (49.7
+// days).  era counts the rollovers, so a time runs for 256 eras, about 34.8
+// years.  Make era a uint16_t for about 8919.6 years.
+struct time {
+  uint8_t era;
+  uint32_t ms;
+};
+
 // An interval of system millis.  The interval can be used as an open, closed
 // or half-open interval.
 //
@@ -38,4 +46,4 @@ inline uint32_t open_closed_interval_remaining(struct interval * i, uint32_t t)
   }
 }
 
-#endif TIME_H
+#endif
@@ -0,0 +1,129 @@
+#include "tx_queue.h"
+
+TxStream tx_protocol(TX_BLOCK);
+TxStream tx_debug(TX_DROP);
+
+// Output from both streams, oldest at tail
+static uint8_t queue[TX_QUEUE_SIZE];
+static uint16_t head = 0;
+static uint16_t tail = 0;
+
+static uint16_t max_queued = 0;
+static uint32_t dropped = 0;
+
+// The TX_DROP stream is dropping the rest of a line, and part of its current
+// line was queued
+static boolean dropping = false;
+static boolean line_started = false;
+
+#define QUEUE_INDEX(i) ((i) & (TX_QUEUE_SIZE - 1))
+
+static inline uint16_t queued() {
+  return head - tail;
+}
+
+static inline uint16_t queue_room() {
+  return TX_QUEUE_SIZE - queued();
+}
+
+static void enqueue(const uint8_t * buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    queue[QUEUE_INDEX(head++)] = buffer[i];
+  }
+  if (queued() > max_queued) {
+    max_queued = queued();
+  }
+}
+
+void tx_queue_init() {
+  head = 0;
+  tail = 0;
+  max_queued = 0;
+  dropped = 0;
+  dropping = false;
+  line_started = false;
+}
+
+void tx_queue_loop() {
+  int room;
+  while (queued() > 0 && (room = Serial.availableForWrite()) > 0) {
+    // Up to the end of the queue array or the room, whichever is less
+    uint16_t n = TX_QUEUE_SIZE - QUEUE_INDEX(tail);
+    if (n > queued()) {
+      n = queued();
+    }
+    if (n > room) {
+      n = room;
+    }
+    Serial.write(&queue[QUEUE_INDEX(tail)], n);
+    tail += n;
+  }
+}
+
+// Sends the oldest byte, waiting for the UART if its buffer is full.
+static void send_oldest() {
+  Serial.write(queue[QUEUE_INDEX(tail)]);
+  tail++;
+}
+
+void tx_queue_flush() {
+  while (queued() > 0) {
+    send_oldest();
+  }
+}
+
+size_t TxStream::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t TxStream::write(const uint8_t * buffer, size_t size) {
+  tx_queue_loop();
+
+  if (policy == TX_DROP) {
+    boolean ends_line = size > 0 && buffer[size - 1] == '\n';
+    byte prefix = line_started ? 0 : sizeof(TX_DEBUG_PREFIX) - 1;
+    // Leave room to end the line if the rest of it gets dropped
+    if (!dropping && prefix + size + (ends_line ? 0 : 2) > queue_room()) {
+      dropping = true;
+    }
+    if (dropping) {
+      dropped += size;
+      if (ends_line) {
+        dropping = false;
+        if (line_started) {
+          // End the partial line so the next line starts clean.  Only
+          // output from the other stream can have taken the room left for
+          // this.
+          line_started = false;
+          while (queue_room() < 2) {
+            send_oldest();
+          }
+          enqueue((const uint8_t *) "\r\n", 2);
+        }
+      }
+      return size;
+    }
+    enqueue((const uint8_t *) TX_DEBUG_PREFIX, prefix);
+    line_started = !ends_line;
+    enqueue(buffer, size);
+    return size;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    if (queue_room() == 0) {
+      send_oldest();
+    }
+    enqueue(&buffer[i], 1);
+  }
+  return size;
+}
+
+uint16_t tx_queue_room() {
+  return queue_room();
+}
+
+void tx_queue_get_stats(struct tx_queue_stats * stats) {
+  stats->queued = queued();
+  stats->max_queued = max_queued;
+  stats->dropped = dropped;
+}
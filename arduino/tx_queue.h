@@ -0,0 +1,66 @@
+// Queues serial output in SRAM so printing doesn't wait for the UART.
+//
+
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include <Arduino.h>
+
+#include "config.h"
+
+#if (TX_QUEUE_SIZE & (TX_QUEUE_SIZE - 1)) != 0 || TX_QUEUE_SIZE < 8 || TX_QUEUE_SIZE > 32768
+# error TX_QUEUE_SIZE must be a power of 2 from 8 to 32768.
+#endif
+
+// What to do with output that doesn't fit in the queue.
+//
+// TX_BLOCK waits for the UART to make room, so nothing is lost.  Use it for
+// CLI responses and events, which hosts depend on.
+//
+// TX_DROP drops the output and the rest of its line, and counts the dropped
+// bytes.  A line cut short still ends with a newline.  Use it for debug 
+// traces.  Its lines start with TX_DEBUG_PREFIX, so hosts can tell them from
+// CLI responses and events.
+#define TX_BLOCK 0
+#define TX_DROP  1
+
+#define TX_DEBUG_PREFIX "# "
+
+// Prints to the queue with a policy for when it's full.  Output of both
+// streams goes out in the order it was printed.
+class TxStream : public Print {
+public:
+  TxStream(byte policy) : policy(policy) {}
+  virtual size_t write(uint8_t c);
+  virtual size_t write(const uint8_t * buffer, size_t size);
+  using Print::write;
+
+private:
+  byte policy;
+};
+
+// CLI responses and events
+extern TxStream tx_protocol;
+// The P and PL debug macros
+extern TxStream tx_debug;
+
+void tx_queue_init();
+// Moves queued output to Serial's transmit buffer as it has room.  Call
+// every loop iteration.
+void tx_queue_loop();
+// Sends everything queued, waiting for the UART.
+void tx_queue_flush();
+// Bytes that can be queued without waiting or dropping.
+uint16_t tx_queue_room();
+
+struct tx_queue_stats {
+  // Bytes waiting now, and the most that have waited
+  uint16_t queued;
+  uint16_t max_queued;
+  // Bytes dropped by TX_DROP streams
+  uint32_t dropped;
+};
+
+void tx_queue_get_stats(struct tx_queue_stats * stats);
+
+#endif
@@ -1,22 +1,23 @@
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <util/atomic.h>
 
 #include "wiegand.h"
 #include "dorbo_utils.h"
+#include "stats.h"
+#include "tick.h"
 
+// Frame assembly state, written by the reader's ISRs.  The main loop may
+// touch it only in an ATOMIC_BLOCK().
 struct wiegand_reader {
-  // DATA0 and DATA 1 pins for the ISR to poll
-  byte data_pins[2];
-  
-  // DATA0 and DATA1 values as of the last interrupt.
-  // Accessed only in ISRs so does not require an atomic block
-  volatile byte previous_pin_values[2];
-  
-  // The following volatile fields must be accessed in an ATOMIC_BLOCK()
-  
   // Number of bits read
   volatile byte           count;
-  // Value (bits read are pushed on the right)
+  // Value (bits read are pushed on the right).  Bits shifted out of the top
+  // of bits go into bits_high, which is cheaper in an ISR than a uint64_t.
   volatile uint32_t       bits;
+  volatile byte           bits_high;
+  // Parity accumulators, see WIEGAND_MAX_PARITY_CHECKS
+  volatile uint16_t       parity;
   // Millis of the last bits change (rollover-safe)
   volatile unsigned long  last_changed;
 };
@@ -25,106 +26,548 @@ static byte wiegand_reader_pins[NUM_WIEGAND_READERS][2] = WIEGAND_READER_PINS;
 
 static struct wiegand_reader wiegand_readers[NUM_WIEGAND_READERS];
 
-boolean wiegand_reader_get_wiegand26(byte reader_num, struct wiegand26_credential * cred) {
-  struct wiegand_reader * reader = &wiegand_readers[reader_num];
+// Input register (PINx) and bit mask of each reader's DATA0 and DATA1 pins.
+// Looked up once by wiegand_readers_init() so the ISRs can read their pin
+// without going through digitalRead().
+static volatile uint8_t * data_pin_registers[NUM_WIEGAND_READERS][2];
+static uint8_t data_pin_masks[NUM_WIEGAND_READERS][2];
+
+//////////////////////////////////////////////////////////////////////////////
+// Frame Queue
+//////////////////////////////////////////////////////////////////////////////
 
-  // Check if we have a complete credential
-  byte count;
-  uint32_t bits;
+#if WIEGAND_FRAME_QUEUE_SIZE < 1 || WIEGAND_FRAME_QUEUE_SIZE > 128 \
+  || (WIEGAND_FRAME_QUEUE_SIZE & (WIEGAND_FRAME_QUEUE_SIZE - 1)) != 0
+# error WIEGAND_FRAME_QUEUE_SIZE must be a power of 2 no larger than 128.
+#endif
+
+// Single-producer, single-consumer ring buffer.  The reader ISRs are the only
+// producer (AVR ISRs don't nest, so they never push concurrently, and the
+// main loop pushes idle frames only with interrupts disabled) and the main
+// loop is the only consumer.  Only the producer writes head and only
+// the consumer writes tail.  Both are free-running bytes, so head - tail is
+// the number of frames waiting, and single-byte reads and writes are atomic
+// on the AVR.
+static struct wiegand_frame frame_queue[WIEGAND_FRAME_QUEUE_SIZE];
+static volatile byte frame_queue_head = 0;
+static volatile byte frame_queue_tail = 0;
+static volatile uint16_t frame_queue_overflows = 0;
+
+#define FRAME_QUEUE_SLOT(i) (&frame_queue[(i) & (WIEGAND_FRAME_QUEUE_SIZE - 1)])
+
+// Call only from ISRs or with interrupts disabled.
+static inline void push_frame(byte reader_num, struct wiegand_reader * reader) {
+  byte head = frame_queue_head;
+  if ((byte) (head - frame_queue_tail) == WIEGAND_FRAME_QUEUE_SIZE) {
+    frame_queue_overflows++;
+    return;
+  }
+  struct wiegand_frame * frame = FRAME_QUEUE_SLOT(head);
+  frame->captured = reader->last_changed;
+  frame->bits = reader->bits;
+  frame->bits_high = reader->bits_high;
+  frame->count = reader->count;
+  frame->reader_num = reader_num;
+  frame->parity = reader->parity;
+  // Publish the frame only after it is written
+  COMPILER_BARRIER();
+  frame_queue_head = head + 1;
+}
+
+boolean wiegand_next_frame(struct wiegand_frame * frame) {
+  byte tail = frame_queue_tail;
+  if (tail == frame_queue_head) {
+    return false;
+  }
+  COMPILER_BARRIER();
+  *frame = *FRAME_QUEUE_SLOT(tail);
+  // Release the slot only after it is copied
+  COMPILER_BARRIER();
+  frame_queue_tail = tail + 1;
+  return true;
+}
+
+byte wiegand_frames_waiting() {
+  return frame_queue_head - frame_queue_tail;
+}
+
+uint16_t wiegand_frame_overflows() {
+  uint16_t overflows;
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    count = reader->count;
-    bits = reader->bits;
+    overflows = frame_queue_overflows;
   }
+  return overflows;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Formats and Decoding
+//////////////////////////////////////////////////////////////////////////////
 
-  if (count < 26) {
+// Mask of bits first through last of a frame, numbered from 1 in the order
+// they arrive.
+#define FRAME_BITS(len, first, last) \
+  ((((uint64_t) 1 << ((last) - (first) + 1)) - 1) << ((len) - (last)))
+
+// Indexed by WIEGAND_FORMAT_*.  Kept in flash; disabled formats are still
+// listed so the indexes stay fixed.
+static const struct wiegand_format formats[WIEGAND_NUM_FORMATS] PROGMEM = {
+  // H10301: even parity over bits 1-13, odd parity over bits 14-26
+  { 26, 17, 8, 1, 16, 2, {
+    { FRAME_BITS(26, 1, 13), 0 },
+    { FRAME_BITS(26, 14, 26), 1 } } },
+  // H10306: even parity over bits 1-17, odd parity over bits 18-34
+  { 34, 17, 16, 1, 16, 2, {
+    { FRAME_BITS(34, 1, 17), 0 },
+    { FRAME_BITS(34, 18, 34), 1 } } },
+  // Corporate 1000: even parity over bit 2 and bits 3-4, 6-7, ... 33-34;
+  // odd parity over bits 2-3, 5-6, ... 32-33 and bit 35; odd parity over all
+  // bits
+  { 35, 21, 12, 1, 20, 3, {
+    { 0x3b6db6db6ULL, 0 },
+    { 0x36db6db6dULL, 1 },
+    { FRAME_BITS(35, 1, 35), 1 } } },
+  // H10304: even parity over bits 1-19, odd parity over bits 19-37
+  { 37, 20, 16, 1, 19, 2, {
+    { FRAME_BITS(37, 1, 19), 0 },
+    { FRAME_BITS(37, 19, 37), 1 } } },
+};
+
+boolean wiegand_get_format(byte format, struct wiegand_format * f) {
+  if (format >= WIEGAND_NUM_FORMATS || !WIEGAND_FORMAT_ENABLED(format)) {
     return false;
   }
+  memcpy_P(f, &formats[format], sizeof(*f));
+  return true;
+}
+
+#if WIEGAND_NUM_FORMATS * WIEGAND_MAX_PARITY_CHECKS > 16
+# error Too many parity checks for the uint16_t parity accumulators.
+#endif
 
-  // Check for odd parity in the lower 13 bits and even parity in the upper 13 bits.
-  boolean success = false;
-  if ((__builtin_popcount(bits & 0x1fff) % 2) == 1
-    && (__builtin_popcount((bits >> 13) & 0x1fff) % 2) == 0) {
-    bits >>= 1;
-    cred->user = bits & 0xffff;
-    bits >>= 16;
-    cred->facility = bits & 0xff;
-    success = true;
+// The accumulators to toggle when a 1 bit arrives at each position (counted
+// from 1) of a frame.  Built from the format table by build_parity_tables().
+static uint16_t parity_toggles[WIEGAND_MAX_FRAME_BITS + 1];
+
+// For each format, the accumulators of its checks and the values they must
+// hold for a valid frame.
+static uint16_t parity_checks[WIEGAND_NUM_FORMATS];
+static uint16_t parity_expected[WIEGAND_NUM_FORMATS];
+
+static void build_parity_tables() {
+  memset(parity_toggles, 0, sizeof(parity_toggles));
+  memset(parity_checks, 0, sizeof(parity_checks));
+  memset(parity_expected, 0, sizeof(parity_expected));
+
+  struct wiegand_format f;
+  for (byte format = 0; format < WIEGAND_NUM_FORMATS; format++) {
+    if (!wiegand_get_format(format, &f)) {
+      continue;
+    }
+    for (byte i = 0; i < f.num_parity_checks; i++) {
+      uint16_t accumulator = 1 << (format * WIEGAND_MAX_PARITY_CHECKS + i);
+      parity_checks[format] |= accumulator;
+      if (f.parity[i].odd) {
+        parity_expected[format] |= accumulator;
+      }
+      for (byte n = 1; n <= f.bits; n++) {
+        if ((f.parity[i].mask >> (f.bits - n)) & 1) {
+          parity_toggles[n] |= accumulator;
+        }
+      }
+    }
   }
-  
-  // Reset for next time.
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-    reader->count = 0;
-    reader->bits = 0;
-    reader->last_changed = millis();
+}
+
+boolean wiegand_frame_decode(struct wiegand_frame * frame, struct wiegand_credential * cred) {
+  struct wiegand_format f;
+  byte format;
+  for (format = 0; format < WIEGAND_NUM_FORMATS; format++) {
+    if (pgm_read_byte(&formats[format].bits) == frame->count
+      && wiegand_get_format(format, &f)) {
+      break;
+    }
+  }
+  if (format == WIEGAND_NUM_FORMATS) {
+    // Frames ending at WIEGAND_MAX_FRAME_BITS always match, so the idle
+    // timeout cut this one off
+    STATS_COUNT(STATS_INPUT_TIMEOUTS);
+    return false;
+  }
+
+  // The ISR already worked out the parity
+  if ((frame->parity & parity_checks[format]) != parity_expected[format]) {
+    STATS_COUNT(STATS_PARITY_FAILURES);
+    return false;
+  }
+
+  uint64_t bits = ((uint64_t) frame->bits_high << 32) | frame->bits;
+
+  cred->format = format;
+  cred->facility = (bits >> f.facility_shift) & ((1UL << f.facility_bits) - 1);
+  cred->user = (bits >> f.user_shift) & ((1UL << f.user_bits) - 1);
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Capture
+//////////////////////////////////////////////////////////////////////////////
+
+// Queues the reader's frame if it is long enough to be a credential and
+// resets the reader.  Call only from ISRs or with interrupts disabled.
+static inline void close_frame(byte reader_num, struct wiegand_reader * reader) {
+  if (reader->count >= WIEGAND_MIN_FRAME_BITS) {
+    push_frame(reader_num, reader);
+  } else if (reader->count > 0) {
+    STATS_COUNT(STATS_INPUT_TIMEOUTS);
+  }
+  reader->count = 0;
+  reader->bits = 0;
+  reader->bits_high = 0;
+  reader->parity = 0;
+}
+
+// Adds one bit to a reader's frame.  now is the millis() when the bit
+// arrived.  Call only from ISRs.
+static inline void add_bit(byte reader_num, byte bit, unsigned long now) {
+  struct wiegand_reader * reader = &wiegand_readers[reader_num];
+
+  // A bit after the lines were idle starts a new frame.  The main loop
+  // normally closes idle frames first, but it may not have run yet.
+  //
+  // Subtract to yield a signed difference, which will contain the correct
+  // delta even if the system millis rolled over (so long as the delta is 
+  // less than (2^32)/2 milliseconds).
+  if (reader->count > 0
+    && (long) (now - reader->last_changed) > WIEGAND_INPUT_TIMEOUT_MS) {
+    close_frame(reader_num, reader);
+  }
+
+  reader->count += 1;
+  reader->bits_high = (reader->bits_high << 1) | (byte) (reader->bits >> 31);
+  reader->bits = (reader->bits << 1) | bit;
+  if (bit) {
+    reader->parity ^= parity_toggles[reader->count];
+  }
+  reader->last_changed = now;
+
+  // Nothing longer can be decoded, so hand the frame to the main loop and
+  // start over right away.
+  if (reader->count == WIEGAND_MAX_FRAME_BITS) {
+    close_frame(reader_num, reader);
   }
-  
-  return success; 
 }
 
+#if NUM_WIEGAND_READERS > 8
+# error NUM_WIEGAND_READERS must be at most 8.
+#endif
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_EXTERNAL
+
 // Typical Wiegand pulse period is 1 millisecond (with a pulse width of 
 // 50 microseconds).  The ISR must complete before the next pulse comes.
-void handle_interrupt() {
+//
+// There is one ISR per data line, instantiated for each reader and bit value
+// so the reader and bit are constants and the ISR only touches its own
+// reader.  The interrupt fires on the falling edge, so no edge bookkeeping is
+// needed; the ISR just confirms the line is still LOW to ignore glitches
+// shorter than the interrupt latency.
+template <byte reader_num, byte bit>
+static void handle_data_interrupt() {
+  if (*data_pin_registers[reader_num][bit] & data_pin_masks[reader_num][bit]) {
+    return;
+  }
+
+  STATS_START(started);
+  add_bit(reader_num, bit, millis());
+  STATS_RECORD(STATS_ISR_DURATION, micros() - started);
+}
+
+#define WIEGAND_READER_ISRS(R) { handle_data_interrupt<R, 0>, handle_data_interrupt<R, 1> }
+
+static void (* const wiegand_reader_isrs[NUM_WIEGAND_READERS][2])(void) = {
+  WIEGAND_READER_ISRS(0),
+#if NUM_WIEGAND_READERS > 1
+  WIEGAND_READER_ISRS(1),
+#endif
+#if NUM_WIEGAND_READERS > 2
+  WIEGAND_READER_ISRS(2),
+#endif
+#if NUM_WIEGAND_READERS > 3
+  WIEGAND_READER_ISRS(3),
+#endif
+#if NUM_WIEGAND_READERS > 4
+  WIEGAND_READER_ISRS(4),
+#endif
+#if NUM_WIEGAND_READERS > 5
+  WIEGAND_READER_ISRS(5),
+#endif
+#if NUM_WIEGAND_READERS > 6
+  WIEGAND_READER_ISRS(6),
+#endif
+#if NUM_WIEGAND_READERS > 7
+  WIEGAND_READER_ISRS(7),
+#endif
+};
+
+static void attach_data_pin(byte reader_num, byte bit, byte pin) {
+  attachInterrupt(digitalPinToInterrupt(pin), wiegand_reader_isrs[reader_num][bit], FALLING);
+}
+
+// External interrupts are enabled as they are attached
+static void enable_data_interrupts() {
+}
+
+#elif WIEGAND_CAPTURE == WIEGAND_CAPTURE_PCINT || WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+
+// The data lines on one port
+struct port_lines {
+  // The port's input register, and the bits of it that are data lines
+  volatile uint8_t * input;
+  uint8_t lines;
+  // The port as it was last read
+  uint8_t last;
+  // For each port bit, reader_num * 2 + bit of its data line
+  byte line_bits[8];
+};
+
+static void add_port_line(struct port_lines * port, byte reader_num, byte bit, byte pin) {
+  uint8_t mask = digitalPinToBitMask(pin);
+  port->input = portInputRegister(digitalPinToPort(pin));
+  port->lines |= mask;
+  for (byte i = 0; i < 8; i++) {
+    if (mask == (1 << i)) {
+      port->line_bits[i] = reader_num * 2 + bit;
+    }
+  }
+}
+
+// Reads the port and adds a bit for each data line that fell since the last
+// reading, that is, was HIGH then and is LOW now.  Glitches that come and go
+// between readings, rising edges and the port's other pins add nothing.
+// Returns false if no line fell.  Call only from ISRs.
+static inline boolean read_port_lines(struct port_lines * port) {
+  uint8_t levels = *port->input;
+  uint8_t fell = port->last & ~levels & port->lines;
+  port->last = levels;
+  if (fell == 0) {
+    return false;
+  }
+
+  unsigned long now = millis();
+  for (byte i = 0; fell != 0; i++, fell >>= 1) {
+    if (fell & 1) {
+      byte line = port->line_bits[i];
+      add_bit(line >> 1, line & 1, now);
+    }
+  }
+  return true;
+}
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_PCINT
+
+// PCINT0_vect to PCINT2_vect
+#define PCINT_BANKS 3
+
+static struct port_lines pcint_banks[PCINT_BANKS];
+
+// One vector per bank handles both edges of every data line on it, so all
+// the readers of a bank share it.
+template <byte bank_num>
+static inline void handle_pin_change() {
+  STATS_START(started);
+  if (read_port_lines(&pcint_banks[bank_num])) {
+    STATS_RECORD(STATS_ISR_DURATION, micros() - started);
+  }
+}
+
+ISR(PCINT0_vect) {
+  handle_pin_change<0>();
+}
+
+ISR(PCINT1_vect) {
+  handle_pin_change<1>();
+}
+
+ISR(PCINT2_vect) {
+  handle_pin_change<2>();
+}
+
+static void attach_data_pin(byte reader_num, byte bit, byte pin) {
+  add_port_line(&pcint_banks[digitalPinToPCICRbit(pin)], reader_num, bit, pin);
+  *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+}
+
+// Starts each bank with data lines from the port's current levels.
+static void enable_data_interrupts() {
+  for (byte i = 0; i < PCINT_BANKS; i++) {
+    struct port_lines * bank = &pcint_banks[i];
+    if (bank->lines != 0) {
+      bank->last = *bank->input;
+      PCIFR = _BV(i);
+      PCICR |= _BV(i);
+    }
+  }
+}
+
+#else
+
+// Timer 2 counts at F_CPU / 8, 2 counts per microsecond at 16 MHz
+#define SAMPLE_TICKS_PER_US (F_CPU / 8000000UL)
+#define SAMPLE_TICKS (WIEGAND_SAMPLE_US * SAMPLE_TICKS_PER_US)
+
+#if SAMPLE_TICKS < 1 || SAMPLE_TICKS > 256
+# error WIEGAND_SAMPLE_US is out of range for Timer 2.
+#endif
+
+// Samples per duty cycle measurement
+#define SAMPLE_WINDOW 4096
+
+// Ports with data lines, in the order they are sampled
+static struct port_lines sampled_ports[NUM_WIEGAND_READERS * 2];
+static byte num_sampled_ports;
+
+// Timer counts spent sampling in the current window, and samples taken in it
+static uint32_t window_ticks;
+static uint16_t window_samples;
+
+// Counts spent in the last complete window and the busiest one, and the
+// most spent on one sample
+static volatile uint32_t last_window_ticks;
+static volatile uint32_t peak_window_ticks;
+static volatile uint8_t peak_sample_ticks;
+
+// Every sample reads each port with data lines once, and the only other
+// work is a bit for each line that fell, which a line can do at most every
+// other sample.  So the cost is bounded by the ports and lines, however
+// much noise is on them.
+ISR(TIMER2_COMPA_vect) {
+  for (byte i = 0; i < num_sampled_ports; i++) {
+    read_port_lines(&sampled_ports[i]);
+  }
+
+  // The timer restarted from 0 at the compare match, so it holds the counts
+  // spent on this sample, including the interrupt latency but not the
+  // return.
+  uint8_t ticks = TCNT2;
+  if (ticks > peak_sample_ticks) {
+    peak_sample_ticks = ticks;
+  }
+  window_ticks += ticks;
+  if (++window_samples == SAMPLE_WINDOW) {
+    last_window_ticks = window_ticks;
+    if (window_ticks > peak_window_ticks) {
+      peak_window_ticks = window_ticks;
+    }
+    window_ticks = 0;
+    window_samples = 0;
+  }
+}
+
+static void attach_data_pin(byte reader_num, byte bit, byte pin) {
+  volatile uint8_t * input = portInputRegister(digitalPinToPort(pin));
+  byte i = 0;
+  while (i < num_sampled_ports && sampled_ports[i].input != input) {
+    i++;
+  }
+  if (i == num_sampled_ports) {
+    num_sampled_ports++;
+  }
+  add_port_line(&sampled_ports[i], reader_num, bit, pin);
+}
+
+// Starts from the ports' current levels and starts the timer.
+static void enable_data_interrupts() {
+  for (byte i = 0; i < num_sampled_ports; i++) {
+    sampled_ports[i].last = *sampled_ports[i].input;
+  }
+  // CTC mode at F_CPU / 8, interrupting every SAMPLE_TICKS counts
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS21);
+  OCR2A = SAMPLE_TICKS - 1;
+  TCNT2 = 0;
+  TIFR2 = _BV(OCF2A);
+  TIMSK2 = _BV(OCIE2A);
+}
+
+// Windowed counts as hundredths of a percent of the window's time
+static uint16_t window_duty(uint32_t ticks) {
+  return (uint64_t) ticks * 10000 / ((uint32_t) SAMPLE_WINDOW * SAMPLE_TICKS);
+}
+
+void wiegand_get_sample_stats(struct wiegand_sample_stats * stats) {
+  uint32_t last;
+  uint32_t peak;
+  uint8_t sample;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    last = last_window_ticks;
+    peak = peak_window_ticks;
+    sample = peak_sample_ticks;
+  }
+  stats->duty = window_duty(last);
+  stats->peak_duty = window_duty(peak);
+  stats->peak_sample_ns = (uint32_t) sample * 1000 / SAMPLE_TICKS_PER_US;
+}
+
+void wiegand_reset_sample_stats() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    peak_window_ticks = 0;
+    peak_sample_ticks = 0;
+  }
+}
+
+#endif
+
+#else
+# error Unknown WIEGAND_CAPTURE.
+#endif
+
+void wiegand_readers_loop(void) {
   for (byte i = 0; i < NUM_WIEGAND_READERS; i++) {
     struct wiegand_reader * reader = &wiegand_readers[i];
-
-    // If we don't have a 26-bit credential ready, check for changes on the "zero" and "one" 
-    // data pins.  The initial "count" lets us avoid increasing count beyond 26, which means 
-    // the value remains in the struct until the application code can read it out (or until 
-    // an interrupt after the input timeout clears it out and starts over).
-    //
-    // Wiegand readers should not normally send us data faster than our application can
-    // process it, but noisy transmission lines may cause random bits to trickle in.
-    
-    // Throw away incomplete credential data if it's been too long since the last 
-    // bit was read.  This prevents noise in the lines from spoiling the next read.
-    if (reader->count > 0 && reader->count < 26) {
-      // Subtract to yield a signed difference, which will contain the correct
-      // delta even if the system millis rolled over (so long as the delta is 
-      // less than (2^32)/2 milliseconds).
-      if ((long) (millis() - reader->last_changed) > WIEGAND_INPUT_TIMEOUT_MS) {
-        reader->count = 0;
-        reader->bits = 0;
-        reader->last_changed = millis();
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (reader->count > 0
+        && (long) (tick_millis() - reader->last_changed) > WIEGAND_INPUT_TIMEOUT_MS) {
+        close_frame(i, reader);
       }
     }
-      
-    // When the "zero" pin changes to LOW the device is sending us a 0
-    byte zero_pin_value = digitalRead(reader->data_pins[0]);
-    if (reader->count < 26 && zero_pin_value == LOW && reader->previous_pin_values[0] == HIGH) {
-      // Shift in a 0
-      reader->count += 1;
-      reader->bits <<= 1;
-      reader->last_changed = millis();
-    }
-    reader->previous_pin_values[0] = zero_pin_value;
-    
-    // When the "one" pin changes to LOW the device is sending us a 1
-    byte one_pin_value = digitalRead(reader->data_pins[1]);
-    if (reader->count < 26 && one_pin_value == LOW && reader->previous_pin_values[1] == HIGH) {
-      // Shift and add a 1
-      reader->count += 1;
-      reader->bits <<= 1;
-      reader->bits |= 1;
-      reader->last_changed = millis();
-    }  
-    reader->previous_pin_values[1] = one_pin_value;
   }
 }
 
 void wiegand_readers_init(void) {
+  build_parity_tables();
+
+  frame_queue_head = 0;
+  frame_queue_tail = 0;
+  frame_queue_overflows = 0;
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_PCINT
+  memset(pcint_banks, 0, sizeof(pcint_banks));
+#elif WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+  memset(sampled_ports, 0, sizeof(sampled_ports));
+  num_sampled_ports = 0;
+  window_ticks = 0;
+  window_samples = 0;
+  last_window_ticks = 0;
+  peak_window_ticks = 0;
+  peak_sample_ticks = 0;
+#endif
+
   for (byte i = 0; i < NUM_WIEGAND_READERS; i++) {
     struct wiegand_reader * reader = &wiegand_readers[i];
     
     // Initialize all fields
     reader->count = 0;
     reader->bits = 0;
+    reader->bits_high = 0;
+    reader->parity = 0;
     reader->last_changed = millis();
     
     // DATA0 and DATA1 fields
     for (int j = 0; j < 2; j++) {
       // Define the data pin as an input and enable the internal pull-up resistors.
-      reader->data_pins[j] = wiegand_reader_pins[i][j];
-      pinMode(reader->data_pins[j], INPUT_PULLUP);
+      byte pin = wiegand_reader_pins[i][j];
+      pinMode(pin, INPUT_PULLUP);
+      data_pin_registers[i][j] = portInputRegister(digitalPinToPort(pin));
+      data_pin_masks[i][j] = digitalPinToBitMask(pin);
   
       // The idle state of the Wiegand data lines is HIGH (+5 volts), and the reader 
       // pulls the line LOW to signal 1 bit of credential data.  With the internal 
@@ -133,13 +576,9 @@ void wiegand_readers_init(void) {
       // pins read LOW when the reader is signaling data (the reader closes the circuit
       // and allows current to flow to ground through the pin).
       //
-      // Initialize the previous port pins to the "idle reader" state, which is each
-      // pin HIGH, so we can correctly detect the first credential read.
-      reader->previous_pin_values[j] = HIGH;
-  
-      // Attach the declared interrupt to the generic handler
-      attachInterrupt(digitalPinToInterrupt(wiegand_reader_pins[i][j]), handle_interrupt, CHANGE);
+      // Each falling edge is one bit.
+      attach_data_pin(i, j, pin);
     }
   }
+  enable_data_interrupts();
 }
-
@@ -9,13 +9,151 @@
 #include "config.h"
 #include "dorbo_utils.h"
 
+//////////////////////////////////////////////////////////////////////////////
+// Wiegand Formats
+//////////////////////////////////////////////////////////////////////////////
+
+// Supported formats.  The values index the format table in wiegand.cpp.
+//
+// WIEGAND_FORMAT_26  HID H10301: 8-bit facility, 16-bit user
+// WIEGAND_FORMAT_34  HID H10306: 16-bit facility, 16-bit user
+// WIEGAND_FORMAT_35  HID Corporate 1000: 12-bit company (facility), 20-bit card (user)
+// WIEGAND_FORMAT_37  HID H10304: 16-bit facility, 19-bit user
+#define WIEGAND_FORMAT_26   0
+#define WIEGAND_FORMAT_34   1
+#define WIEGAND_FORMAT_35   2
+#define WIEGAND_FORMAT_37   3
+#define WIEGAND_NUM_FORMATS 4
+
+// A format is enabled when config.h gives it storage.  Wiegand-26 is always
+// enabled.
+#define WIEGAND_FORMAT_ENABLED(f) \
+  ((f) == WIEGAND_FORMAT_26 \
+  || ((f) == WIEGAND_FORMAT_34 && WIEGAND34_MAX_CREDS > 0) \
+  || ((f) == WIEGAND_FORMAT_35 && WIEGAND35_MAX_CREDS > 0) \
+  || ((f) == WIEGAND_FORMAT_37 && WIEGAND37_MAX_CREDS > 0))
+
+// The longest enabled frame.  The ISRs accept up to this many bits.
+#if WIEGAND37_MAX_CREDS > 0
+# define WIEGAND_MAX_FRAME_BITS 37
+#elif WIEGAND35_MAX_CREDS > 0
+# define WIEGAND_MAX_FRAME_BITS 35
+#elif WIEGAND34_MAX_CREDS > 0
+# define WIEGAND_MAX_FRAME_BITS 34
+#else
+# define WIEGAND_MAX_FRAME_BITS 26
+#endif
+
+// Shorter frames are noise and are discarded without being queued.
+#define WIEGAND_MIN_FRAME_BITS 26
+
+// Frames are decoded by checking their parity with a mask per parity bit:
+// the number of 1 bits in (frame & mask) must be odd or even as required.
+// Each mask includes its parity bit.
+//
+// The ISRs keep the parity of every check of every enabled format as bits
+// arrive, one accumulator bit each, so decoding doesn't count bits.
+// Accumulator bit (format * WIEGAND_MAX_PARITY_CHECKS + check) is 1 when an
+// odd number of the frame's 1 bits are in the check's mask.
+#define WIEGAND_MAX_PARITY_CHECKS 3
+
+struct wiegand_parity_check {
+  uint64_t mask;
+  byte odd;
+};
+
+// Bit positions count from the last (least significant) bit of the frame.
+struct wiegand_format {
+  // Frame length
+  byte bits;
+  byte facility_shift;
+  byte facility_bits;
+  byte user_shift;
+  byte user_bits;
+  byte num_parity_checks;
+  struct wiegand_parity_check parity[WIEGAND_MAX_PARITY_CHECKS];
+};
+
+// Copies a format's table entry.  Returns false if the format is unknown or
+// not enabled.
+boolean wiegand_get_format(byte format, struct wiegand_format * f);
+
+// A credential of any format.
+struct wiegand_credential {
+  byte format;
+  uint16_t facility;
+  uint32_t user;
+};
+
+#define P_WIEGAND_CREDENTIAL(e) \
+  P("wiegand_credential<format="); \
+  PDEC((e).format); \
+  P(",facility="); \
+  PDEC((e).facility); \
+  P(",user="); \
+  PDEC((e).user); \
+  P(">");
+
+//////////////////////////////////////////////////////////////////////////////
+// Readers
+//////////////////////////////////////////////////////////////////////////////
+
 void wiegand_readers_init();
 
+// Closes frames that have been idle for WIEGAND_INPUT_TIMEOUT_MS.  Call from
+// the main loop before taking frames.
+void wiegand_readers_loop();
+
+// A complete frame captured from a reader.  Frames from all readers wait in
+// one queue in the order they finished arriving.
+struct wiegand_frame {
+  // Millis when the last bit arrived
+  uint32_t captured;
+  // Bits read, first bit most significant.  Bits beyond 32 are in bits_high.
+  uint32_t bits;
+  byte bits_high;
+  byte count;
+  byte reader_num;
+  // Parity accumulators, see WIEGAND_MAX_PARITY_CHECKS
+  uint16_t parity;
+};
+
+// Removes the oldest captured frame from the queue.  Returns false if the
+// queue is empty.
+boolean wiegand_next_frame(struct wiegand_frame * frame);
+
+// The number of frames waiting, and the number dropped because the queue
+// was full.
+byte wiegand_frames_waiting();
+uint16_t wiegand_frame_overflows();
+
+#if WIEGAND_CAPTURE == WIEGAND_CAPTURE_TIMER
+
+// The CPU time taken sampling the data lines.  Duties are hundredths of a
+// percent of the time between samples, averaged over windows of a few
+// thousand samples: the last window and the busiest since the last reset.
+struct wiegand_sample_stats {
+  uint16_t duty;
+  uint16_t peak_duty;
+  // The longest single sample since the last reset
+  uint32_t peak_sample_ns;
+};
+
+void wiegand_get_sample_stats(struct wiegand_sample_stats * stats);
+// Forgets the busiest window and the longest sample.
+void wiegand_reset_sample_stats();
+
+#endif
+
+// Decodes a captured frame with the enabled format of the same length.
+// Returns false if there is none or the parity is wrong.
+boolean wiegand_frame_decode(struct wiegand_frame * frame, struct wiegand_credential * cred);
+
 //////////////////////////////////////////////////////////////////////////////
 // Wiegand 26-bit Types and Functions
 //////////////////////////////////////////////////////////////////////////////
 
-// 24-bit Wiegand (26-bits on-the-wire includes 2 parity bits) as used by 
+// 24-bit Wiegand (26-bits on-the-wire includes 2 parity bits) as used by
 // HID Prox and many other devices.  Packed for storage in EEPROM.
 struct __attribute__((packed)) wiegand26_credential {
   uint8_t facility;
@@ -29,11 +167,4 @@ struct __attribute__((packed)) wiegand26_credential {
   PDEC((e).user); \
   P(">");
 
-boolean wiegand_reader_credential_ready(byte reader_num, byte credential_type);
-boolean wiegand_reader_get_wiegand26(byte reader_num, struct wiegand26_credential * cred);
-
-// There are Wiegand formats with more than 26 bits.  Adding support for these
-// should be straightforward.  Define types here and change the ISR and 
-// retrieval code in wiegand.cpp to detect other formats.
-
 #endif
@@ -3,13 +3,46 @@ Classes and types that provide for communication with the Dorbo access
 controller hardware via RS-232 serial.
 """
 import logging
-from collections import namedtuple
+from collections import deque, namedtuple
 
 import serial
 
 Wiegand26Credential = namedtuple('Wiegand26Credential', ['facility', 'user'])
 """Represents one stored door access credential."""
 
+Wiegand26Rule = namedtuple('Wiegand26Rule', ['kind', 'facility', 'first_user',
+                                             'last_user'])
+"""Grants ("allow") or denies ("deny") the Wiegand-26 credentials of one
+facility with user codes from first_user to last_user.  A free rule slot has
+kind "none"."""
+
+StorageInfo = namedtuple('StorageInfo', ['max_credentials', 'layout'])
+"""The size and layout ("flat", "hash" or "group") of one credential type's
+storage, or the number of Wiegand-26 rules (type "r26", layout "rule")."""
+
+AccessEvent = namedtuple('AccessEvent', ['seq', 'era', 'millis', 'reader',
+                                         'type', 'facility', 'user',
+                                         'granted'])
+"""One grant or deny decision from the controller's event log.  It was made
+era * 2**32 + millis ms after the controller started."""
+
+DoorEvent = namedtuple('DoorEvent', ['door', 'open'])
+"""A door strike opening or closing."""
+
+EVENT_PREFIX = '!'
+"""Starts the unsolicited event lines the controller prints."""
+
+DEBUG_PREFIX = '#'
+"""Starts the debug trace lines the controller prints when built with
+DEBUG."""
+
+CONTROLLER_RX_BUFFER_SIZE = 64
+"""Bytes the controller's serial receive buffer holds (the Arduino core's
+SERIAL_RX_BUFFER_SIZE)."""
+
+DEFAULT_PIPELINE_WINDOW = 8
+"""How many commands execute_pipelined() keeps in flight by default."""
+
 SERIAL_ENCODING = 'utf8'
 """Encoding used to communicate with the access controller."""
 
@@ -28,6 +61,45 @@ class ProtocolError(Exception):
     pass
 
 
+def parse_access_event(fields):
+    """
+    Parses the fields of a "log" line or "!access" event.
+
+    :raises ProtocolError: if the fields can't be parsed
+    """
+    if len(fields) != 8:
+        raise ProtocolError('Got %d fields instead of 8' % len(fields))
+    try:
+        return AccessEvent(seq=int(fields[0]), era=int(fields[1]),
+                           millis=int(fields[2]), reader=int(fields[3]),
+                           type=fields[4], facility=int(fields[5]),
+                           user=int(fields[6]), granted=fields[7] == 'grant')
+    except ValueError as e:
+        raise ProtocolError('Bad event: %s' % e)
+
+
+def parse_event(line):
+    """
+    Parses an unsolicited event line like "!door 0 open".
+
+    :return: an AccessEvent or DoorEvent, or None for unknown events
+    :raises ProtocolError: if a known event can't be parsed
+    """
+    fields = line[len(EVENT_PREFIX):].split()
+    if not fields:
+        return None
+    if fields[0] == 'access':
+        return parse_access_event(fields[1:])
+    if fields[0] == 'door':
+        if len(fields) != 3:
+            raise ProtocolError('Got %d fields instead of 3' % len(fields))
+        try:
+            return DoorEvent(door=int(fields[1]), open=fields[2] == 'open')
+        except ValueError as e:
+            raise ProtocolError('Bad event: %s' % e)
+    return None
+
+
 class AccessController(object):
     """
     Provides high- and low-level interfaces for communicating with the Dorbo
@@ -41,7 +113,7 @@ class AccessController(object):
 
     """
 
-    def __init__(self, serial_dev, serial_speed=115200):
+    def __init__(self, serial_dev, serial_speed=115200, event_handler=None):
         """
 
         :param serial_dev: the serial device the controller is attached to;
@@ -49,8 +121,12 @@ class AccessController(object):
             probably a string like "COM1" on Windows systems
         :param serial_speed: the speed at which to communicate to the access
             controller (115200 is standard)
+        :param event_handler: called with the raw line and the parsed
+            AccessEvent or DoorEvent (None if unknown) for each unsolicited
+            event line the controller prints
         """
         self.logger = logging.getLogger(type(self).__name__)
+        self.event_handler = event_handler
         self.serial_kwargs = dict(port=serial_dev, baudrate=serial_speed,
                                   timeout=5)
 
@@ -138,6 +214,165 @@ class AccessController(object):
             raise ProtocolError('Error setting credentials: %s'
                                 % ','.join(lines))
 
+    def add_wiegand26(self, wiegand26_credential):
+        """
+        Store a Wiegand-26 credential in a free index, unless it is already
+        stored.  This is the way to store credentials in a hashed or grouped
+        table.
+
+        :param wiegand26_credential: the credential data to add
+        :return: the index that holds the credential
+        :raises ProtocolError: if there was an error communicating with the
+            access controller or the table is full
+        """
+        success, lines = self.execute('a w26 %d %d'
+                                      % (wiegand26_credential.facility,
+                                         wiegand26_credential.user))
+        if not success:
+            raise ProtocolError('Error adding credential: %s'
+                                % ','.join(lines))
+        return int(lines[0].split()[0])
+
+    def delete_wiegand26(self, wiegand26_credential):
+        """
+        Remove a stored Wiegand-26 credential from the index that holds it.
+
+        :param wiegand26_credential: the credential data to remove
+        :return: the index that held the credential
+        :raises ProtocolError: if there was an error communicating with the
+            access controller or the credential was not stored
+        """
+        success, lines = self.execute('d w26 %d %d'
+                                      % (wiegand26_credential.facility,
+                                         wiegand26_credential.user))
+        if not success:
+            raise ProtocolError('Error deleting credential: %s'
+                                % ','.join(lines))
+        return int(lines[0].split()[0])
+
+    def list_wiegand26_rules(self):
+        """
+        List the Wiegand-26 rules, which the controller checks before its
+        stored credentials.  Deny rules override everything else.
+
+        :return: a list of all Wiegand26Rules with list indices corresponding
+            to the controller rule index
+        :raises ProtocolError: if there was an error communicating with the
+            access controller
+        """
+        success, lines = self.execute('l r26')
+        if not success:
+            raise ProtocolError('Error listing rules: %s' % ','.join(lines))
+        rules = []
+        for line in lines:
+            fields = line.split()
+            if len(fields) != 5:
+                raise ProtocolError('Got %d fields instead of 5' % len(fields))
+            rules.append(Wiegand26Rule(kind=fields[1],
+                                       facility=int(fields[2]),
+                                       first_user=int(fields[3]),
+                                       last_user=int(fields[4])))
+        return rules
+
+    def set_wiegand26_rule(self, index, wiegand26_rule):
+        """
+        Set a Wiegand-26 rule by index.  A rule of kind "none" frees the
+        index.
+
+        :param index: the index of the rule to set
+        :param wiegand26_rule: the Wiegand26Rule to set
+        :raises ProtocolError: if there was an error communicating with the
+            access controller
+        """
+        if wiegand26_rule.kind == 'none':
+            command = 'w r26 %d none' % index
+        else:
+            command = 'w r26 %d %s %d %d %d' % (index, wiegand26_rule.kind,
+                                                wiegand26_rule.facility,
+                                                wiegand26_rule.first_user,
+                                                wiegand26_rule.last_user)
+        success, lines = self.execute(command)
+        if not success:
+            raise ProtocolError('Error setting rule: %s' % ','.join(lines))
+
+    def get_storage_info(self):
+        """
+        Get the size and layout of each credential type's storage.
+
+        :return: a dict of StorageInfo keyed by credential type, like "w26"
+        :raises ProtocolError: if there was an error communicating with the
+            access controller
+        """
+        success, lines = self.execute('i')
+        if not success:
+            raise ProtocolError('Error getting storage info: %s'
+                                % ','.join(lines))
+        info = {}
+        for line in lines:
+            fields = line.split()
+            if len(fields) == 2:
+                # Controllers older than the hashed layout
+                fields.append('flat')
+            if len(fields) != 3:
+                raise ProtocolError('Got %d fields instead of 3' % len(fields))
+            info[fields[0]] = StorageInfo(max_credentials=int(fields[1]),
+                                          layout=fields[2])
+        return info
+
+    def get_events(self, after=0):
+        """
+        Get logged access decisions numbered after the given sequence number.
+        One call returns a limited number of events; call again with the
+        last seq returned until no events are returned.  A seq lower than the
+        one given means the controller was reset and started a new log.
+
+        :param after: the seq of the last event already seen, 0 for all
+        :return: a list of AccessEvents, oldest first
+        :raises ProtocolError: if there was an error communicating with the
+            access controller
+        """
+        success, lines = self.execute('log %d' % after)
+        if not success:
+            raise ProtocolError('Error getting events: %s' % ','.join(lines))
+        return [parse_access_event(line.split()) for line in lines]
+
+    def poll_events(self):
+        """
+        Handles the lines that arrived since the last command, passing
+        events to the event handler.  Call this while idle so events are
+        handled when they happen.
+        """
+        assert self.serial, 'can only poll inside a context manager'
+        while self.serial.inWaiting() > 0:
+            line = str(self.serial.readline(), SERIAL_ENCODING).strip()
+            if not self._handle_event(line) and not self._is_trace(line):
+                self.logger.debug('discarding junk: %s', line)
+
+    @staticmethod
+    def _is_trace(line):
+        """
+        :return: True if the line is a debug trace, which is only logged
+        """
+        return line.startswith(DEBUG_PREFIX)
+
+    def _handle_event(self, line):
+        """
+        Passes an event line to the event handler.
+
+        :return: True if the line was an event
+        """
+        if not line.startswith(EVENT_PREFIX):
+            return False
+        try:
+            event = parse_event(line)
+        except ProtocolError as e:
+            self.logger.warning('%s: %r', e, line)
+            event = None
+        self.logger.debug('event: %r', line)
+        if self.event_handler:
+            self.event_handler(line, event)
+        return True
+
     def execute(self, command):
         """
         Executes the command on the access controller.
@@ -147,23 +382,71 @@ class AccessController(object):
             successful, or (False, [result_lines]) if the command failed
         :raises ReadTimeoutError: if the command was not acknowledged in time
         """
+        return self.execute_pipelined([command], window=1)[0]
+
+    def execute_pipelined(self, commands, window=DEFAULT_PIPELINE_WINDOW):
+        """
+        Executes commands in order, sending the next ones before the earlier
+        ones have answered so the round trips overlap.  Responses come back
+        in the order the commands were sent.  A command that fails doesn't
+        stop the ones after it, so don't pipeline commands that depend on
+        each other's success.
+
+        :param commands: the commands as strings
+        :param window: the most commands to have in flight; the commands in
+            flight are also kept within CONTROLLER_RX_BUFFER_SIZE bytes
+        :return: a list with a (success, [result_lines]) tuple per command,
+            like execute()
+        :raises ReadTimeoutError: if a command was not acknowledged in time
+        """
         assert self.serial, 'can only execute inside a context manager'
+        assert window >= 1, 'the window must hold at least one command'
 
-        # Consume the text prompt or any left-overs from previous commands
-        while self.serial.inWaiting() > 0:
-            junk = self.serial.read()
-            self.logger.debug('discarding pre-execution junk: %s', junk.strip())
+        # Handle events and consume any left-overs from previous commands
+        self.poll_events()
 
         # Communication with the access controller uses very simple flow
         # control that's human friendly for manual debugging.  The host sends
         # a command terminated by a newline, the command executes, and the
         # controller's response is one or more lines that always ends in a full
-        # line of text of "ok" or "err".
-        command_bytes = bytes(command + '\n', SERIAL_ENCODING)
-        self.serial.write(command_bytes)
-        self.logger.debug('write: %r', command_bytes)
+        # line of text of "ok" or "err".  Event lines and debug traces can
+        # arrive at any time, even in the middle of the response.  A listing
+        # takes several loop iterations, so a badge read meanwhile puts its
+        # event and traces between the slot lines.
+        #
+        # The controller reads commands from its receive buffer only between
+        # commands, and bytes that arrive while the buffer is full are lost,
+        # so the bytes in flight must fit in it.
+        results = []
+        in_flight = deque()
+        in_flight_bytes = 0
+        for command in commands:
+            command_bytes = bytes(command + '\n', SERIAL_ENCODING)
+            while in_flight and (
+                    len(in_flight) >= window or
+                    in_flight_bytes + len(command_bytes) >
+                    CONTROLLER_RX_BUFFER_SIZE):
+                done = in_flight.popleft()
+                in_flight_bytes -= len(done)
+                results.append(self._read_response(done))
+
+            self.serial.write(command_bytes)
+            self.logger.debug('write: %r', command_bytes)
+            in_flight.append(command_bytes)
+            in_flight_bytes += len(command_bytes)
+
         self.serial.flush()
+        while in_flight:
+            results.append(self._read_response(in_flight.popleft()))
+        return results
 
+    def _read_response(self, command_bytes):
+        """
+        Reads the response to the oldest command in flight.
+
+        :return: (success, [result_lines])
+        :raises ReadTimeoutError: if the response did not arrive in time
+        """
         result_lines = []
         while True:
             line_bytes = self.serial.readline()
@@ -171,10 +454,14 @@ class AccessController(object):
             line = str(line_bytes, SERIAL_ENCODING)
             if not line:
                 self.logger.debug('timeout waiting for line: %r)', command_bytes)
-                raise ReadTimeoutError('Timeout waiting for line: %s' % command)
+                raise ReadTimeoutError('Timeout waiting for line: %s'
+                                       % str(command_bytes,
+                                             SERIAL_ENCODING).strip())
 
             line = line.strip()
-            if line == 'ok':
+            if self._handle_event(line) or self._is_trace(line):
+                continue
+            elif line == 'ok':
                 return True, result_lines
             elif line == 'err':
                 return False, result_lines
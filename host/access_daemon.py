@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+#
+# Holds the serial link to the access controller open and shares it with
+# local clients over a Unix socket, so they skip the handshake that opening
+# the port costs.  Clients speak the controller's own protocol: send a
+# command line and read response lines up to "ok" or "err".  For example:
+#
+#   socat - UNIX-CONNECT:/tmp/dorbo.sock
+#
+# Commands from all clients run one at a time.  A client that sends "events"
+# instead is sent every unsolicited event line the controller prints (like
+# "!access ..." and "!door 0 open") until it disconnects.  Events are logged
+# too.
+#
+# Requires pySerial
+import logging
+import os
+import queue
+import socketserver
+import sys
+import threading
+from argparse import ArgumentParser
+
+from access_controller import AccessController, ReadTimeoutError, \
+    SERIAL_ENCODING
+
+log_level_choices = ['CRITICAL', 'ERROR', 'WARNING', 'INFO', 'DEBUG']
+
+SUBSCRIBE_COMMAND = 'events'
+
+# Events a slow subscriber can fall behind by before it is sent no more.
+SUBSCRIBER_QUEUE_SIZE = 100
+
+# How long the serial thread waits for a command before checking for events.
+POLL_INTERVAL = 0.05
+
+
+class Daemon(object):
+    """
+    Owns the controller.  Commands are queued to the thread that does all
+    serial I/O, and events are fanned out to subscriber queues.
+    """
+
+    def __init__(self, serial_dev, serial_speed):
+        self.logger = logging.getLogger(type(self).__name__)
+        self.controller = AccessController(serial_dev, serial_speed,
+                                           event_handler=self._on_event)
+        self.commands = queue.Queue()
+        self.subscribers = set()
+        self.subscribers_lock = threading.Lock()
+
+    def execute(self, command):
+        """
+        Runs a command on the controller from any thread.
+
+        :return: (success, result_lines) like AccessController.execute
+        """
+        reply = queue.Queue(maxsize=1)
+        self.commands.put((command, reply))
+        return reply.get()
+
+    def subscribe(self):
+        """
+        :return: a queue that receives every event line; pass it to
+            unsubscribe() when done
+        """
+        events = queue.Queue(maxsize=SUBSCRIBER_QUEUE_SIZE)
+        with self.subscribers_lock:
+            self.subscribers.add(events)
+        return events
+
+    def unsubscribe(self, events):
+        with self.subscribers_lock:
+            self.subscribers.discard(events)
+
+    def run(self):
+        """
+        Does the serial I/O until the process exits.
+        """
+        with self.controller as controller:
+            self.logger.info('controller ready')
+            while True:
+                try:
+                    command, reply = self.commands.get(timeout=POLL_INTERVAL)
+                except queue.Empty:
+                    controller.poll_events()
+                    continue
+                try:
+                    reply.put(controller.execute(command))
+                except ReadTimeoutError as e:
+                    reply.put((False, [str(e)]))
+                except Exception as e:
+                    # The link is broken.  Exit so a supervisor can restart us.
+                    reply.put((False, [str(e)]))
+                    raise
+
+    def _on_event(self, line, event):
+        self.logger.info('%s', event if event else line)
+        with self.subscribers_lock:
+            for events in list(self.subscribers):
+                try:
+                    events.put_nowait(line)
+                except queue.Full:
+                    self.logger.warning('dropping slow event subscriber')
+                    self.subscribers.discard(events)
+                    self._close_subscriber(events)
+
+    @staticmethod
+    def _close_subscriber(events):
+        """
+        Replaces the events a dropped subscriber hasn't read with the None
+        that ends its stream.  Never blocks: this runs on the serial thread,
+        and nothing else puts to the queue once it is unsubscribed.
+        """
+        try:
+            while True:
+                events.get_nowait()
+        except queue.Empty:
+            pass
+        events.put_nowait(None)
+
+
+class ClientHandler(socketserver.StreamRequestHandler):
+    """Serves one client connection."""
+
+    def handle(self):
+        daemon = self.server.daemon
+        for line_bytes in self.rfile:
+            command = str(line_bytes, SERIAL_ENCODING).strip()
+            if command == SUBSCRIBE_COMMAND:
+                self._stream_events(daemon)
+                return
+            success, lines = daemon.execute(command)
+            lines.append('ok' if success else 'err')
+            self._write_lines(lines)
+
+    def _stream_events(self, daemon):
+        events = daemon.subscribe()
+        try:
+            while True:
+                line = events.get()
+                if line is None:
+                    return
+                self._write_lines([line])
+        except OSError:
+            # The client went away
+            pass
+        finally:
+            daemon.unsubscribe(events)
+
+    def _write_lines(self, lines):
+        self.wfile.write(bytes(''.join(l + '\n' for l in lines),
+                               SERIAL_ENCODING))
+        self.wfile.flush()
+
+
+class Server(socketserver.ThreadingUnixStreamServer):
+    daemon_threads = True
+
+    def __init__(self, path, daemon):
+        self.daemon = daemon
+        socketserver.ThreadingUnixStreamServer.__init__(self, path,
+                                                        ClientHandler)
+
+
+def main():
+    parser = ArgumentParser(
+        description='Share a Dorbo Access Controller with local clients over '
+                    'a Unix socket')
+
+    parser.add_argument('--log-level', help='sets the log level',
+                        choices=log_level_choices, dest='log_level',
+                        default='INFO')
+    parser.add_argument('-d', '--device',
+                        help='the serial device to use to communicate with the '
+                             'controller',
+                        default='/dev/ttyACM0')
+    parser.add_argument('-s', '--speed',
+                        help='the speed (bytes/second) to use to communicate '
+                             'with the controller',
+                        default='115200')
+    parser.add_argument('-u', '--socket',
+                        help='the Unix socket to serve clients on',
+                        default='/tmp/dorbo.sock')
+
+    args = parser.parse_args()
+
+    logging.basicConfig(level=args.log_level)
+    try:
+        speed = int(args.speed)
+    except ValueError:
+        print('Speed %s is not an integer' % args.speed)
+        sys.exit(1)
+
+    # A socket left behind by a previous run
+    if os.path.exists(args.socket):
+        os.unlink(args.socket)
+
+    daemon = Daemon(args.device, speed)
+    server = Server(args.socket, daemon)
+    server_thread = threading.Thread(target=server.serve_forever)
+    server_thread.daemon = True
+    server_thread.start()
+    try:
+        daemon.run()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        server.server_close()
+        os.unlink(args.socket)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+# Measures how many commands per second AccessController gets through with
+# and without pipelining, against a stand-in controller on a pseudo-terminal.
+# The stand-in answers every command with "ok" after a service time, delays
+# each direction of the link, and models the controller's serial receive
+# buffer: it only reads commands between commands, and bytes that arrive
+# while the buffer is full are lost.  Lost bytes corrupt commands, which show
+# up as failed commands in the results.
+#
+#   ./bench_pipeline.py --latency 2 --service 10 --commands 100
+#
+# Requires pySerial
+import os
+import threading
+import time
+import tty
+from argparse import ArgumentParser
+from collections import deque
+
+from access_controller import AccessController, CONTROLLER_RX_BUFFER_SIZE
+
+# How often the stand-in checks the link, in seconds
+TICK = 0.0002
+
+
+class StandInController(object):
+    """
+    Serves the controller's line protocol on the master side of a pty.
+    """
+
+    def __init__(self, latency, service, rx_buffer_size):
+        self.latency = latency
+        self.service = service
+        self.rx_buffer_size = rx_buffer_size
+        self.master, slave = os.openpty()
+        tty.setraw(slave)
+        self.port = os.ttyname(slave)
+        self.slave = slave
+        self.commands = 0
+        self.bad_commands = 0
+        self.dropped_bytes = 0
+        self.running = True
+        self.thread = threading.Thread(target=self._run)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def close(self):
+        self.running = False
+        self.thread.join()
+        os.close(self.master)
+        os.close(self.slave)
+
+    def _run(self):
+        # Bytes on their way in and out, as (due time, bytes)
+        arriving = deque()
+        leaving = deque()
+        rx_buffer = bytearray()
+        command = bytearray()
+        busy_until = 0
+        os.set_blocking(self.master, False)
+        while self.running:
+            now = time.monotonic()
+            try:
+                data = os.read(self.master, 4096)
+                arriving.append((now + self.latency, data))
+            except BlockingIOError:
+                pass
+
+            while arriving and arriving[0][0] <= now:
+                data = arriving.popleft()[1]
+                room = self.rx_buffer_size - len(rx_buffer)
+                rx_buffer += data[:room]
+                self.dropped_bytes += max(0, len(data) - room)
+
+            # Like cli_loop(), read input only between commands
+            while now >= busy_until and rx_buffer:
+                c = rx_buffer.pop(0)
+                if c != ord('\n'):
+                    command.append(c)
+                    continue
+                self.commands += 1
+                response = b'ok\r\n'
+                if command and not command.startswith((b'w ', b'r ', b'a ', b'd ')):
+                    self.bad_commands += 1
+                    response = b'invalid command\r\nerr\r\n'
+                command = bytearray()
+                busy_until = now + self.service
+                leaving.append((busy_until + self.latency, response))
+
+            while leaving and leaving[0][0] <= now:
+                os.write(self.master, leaving.popleft()[1])
+            time.sleep(TICK)
+
+
+def run(controller, commands, window):
+    start = time.monotonic()
+    if window == 0:
+        results = [controller.execute(c) for c in commands]
+    else:
+        results = controller.execute_pipelined(commands, window=window)
+    elapsed = time.monotonic() - start
+    failed = sum(1 for success, lines in results if not success)
+    return elapsed, failed
+
+
+def main():
+    parser = ArgumentParser(
+        description='Benchmark pipelined commands against a stand-in '
+                    'controller')
+    parser.add_argument('--latency', type=float, default=2,
+                        help='one-way link delay in ms')
+    parser.add_argument('--service', type=float, default=10,
+                        help='time the controller takes per command in ms '
+                             '(a credential write is 3 EEPROM byte writes)')
+    parser.add_argument('--commands', type=int, default=100,
+                        help='commands per run')
+    parser.add_argument('--rx-buffer', type=int,
+                        default=CONTROLLER_RX_BUFFER_SIZE,
+                        help='the controller receive buffer size in bytes')
+    args = parser.parse_args()
+
+    stand_in = StandInController(args.latency / 1000, args.service / 1000,
+                                 args.rx_buffer)
+    commands = ['w w26 %d 103 %d' % (i, 26000 + i)
+                for i in range(args.commands)]
+    try:
+        with AccessController(stand_in.port) as controller:
+            print('%-10s %10s %12s %8s' % ('window', 'seconds', 'commands/s',
+                                            'failed'))
+            for window in [0, 1, 2, 4, 8, 16]:
+                elapsed, failed = run(controller, commands, window)
+                print('%-10s %10.3f %12.1f %8d'
+                      % (window if window else 'execute', elapsed,
+                         len(commands) / elapsed, failed))
+        print('%d bytes dropped by the receive buffer' % stand_in.dropped_bytes)
+    finally:
+        stand_in.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -1,20 +1,42 @@
 #!/usr/bin/env python3
 #
-# Reads door access fobs from a Google Spreadsheet and prints the fob numbers
-# that are enabled to standard output, one fob number per line like
-# "123 12345" (facility and user separated by a space).
+# Reads door access fobs from a Google Spreadsheet or a CSV file and prints
+# the fob numbers that are enabled to standard output, one fob number per
+# line like "123 12345" (facility and user separated by a space).  Fobs are
+# printed as their rows are validated.
 #
-# Requires: gspread oauth2client
+# Either source has a header row naming the "Fob Number" and "Enabled"
+# columns, and the same rows are enabled in both, so a CSV export of the
+# spreadsheet gives the same fobs:
+#
+#   ./cat_enabled_fobs.py creds.json Fobs Sheet1
+#   ./cat_enabled_fobs.py --csv fobs.csv
+#
+# With --snapshot, the fobs printed and a hash of the source's rows are kept
+# in a local file.  When the source can't be reached the snapshot's fobs are
+# printed instead, and --max-age reuses a recent snapshot without reading
+# the source at all.  --skip-unchanged prints nothing and exits with status
+# 6 instead when the rows hash the same as the snapshot's, or the snapshot
+# is used, so the sync can be skipped:
+#
+#   ./cat_enabled_fobs.py --snapshot fobs.json --skip-unchanged \
+#       creds.json Fobs Sheet1 > fobs.txt && ./sync_fobs.py fobs.txt
+#
+# Exit statuses: 2 authentication failed, 3 spreadsheet or CSV file not
+# found, 4 worksheet not found, 5 column not found, 6 source unchanged, 7
+# source unavailable and no snapshot of it.
+#
+# Requires: gspread oauth2client (for spreadsheets only)
 
+import csv
+import hashlib
+import json
+import os
 import re
 import sys
+import time
 from argparse import ArgumentParser
 
-import gspread
-import oauth2client.client
-from gspread.exceptions import SpreadsheetNotFound, WorksheetNotFound
-from oauth2client.service_account import ServiceAccountCredentials
-
 # Spreadsheet column headers, compared case-sensitive.
 FOB_NUMBER_COLUMN = 'Fob Number'
 ENABLED_COLUMN = 'Enabled'
@@ -23,82 +45,130 @@ FOB_NUMBER_PATTERN = re.compile('^(?P<facility>[0-9]{1,3})-'
                                 '(?P<user>[0-9]{1,5})$')
 ENABLED_PATTERN = re.compile('^TRUE$', flags=re.IGNORECASE)
 
+UNCHANGED_EXIT_STATUS = 6
+UNAVAILABLE_EXIT_STATUS = 7
 
-def main():
-    parser = ArgumentParser(
-        description='Reads door access fobs from a Google Spreadsheet and '
-                    'prints the ones that are enabled to standard output')
 
-    parser.add_argument('--verbose', '-v',
-                        help='enable verbose output to standard error',
-                        action='store_true')
-    parser.add_argument('sa_creds_file',
-                        metavar='credentials-file.json',
-                        help='JSON file containing Google service account '
-                             'credentials')
-    parser.add_argument('doc_name',
-                        metavar='spreadsheet',
-                        help='name of the Google Spreadsheets document')
-    parser.add_argument('sheet_name',
-                        metavar='worksheet',
-                        help='name of the worksheet inside the spreadsheet '
-                             'document that contains the fob rows')
+class SourceUnavailableError(Exception):
+    """
+    The source couldn't be read, for example because the network is down.
+    """
+    pass
 
-    args = parser.parse_args()
+
+def read_sheet_rows(sa_creds_file, doc_name, sheet_name, verbose=False):
+    """
+    Reads a worksheet of a Google Spreadsheet in one request.
+
+    :return: the list of rows, header first, each a list of cell strings
+    :raises SourceUnavailableError: if Google can't be reached
+    """
+    import gspread
+    import httplib2
+    import oauth2client.client
+    from gspread.exceptions import GSpreadException, SpreadsheetNotFound, \
+        WorksheetNotFound
+    from oauth2client.service_account import ServiceAccountCredentials
 
     scopes = ['https://spreadsheets.google.com/feeds']
     try:
         credentials = ServiceAccountCredentials.from_json_keyfile_name(
-            args.sa_creds_file, scopes)
-        if args.verbose:
+            sa_creds_file, scopes)
+        if verbose:
             sys.stderr.write('Service credentials loaded from "%s"\n'
-                             % args.sa_creds_file)
+                             % sa_creds_file)
 
         conn = gspread.authorize(credentials)
-        if args.verbose:
+        if verbose:
             sys.stderr.write('Connected to Google Drive\n')
+
+        doc = conn.open(doc_name)
+        if verbose:
+            sys.stderr.write('Spreadsheet document "%s" opened\n' % doc_name)
+
+        worksheet = doc.worksheet(sheet_name)
+        if verbose:
+            sys.stderr.write('Worksheet "%s" opened\n' % sheet_name)
+
+        return worksheet.get_all_values()
     except oauth2client.client.Error as e:
         sys.stderr.write('Authentication error: %s\n' % str(e))
         sys.stderr.write('Verify that the service account credentials file '
                          '"%s" contains valid access credentials.\n'
-                         % args.sa_creds_file)
+                         % sa_creds_file)
         sys.exit(2)
-
-    try:
-        doc = conn.open(args.doc_name)
-        if args.verbose:
-            sys.stderr.write('Spreadsheet document "%s" opened\n'
-                             % args.doc_name)
-
-        worksheet = doc.worksheet(args.sheet_name)
-        if args.verbose:
-            sys.stderr.write('Worksheet "%s" opened\n' % args.sheet_name)
     except SpreadsheetNotFound:
-        sys.stderr.write('Spreadsheet document "%s" not found.\n'
-                         % args.doc_name)
+        sys.stderr.write('Spreadsheet document "%s" not found.\n' % doc_name)
         sys.exit(3)
     except WorksheetNotFound:
         sys.stderr.write('Worksheet "%s" not found in spreadsheet "%s".\n'
-                         % (args.sheet_name, args.doc_name))
+                         % (sheet_name, doc_name))
         sys.exit(4)
+    except (OSError, httplib2.HttpLib2Error, GSpreadException) as e:
+        raise SourceUnavailableError(str(e) or type(e).__name__)
+
+
+def read_csv_rows(path):
+    """
+    Reads a CSV file a row at a time.
+
+    :return: an iterator of rows, header first, each a list of cell strings
+    """
+    try:
+        f = open(path, newline='')
+    except FileNotFoundError:
+        sys.stderr.write('CSV file "%s" not found.\n' % path)
+        sys.exit(3)
+    except OSError as e:
+        raise SourceUnavailableError(str(e))
+
+    def rows():
+        with f:
+            yield from csv.reader(f)
+    return rows()
+
+
+def hashed_rows(rows, digest):
+    """
+    Passes rows through, adding each one to a hashlib digest.
+    """
+    for row in rows:
+        digest.update(json.dumps(row).encode('utf-8'))
+        digest.update(b'\n')
+        yield row
+
+
+def enabled_fobs(rows, source_name, verbose=False):
+    """
+    Validates fob rows, header first, and yields the fob number of each
+    enabled row as soon as it is validated.  Invalid enabled rows are
+    reported on standard error and skipped.
 
-    records = worksheet.get_all_records(head=1)
-    if args.verbose:
-        sys.stderr.write('%d records in worksheet\n' % len(records))
-
-    # Validate records and collect decimal fob numbers.
-    for record in records:
-        for column_name in [FOB_NUMBER_COLUMN, ENABLED_COLUMN]:
-            if column_name not in record:
-                sys.stderr.write('Column "%s" not found in worksheet "%s".  '
-                                 'Verify the worksheet contains the column '
-                                 'with the correct name and capitalization.\n'
-                                 % (column_name, args.sheet_name))
-                sys.exit(5)
-
-        if ENABLED_PATTERN.match(record[ENABLED_COLUMN]):
+    :return: an iterator of (facility, user) tuples
+    """
+    rows = iter(rows)
+    header = next(rows, None)
+    if header is None:
+        return
+    for column_name in [FOB_NUMBER_COLUMN, ENABLED_COLUMN]:
+        if column_name not in header:
+            sys.stderr.write('Column "%s" not found in %s.  Verify it '
+                             'contains the column with the correct name and '
+                             'capitalization.\n' % (column_name, source_name))
+            sys.exit(5)
+    fob_number_index = header.index(FOB_NUMBER_COLUMN)
+    enabled_index = header.index(ENABLED_COLUMN)
+
+    count = 0
+    for row in rows:
+        count += 1
+        # Short rows leave their last cells empty
+        row = row + [''] * (len(header) - len(row))
+        record = dict(zip(header, row))
+
+        if ENABLED_PATTERN.match(row[enabled_index]):
             # Parse the fob number into the facility and user parts
-            fob_number = record[FOB_NUMBER_COLUMN]
+            fob_number = row[fob_number_index]
             fob_match = FOB_NUMBER_PATTERN.match(fob_number)
             if fob_match:
                 # Convert to int to removing leading zeroes
@@ -107,17 +177,177 @@ def main():
                 if facility > 255:
                     sys.stderr.write('Ignoring invalid "facility" part of '
                                      'fob number: %s\n' % record)
-                elif user > 65536:
+                elif user > 65535:
                     sys.stderr.write('Ignoring invalid "user" part of '
                                      'fob number: %s\n' % record)
                 else:
-                    sys.stdout.write('%s %s\n' % (facility, user))
+                    yield facility, user
             else:
                 sys.stderr.write('Ignoring enabled record with invalid fob '
                                  'number: %s\n' % record)
-        elif args.verbose:
+        elif verbose:
             sys.stderr.write('Ignoring non-enabled record: %s\n' % record)
 
+    if verbose:
+        sys.stderr.write('%d records in %s\n' % (count, source_name))
+
+
+def load_snapshot(path, source):
+    """
+    Reads the snapshot of a source.
+
+    :return: the snapshot dict, or None if there is none for this source
+    """
+    try:
+        with open(path) as f:
+            snapshot = json.load(f)
+    except FileNotFoundError:
+        return None
+    except (OSError, ValueError) as e:
+        sys.stderr.write('Ignoring unreadable snapshot "%s": %s\n' % (path, e))
+        return None
+    if not isinstance(snapshot, dict) or snapshot.get('source') != source \
+            or not {'sha256', 'time', 'fobs'} <= snapshot.keys():
+        return None
+    return snapshot
+
+
+def save_snapshot(path, snapshot):
+    """
+    Replaces the snapshot file atomically, so a failed run leaves the last
+    one intact.
+    """
+    tmp_path = path + '.tmp'
+    with open(tmp_path, 'w') as f:
+        json.dump(snapshot, f)
+    os.replace(tmp_path, path)
+
+
+def write_fob(facility, user):
+    sys.stdout.write('%s %s\n' % (facility, user))
+    sys.stdout.flush()
+
+
+def main():
+    parser = ArgumentParser(
+        description='Reads door access fobs from a Google Spreadsheet or a '
+                    'CSV file and prints the ones that are enabled to '
+                    'standard output')
+
+    parser.add_argument('--verbose', '-v',
+                        help='enable verbose output to standard error',
+                        action='store_true')
+    parser.add_argument('--csv',
+                        metavar='file.csv',
+                        help='read the fob rows from a CSV file instead of '
+                             'a spreadsheet')
+    parser.add_argument('--snapshot',
+                        metavar='snapshot.json',
+                        help='keep the fobs and a hash of the source in this '
+                             'file, and print them from it when the source '
+                             'is unavailable')
+    parser.add_argument('--max-age',
+                        metavar='seconds',
+                        type=float,
+                        help='use the snapshot without reading the source if '
+                             'it is at most this old')
+    parser.add_argument('--skip-unchanged',
+                        help='print nothing and exit with status %d if the '
+                             'source is unchanged since the snapshot'
+                             % UNCHANGED_EXIT_STATUS,
+                        action='store_true')
+    parser.add_argument('sa_creds_file',
+                        metavar='credentials-file.json',
+                        nargs='?',
+                        help='JSON file containing Google service account '
+                             'credentials')
+    parser.add_argument('doc_name',
+                        metavar='spreadsheet',
+                        nargs='?',
+                        help='name of the Google Spreadsheets document')
+    parser.add_argument('sheet_name',
+                        metavar='worksheet',
+                        nargs='?',
+                        help='name of the worksheet inside the spreadsheet '
+                             'document that contains the fob rows')
+
+    args = parser.parse_args()
+
+    spreadsheet_args = [args.sa_creds_file, args.doc_name, args.sheet_name]
+    if args.csv is not None:
+        if any(spreadsheet_args):
+            parser.error('--csv replaces the spreadsheet arguments')
+        source = 'csv:%s' % os.path.abspath(args.csv)
+        source_name = 'CSV file "%s"' % args.csv
+    else:
+        if not all(spreadsheet_args):
+            parser.error('the credentials file, spreadsheet and worksheet '
+                         'are required without --csv')
+        source = 'sheet:%s/%s' % (args.doc_name, args.sheet_name)
+        source_name = 'worksheet "%s"' % args.sheet_name
+    if (args.max_age is not None or args.skip_unchanged) \
+            and args.snapshot is None:
+        parser.error('--max-age and --skip-unchanged need --snapshot')
+
+    snapshot = None
+    if args.snapshot is not None:
+        snapshot = load_snapshot(args.snapshot, source)
+
+    def use_snapshot():
+        if args.skip_unchanged:
+            sys.exit(UNCHANGED_EXIT_STATUS)
+        for facility, user in snapshot['fobs']:
+            write_fob(facility, user)
+
+    if snapshot is not None and args.max_age is not None \
+            and time.time() - snapshot['time'] <= args.max_age:
+        if args.verbose:
+            sys.stderr.write('Using the snapshot in "%s"\n' % args.snapshot)
+        use_snapshot()
+        return
+
+    digest = hashlib.sha256()
+    try:
+        if args.csv is not None:
+            rows = read_csv_rows(args.csv)
+        else:
+            rows = read_sheet_rows(args.sa_creds_file, args.doc_name,
+                                   args.sheet_name, args.verbose)
+        rows = hashed_rows(rows, digest)
+        if args.skip_unchanged:
+            # The hash must be known before anything is printed
+            rows = list(rows)
+    except SourceUnavailableError as e:
+        if snapshot is None:
+            sys.stderr.write('Unable to read %s: %s\n' % (source_name, e))
+            sys.exit(UNAVAILABLE_EXIT_STATUS)
+        sys.stderr.write('Unable to read %s: %s.  Using the snapshot from '
+                         '%s.\n' % (source_name, e,
+                                    time.ctime(snapshot['time'])))
+        use_snapshot()
+        return
+
+    if args.skip_unchanged and snapshot is not None \
+            and digest.hexdigest() == snapshot['sha256']:
+        if args.verbose:
+            sys.stderr.write('%s is unchanged\n' % source_name)
+        snapshot['time'] = time.time()
+        save_snapshot(args.snapshot, snapshot)
+        sys.exit(UNCHANGED_EXIT_STATUS)
+
+    fobs = []
+    for facility, user in enabled_fobs(rows, source_name, args.verbose):
+        write_fob(facility, user)
+        fobs.append([facility, user])
+
+    if args.snapshot is not None:
+        save_snapshot(args.snapshot, {
+            'source': source,
+            'sha256': digest.hexdigest(),
+            'time': time.time(),
+            'fobs': fobs,
+        })
+
 
 if __name__ == '__main__':
     main()
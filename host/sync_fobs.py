@@ -0,0 +1,210 @@
+#!/usr/bin/env python3
+#
+# Makes the access controller's Wiegand-26 table hold exactly the enabled
+# fobs, with as few EEPROM writes as possible.  Reads fob numbers like
+# "123 12345" (facility and user separated by a space), one per line, from a
+# file or standard input, so the output of cat_enabled_fobs.py can be piped
+# straight in:
+#
+#   ./cat_enabled_fobs.py creds.json Fobs Sheet1 | ./sync_fobs.py --dry-run
+#
+# Slots that already hold a fob to keep are left alone.  New fobs go into the
+# slots of fobs that are no longer enabled first, then into empty slots, and
+# whatever stale slots are left are set to the zero credential.  When the
+# controller uses the hashed or grouped storage layout the plan is made of "a"
+# and "d" commands instead, since only the controller knows where a fob
+# belongs.  Adds go in ascending order, which a grouped table stores with the
+# fewest writes.
+#
+# Requires pySerial
+import logging
+import sys
+from argparse import ArgumentParser
+
+from access_controller import AccessController, Wiegand26Credential
+
+log_level_choices = ['CRITICAL', 'ERROR', 'WARNING', 'INFO', 'DEBUG']
+
+ZERO_CREDENTIAL = Wiegand26Credential(facility=0, user=0)
+ERASED_CREDENTIAL = Wiegand26Credential(facility=255, user=65535)
+TOMBSTONE_CREDENTIAL = Wiegand26Credential(facility=0, user=65535)
+
+# Values the controller uses to mark free slots.  They can't be stored.
+RESERVED_CREDENTIALS = {ZERO_CREDENTIAL, ERASED_CREDENTIAL, TOMBSTONE_CREDENTIAL}
+
+
+def read_fobs(lines):
+    """
+    Parses fob numbers, one "<facility> <user>" per line.  Blank lines are
+    skipped.
+
+    :return: the set of Wiegand26Credentials
+    :raises ValueError: if a line can't be parsed or is out of range
+    """
+    fobs = set()
+    for number, line in enumerate(lines, 1):
+        fields = line.split()
+        if not fields:
+            continue
+        if len(fields) != 2:
+            raise ValueError('line %d: expected "<facility> <user>": %r'
+                             % (number, line))
+        facility, user = int(fields[0]), int(fields[1])
+        if not 0 <= facility <= 255 or not 0 <= user <= 65535:
+            raise ValueError('line %d: fob number out of range: %r'
+                             % (number, line))
+        fobs.add(Wiegand26Credential(facility=facility, user=user))
+    return fobs
+
+
+def plan_flat_sync(current, desired):
+    """
+    Plans index writes that make a flat table hold exactly the desired fobs.
+
+    :param current: the stored credentials, indexed by slot
+    :param desired: the set of credentials to store
+    :return: a list of (index, old_credential, new_credential) writes
+    :raises ValueError: if the desired fobs don't fit in the table
+    """
+    kept = set()
+    stale = []
+    empty = []
+    for index, credential in enumerate(current):
+        if credential in RESERVED_CREDENTIALS:
+            empty.append(index)
+        elif credential in desired and credential not in kept:
+            kept.add(credential)
+        else:
+            # No longer enabled, or a duplicate of a kept slot
+            stale.append(index)
+
+    missing = sorted(desired - kept)
+    free = stale + empty
+    if len(missing) > len(free):
+        raise ValueError('%d fobs do not fit in a table of %d'
+                         % (len(desired), len(current)))
+
+    writes = []
+    for index, credential in zip(free, missing):
+        writes.append((index, current[index], credential))
+    for index in stale[len(missing):]:
+        writes.append((index, current[index], ZERO_CREDENTIAL))
+    return sorted(writes)
+
+
+def plan_hashed_sync(current, desired):
+    """
+    Plans deletes and adds that make a hashed or grouped table hold exactly
+    the desired fobs.  Deletes come first so their slots can be reused, and
+    adds are in ascending order.
+
+    :param current: the stored credentials, indexed by slot
+    :param desired: the set of credentials to store
+    :return: a list of ('d' or 'a', credential) commands
+    """
+    stored = set(current) - RESERVED_CREDENTIALS
+    commands = [('d', c) for c in sorted(stored - desired)]
+    commands += [('a', c) for c in sorted(desired - stored)]
+    return commands
+
+
+def main():
+    parser = ArgumentParser(
+        description='Store exactly the enabled fobs in the Dorbo Access '
+                    'Controller, writing only the slots that change')
+
+    parser.add_argument('--log-level', help='sets the log level',
+                        choices=log_level_choices, dest='log_level',
+                        default='INFO')
+    parser.add_argument('-d', '--device',
+                        help='the serial device to use to communicate with the '
+                             'controller',
+                        default='/dev/ttyACM0')
+    parser.add_argument('-s', '--speed',
+                        help='the speed (bytes/second) to use to communicate '
+                             'with the controller',
+                        default='115200')
+    parser.add_argument('-n', '--dry-run',
+                        help='print the plan without changing the controller',
+                        action='store_true', dest='dry_run')
+    parser.add_argument('fobs_file',
+                        metavar='fobs-file', nargs='?',
+                        help='file of enabled fobs, one "<facility> <user>" '
+                             'per line (default: standard input)')
+
+    args = parser.parse_args()
+
+    logging.basicConfig(level=args.log_level)
+    device = args.device
+    try:
+        speed = int(args.speed)
+    except ValueError:
+        print('Speed %s is not an integer' % args.speed)
+        sys.exit(1)
+
+    try:
+        if args.fobs_file:
+            with open(args.fobs_file) as f:
+                desired = read_fobs(f)
+        else:
+            desired = read_fobs(sys.stdin)
+    except (IOError, ValueError) as e:
+        sys.stderr.write('Error reading fobs: %s\n' % e)
+        sys.exit(2)
+
+    reserved = desired & RESERVED_CREDENTIALS
+    for credential in sorted(reserved):
+        sys.stderr.write('Ignoring reserved fob number: %d %d\n'
+                         % (credential.facility, credential.user))
+    desired -= reserved
+
+    with AccessController(device, speed) as ac:
+        info = ac.get_storage_info().get('w26')
+        current = ac.list_wiegand26()
+        hashed = info is not None and info.layout in ('hash', 'group')
+
+        if hashed:
+            plan = plan_hashed_sync(current, desired)
+            for command, credential in plan:
+                print('%s w26 %d %d'
+                      % (command, credential.facility, credential.user))
+        else:
+            try:
+                plan = plan_flat_sync(current, desired)
+            except ValueError as e:
+                sys.stderr.write('Error: %s\n' % e)
+                sys.exit(3)
+            for index, old, new in plan:
+                print('w w26 %d %d %d    (was %d %d)'
+                      % (index, new.facility, new.user, old.facility, old.user))
+
+        # A full rewrite writes every slot
+        print('%d writes, %d avoided'
+              % (len(plan), len(current) - len(plan)))
+
+        if args.dry_run:
+            return
+
+        # The commands don't depend on each other, so they can be pipelined.
+        # Deletes come before adds in a by-value plan, and a delete that fails
+        # only means the add after it can't reuse that slot.
+        if hashed:
+            commands = ['%s w26 %d %d' % (command, credential.facility,
+                                          credential.user)
+                        for command, credential in plan]
+        else:
+            commands = ['w w26 %d %d %d' % (index, new.facility, new.user)
+                        for index, old, new in plan]
+        failed = 0
+        results = ac.execute_pipelined(commands)
+        for command, (success, lines) in zip(commands, results):
+            if not success:
+                sys.stderr.write('Error: %s: %s\n'
+                                 % (command, ','.join(lines)))
+                failed += 1
+        if failed:
+            sys.exit(4)
+
+
+if __name__ == '__main__':
+    main()
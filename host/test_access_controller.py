@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+# Tests AccessController's handling of the controller's line protocol
+# against a scripted serial port.
+#
+#   ./test_access_controller.py
+#
+# pySerial is only needed to open real ports, so a stand-in module is used
+# when it isn't installed.
+import sys
+import types
+import unittest
+
+try:
+    import serial
+except ImportError:
+    sys.modules['serial'] = types.ModuleType('serial')
+
+from access_controller import AccessController, Wiegand26Credential
+
+
+class ScriptedSerial(object):
+    """
+    Answers each command written with the next scripted lines.
+    """
+
+    def __init__(self, responses):
+        self.responses = list(responses)
+        self.pending = []
+        self.written = []
+
+    def write(self, data):
+        self.written.append(data)
+        self.pending += [bytes(line + '\r\n', 'utf8')
+                         for line in self.responses.pop(0)]
+
+    def flush(self):
+        pass
+
+    def inWaiting(self):
+        return sum(len(line) for line in self.pending)
+
+    def readline(self):
+        return self.pending.pop(0) if self.pending else b''
+
+
+def controller_with(*responses):
+    events = []
+    controller = AccessController(
+        'unused', event_handler=lambda line, event: events.append(event))
+    controller.serial = ScriptedSerial(responses)
+    return controller, events
+
+
+class TestResponses(unittest.TestCase):
+
+    def test_trace_in_list(self):
+        controller, events = controller_with([
+            '0 103 26441',
+            '# wiegand_credential<format=0,facility=1,user=2>',
+            '!access 7 1 1000 0 w26 1 2 deny',
+            '# credential bad',
+            '1 0 0',
+            'ok'])
+        self.assertEqual(controller.list_wiegand26(),
+                         [Wiegand26Credential(103, 26441),
+                          Wiegand26Credential(0, 0)])
+        self.assertEqual([(event.seq, event.era, event.millis)
+                          for event in events], [(7, 1, 1000)])
+
+    def test_trace_before_add_reply(self):
+        controller, events = controller_with([
+            '# frame invalid',
+            '5 103 26441',
+            'ok'])
+        self.assertEqual(
+            controller.add_wiegand26(Wiegand26Credential(103, 26441)), 5)
+
+    def test_trace_before_delete_reply(self):
+        controller, events = controller_with([
+            '# credential good',
+            '5 103 26441',
+            'ok'])
+        self.assertEqual(
+            controller.delete_wiegand26(Wiegand26Credential(103, 26441)), 5)
+
+    def test_poll_skips_traces(self):
+        controller, events = controller_with(['# credential good', 'ok'])
+        controller.serial.write(b'\n')
+        controller.poll_events()
+        self.assertEqual(events, [])
+
+
+if __name__ == '__main__':
+    unittest.main()